@@ -1,6 +1,7 @@
 #include "interface.h"
 #include "precomp.h"
 
+#include "src/math/lerp.h"
 #include "src/math/random.h"
 #include "src/world/layer.h"
 
@@ -123,6 +124,7 @@ bool ParameterCurveEditor(Layer& layer)
 		ImVec2 relative = ImVec2((mouse.x - cursorFirstScreen.x) / (ImGui::GetItemRectSize().x - ImGui::CalcTextSize("Amplitude").x),
 								 (mouse.y - cursorFirstScreen.y) / ImGui::GetItemRectSize().y);
 		layer.points[held] = 1.0f - relative.y;
+		BuildCurve(layer);
 	}
 
 	if (held != -1 && ImGui::IsMouseReleased(ImGuiMouseButton_Left))
@@ -219,3 +221,47 @@ bool LayerParameter(Layer& layer)
 
 	return dirty;
 };
+
+void ProfilerPanel()
+{
+	Profiler& profiler = Profiler::GetProfiler();
+
+	if (ImGui::BeginTable("Stages", 4, ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingStretchProp))
+	{
+		ImGui::TableSetupColumn("Stage");
+		ImGui::TableSetupColumn("Last (ms)");
+		ImGui::TableSetupColumn("Average (ms)");
+		ImGui::TableSetupColumn("History");
+		ImGui::TableHeadersRow();
+
+		for (const Profiler::Stage& stage : profiler.GetStages())
+		{
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn();
+			ImGui::TextUnformatted(stage.name);
+			ImGui::TableNextColumn();
+			ImGui::Text("%.2f", stage.last);
+			ImGui::TableNextColumn();
+			ImGui::Text("%.2f", stage.average);
+			ImGui::TableNextColumn();
+			ImGui::PushID(stage.name);
+			ImGui::PlotLines("", stage.history, min<int>(stage.samples, Profiler::HISTORY),
+				stage.samples > Profiler::HISTORY ? stage.samples % Profiler::HISTORY : 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 16));
+			ImGui::PopID();
+		}
+
+		ImGui::EndTable();
+	}
+
+	if (ImGui::Button("Export trace"))
+	{
+		profiler.ExportTrace("trace.json");
+	}
+
+	ImGui::SameLine();
+
+	if (ImGui::Button("Export CSV"))
+	{
+		profiler.ExportCSV("trace.csv");
+	}
+}
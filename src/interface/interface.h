@@ -6,4 +6,5 @@ void SetParameters(Layer& layer);
 bool ParameterSliderInt(const char* label, int& value, int min, int max);
 bool ParameterSliderFloat(const char* label, float& value, float min, float max);
 bool ParameterCurveEditor(Layer& layer);
-bool LayerParameter(Layer& layer);
\ No newline at end of file
+bool LayerParameter(Layer& layer);
+void ProfilerPanel();
@@ -2,7 +2,7 @@
 
 #include "src/world/layer.h"
 
-float LerpPoints(const Layer& layer, const float x)
+inline float LerpPoints(const Layer& layer, const float x)
 {
 	const std::array<float, 20>& points = layer.points;
 	size_t lower = 0, upper = 19;
@@ -22,7 +22,29 @@ float LerpPoints(const Layer& layer, const float x)
 	return std::lerp(points[lower], points[upper], t);
 }
 
-uint16_t LerpColors(const uint16_t a, const uint16_t b, const float t)
+// Tabulates LerpPoints over [0, 1], call whenever points change.
+inline void BuildCurve(Layer& layer)
+{
+	for (int i = 0; i <= Layer::CURVESAMPLES; i++)
+	{
+		layer.curve[i] = LerpPoints(layer, i / static_cast<float>(Layer::CURVESAMPLES));
+	}
+}
+
+// Table lookup equivalent of LerpPoints, falls back outside [0, 1].
+inline float SampleCurve(const Layer& layer, const float x)
+{
+	if (!(x >= 0.0f && x <= 1.0f))
+	{
+		return LerpPoints(layer, x);
+	}
+
+	const float f = x * Layer::CURVESAMPLES;
+	const int i = std::min(static_cast<int>(f), Layer::CURVESAMPLES - 1);
+	return std::lerp(layer.curve[i], layer.curve[i + 1], f - i);
+}
+
+inline uint16_t LerpColors(const uint16_t a, const uint16_t b, const float t)
 {
 	uint16_t ra = (a >> 8);
 	uint16_t rb = (b >> 8);
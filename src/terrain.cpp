@@ -1,8 +1,10 @@
 #include "precomp.h"
 #include "terrain.h"
-#include "math/lerp.h"
-#include "world/biome.h"
-#include "math/random.h"
+#include "world/preset.h"
+#include "tools/batch.h"
+#include "tools/bench.h"
+#include "tools/export.h"
+#include "tools/render.h"
 #include "interface/interface.h"
 
 #include "imgui.h"
@@ -12,11 +14,37 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
+#include <filesystem>
+
 #include <cmath>
-#include <chrono>
 
 Game* CreateGame() { return new Terrain(); }
 
+int RunCommandLine(int argc, char* argv[])
+{
+	if (argc > 1 && !strcmp(argv[1], "--batch"))
+	{
+		return RunBatch(argc - 2, argv + 2);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "--bench"))
+	{
+		return RunBench(argc - 2, argv + 2);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "--export"))
+	{
+		return RunExport(argc - 2, argv + 2);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "--render"))
+	{
+		return RunRender(argc - 2, argv + 2);
+	}
+
+	return -1;
+}
+
 void Terrain::Init()
 {
 	skyDomeLightScale = 6.0f;
@@ -33,18 +61,18 @@ void Terrain::Init()
 		fclose(f);
 	}
 
-	f = fopen("layer.dat", "rb");
-	if (f)
+	LoadPreset("layer.dat", layers);
+
+	// Regenerated terrain leaves many uniform bricks; turn them into solid cells before each commit
+	GetWorld()->SetOptimizeOnCommit(true);
+
+	// Resume the previous session's world if it was generated from the same settings
+	std::vector<uint8_t> saved(sizeof(Columns) + sizeof(voxels));
+	if (GetWorld()->LoadSnapshotFile("world.snap", WorldCache::Hash(layers, parameters), saved.data(), saved.size()))
 	{
-		fread(&continentalness, 1, sizeof(continentalness), f);
-		fread(&erosion, 1, sizeof(erosion), f);
-		fread(&peaks, 1, sizeof(peaks), f);
-		fread(&temperature, 1, sizeof(temperature), f);
-		fread(&humidity, 1, sizeof(humidity), f);
-		fread(&contdensity, 1, sizeof(contdensity), f);
-		fread(&density, 1, sizeof(density), f);
-		fread(&peakdensity, 1, sizeof(peakdensity), f);
-		fclose(f);
+		memcpy(world, saved.data(), sizeof(Columns));
+		memcpy(&voxels, saved.data() + sizeof(Columns), sizeof(voxels));
+		parameters.dirty = false;
 	}
 
 	// Load spline path
@@ -163,110 +191,52 @@ void Terrain::HandleInterface()
 	ImGui_ImplGlfw_NewFrame();
 	ImGui::NewFrame();
 
-	ImGui::Text("Voxels (%.2f mv)		Delay (%lld ms)", voxels / 1000000.0f, delay);
+	ImGui::Text("Voxels (%.2f mv)		Delay (%.1f ms)", voxels / 1000000.0f, Profiler::GetProfiler().GetLast("Regenerate"));
+	ImGui::Text("Sync (%u bricks queued, %u per frame, %.2f s left)", GetWorld()->GetCommitBacklog(),
+		GetWorld()->GetCommitBudget(), GetWorld()->GetSyncEstimate());
 
 	parameters.dirty |= ImGui::RadioButton("2D", &parameters.dimension, 0);
 	ImGui::SameLine();
 	parameters.dirty |= ImGui::RadioButton("3D", &parameters.dimension, 1);
+	ImGui::SameLine();
+
+	if (ImGui::Checkbox("Heightfield preview", &heightfieldPreview))
+	{
+		// The preview is drawn into the screen surface instead of ray traced;
+		// switching it off regenerates, which voxelizes the current settings
+		Game::autoRendering = !heightfieldPreview;
+		parameters.dirty = true;
+	}
 
 	parameters.dirty |= ImGui::Checkbox("Color blend", &parameters.blend);
 	parameters.dirty |= ImGui::Checkbox("Water fill", &parameters.waterFill);
 	parameters.dirty |= ImGui::Checkbox("Water erosion", &parameters.waterErosion);
 	parameters.dirty |= ImGui::Checkbox("Cave inverted", &parameters.caveInverted);
 
-	std::vector<const char*> items =
-	{
-		"Default", "Grassland", "Desert", "Ocean"
-	};
+	ImGui::Checkbox("Diff update", &diffUpdate);
+	ImGui::SameLine();
+	ImGui::Text("(%u bricks changed)", changedBricks);
 
-	if (parameters.dirty |= ImGui::Combo("Preset",
-		&parameters.presetIndex, items.data(),
-		static_cast<int>(items.size())))
+	if (ImGui::Checkbox("Spill cache to disk", &spillCache))
 	{
-		switch (parameters.presetIndex)
-		{
-			FILE* f;
-
-			case 0:
-			{
-				f = fopen("layer_default.dat", "rb");
-
-				if (f)
-				{
-					fread(&continentalness, 1, sizeof(continentalness), f);
-					fread(&erosion, 1, sizeof(erosion), f);
-					fread(&peaks, 1, sizeof(peaks), f);
-					fread(&temperature, 1, sizeof(temperature), f);
-					fread(&humidity, 1, sizeof(humidity), f);
-					fread(&contdensity, 1, sizeof(contdensity), f);
-					fread(&density, 1, sizeof(density), f);
-					fread(&peakdensity, 1, sizeof(peakdensity), f);
-					fclose(f);
-				}
-
-				break;
-			}
-
-			case 1:
-			{
-				f = fopen("layer_grassland.dat", "rb");
-
-				if (f)
-				{
-					fread(&continentalness, 1, sizeof(continentalness), f);
-					fread(&erosion, 1, sizeof(erosion), f);
-					fread(&peaks, 1, sizeof(peaks), f);
-					fread(&temperature, 1, sizeof(temperature), f);
-					fread(&humidity, 1, sizeof(humidity), f);
-					fread(&contdensity, 1, sizeof(contdensity), f);
-					fread(&density, 1, sizeof(density), f);
-					fread(&peakdensity, 1, sizeof(peakdensity), f);
-					fclose(f);
-				}
-
-				break;
-			}
-
-			case 2:
-			{
-				f = fopen("layer_desert.dat", "rb");
-
-				if (f)
-				{
-					fread(&continentalness, 1, sizeof(continentalness), f);
-					fread(&erosion, 1, sizeof(erosion), f);
-					fread(&peaks, 1, sizeof(peaks), f);
-					fread(&temperature, 1, sizeof(temperature), f);
-					fread(&humidity, 1, sizeof(humidity), f);
-					fread(&contdensity, 1, sizeof(contdensity), f);
-					fread(&density, 1, sizeof(density), f);
-					fread(&peakdensity, 1, sizeof(peakdensity), f);
-					fclose(f);
-				}
+		cache.SetSpillDirectory(spillCache ? "cache" : "");
+	}
 
-				break;
-			}
+	ImGui::SameLine();
+	ImGui::Text("(%zu worlds, %.0f MB)", cache.GetCount(), cache.GetBytes() / 1048576.0f);
 
-			case 3:
-			{
-				f = fopen("layer_ocean.dat", "rb");
+	std::vector<const char*> items;
 
-				if (f)
-				{
-					fread(&continentalness, 1, sizeof(continentalness), f);
-					fread(&erosion, 1, sizeof(erosion), f);
-					fread(&peaks, 1, sizeof(peaks), f);
-					fread(&temperature, 1, sizeof(temperature), f);
-					fread(&humidity, 1, sizeof(humidity), f);
-					fread(&contdensity, 1, sizeof(contdensity), f);
-					fread(&density, 1, sizeof(density), f);
-					fread(&peakdensity, 1, sizeof(peakdensity), f);
-					fclose(f);
-				}
+	for (const Preset& preset : presets)
+	{
+		items.push_back(preset.name);
+	}
 
-				break;
-			}
-		}
+	if (parameters.dirty |= ImGui::Combo("Preset",
+		&parameters.presetIndex, items.data(),
+		static_cast<int>(items.size())))
+	{
+		LoadPreset(presets[parameters.presetIndex].path, layers);
 	}
 
 	items =
@@ -292,7 +262,7 @@ void Terrain::HandleInterface()
 		{
 			if (ImGui::TreeNode("Noise"))
 			{
-				parameters.dirty |= LayerParameter(continentalness);
+				parameters.dirty |= LayerParameter(layers.continentalness);
 				ImGui::TreePop();
 			}
 
@@ -303,7 +273,7 @@ void Terrain::HandleInterface()
 		{
 			if (ImGui::TreeNode("Noise"))
 			{
-				parameters.dirty |= LayerParameter(erosion);
+				parameters.dirty |= LayerParameter(layers.erosion);
 				ImGui::TreePop();
 			}
 
@@ -321,7 +291,7 @@ void Terrain::HandleInterface()
 		{
 			if (ImGui::TreeNode("Noise"))
 			{
-				parameters.dirty |= LayerParameter(peaks);
+				parameters.dirty |= LayerParameter(layers.peaks);
 				ImGui::TreePop();
 			}
 
@@ -336,7 +306,7 @@ void Terrain::HandleInterface()
 		{
 			if (ImGui::TreeNode("Noise"))
 			{
-				parameters.dirty |= LayerParameter(humidity);
+				parameters.dirty |= LayerParameter(layers.humidity);
 				ImGui::TreePop();
 			}
 
@@ -351,7 +321,7 @@ void Terrain::HandleInterface()
 		{
 			if (ImGui::TreeNode("Noise"))
 			{
-				parameters.dirty |= LayerParameter(contdensity);
+				parameters.dirty |= LayerParameter(layers.contdensity);
 				ImGui::TreePop();
 			}
 
@@ -362,7 +332,7 @@ void Terrain::HandleInterface()
 		{
 			if (ImGui::TreeNode("Noise"))
 			{
-				parameters.dirty |= LayerParameter(density);
+				parameters.dirty |= LayerParameter(layers.density);
 				ImGui::TreePop();
 			}
 
@@ -373,7 +343,7 @@ void Terrain::HandleInterface()
 		{
 			if (ImGui::TreeNode("Noise"))
 			{
-				parameters.dirty |= LayerParameter(peakdensity);
+				parameters.dirty |= LayerParameter(layers.peakdensity);
 				ImGui::TreePop();
 			}
 
@@ -383,96 +353,138 @@ void Terrain::HandleInterface()
 		ImGui::TreePop();
 	}
 
-	ImGui::Render();
-	ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
-}
+	if (ImGui::TreeNode("Export"))
+	{
+		const char* formats[] = { "16-bit png", "Raw float", "Tiled 16-bit png" };
+		int format = static_cast<int>(exportSettings.format);
 
-void static Generate(const Columns* world, const Layer& contdensity, const Layer& density, const Layer& peakdensity, const Parameters& parameters, const int thread)
-{
-	int section = parameters.terrainScaleX / THREAD_LIMIT;
-	int start = thread * section;
-	int end = start + section;
+		if (ImGui::Combo("Format", &format, formats, IM_ARRAYSIZE(formats)))
+		{
+			exportSettings.format = static_cast<ExportFormat>(format);
+		}
 
-	for (int x = start; x < end; x++)
-	{
-		for (int z = 0; z < parameters.terrainScaleZ; z++)
+		ImGui::CheckboxFlags("Height", &exportSettings.planes, EXPORT_HEIGHT);
+		ImGui::SameLine();
+		ImGui::CheckboxFlags("Biome", &exportSettings.planes, EXPORT_BIOME);
+		ImGui::SameLine();
+		ImGui::CheckboxFlags("Color", &exportSettings.planes, EXPORT_COLOR);
+
+		if (exportSettings.format == ExportFormat::TiledPng16)
 		{
-			const Column& column = (*world)[x][z];
-			const uint8_t level = column.level;
+			ImGui::SliderInt("Tile size", &exportSettings.tileSize, 64, 1024);
+		}
 
-			const uint16_t water = (0x006 + (static_cast<int>(0x006 * level / 60.0f) << 4));
-			uint16_t color = (level < 61 && parameters.dimension) ? water : colors[column.biome];
+		if (ImGui::Button("Export") && !exporter.IsBusy())
+		{
+			exportSettings.width = parameters.terrainScaleZ;
+			exportSettings.height = parameters.terrainScaleX;
+			exporter.Submit(*world, "export/world_" + std::to_string(time(nullptr)) + "_" + std::to_string(exports++), exportSettings);
+		}
 
-			if (parameters.blend)
-			{
-				uint16_t nearby = LerpColors
-				(
-					LerpColors(colors[(*world)[max(x - 4, 0)][z].biome], colors[(*world)[min(x + 4, 1023)][z].biome], 0.5f),
-					LerpColors(colors[(*world)[x][max(z - 4, 0)].biome], colors[(*world)[x][min(z + 4, 1023)].biome], 0.5f),
-					0.5f
-				);
-
-				color = LerpColors(nearby, color, 0.5f);
-			}
+		ImGui::SameLine();
 
-			if (parameters.layerIndex)
-			{
-				int f = max(static_cast<int>(0x00f * level / 60.0f), 0x001);
-				color = (f << 8) | (f << 4) | f;
-			}
+		if (exporter.IsBusy())
+		{
+			ImGui::Text("Exporting...");
+		}
+		else if (exports)
+		{
+			ImGui::Text(exporter.GetLastResult() ? "Exported (%.1f ms)" : "Export failed", exporter.GetLastMilliseconds());
+		}
 
-			const float fx = static_cast<float>(x + 0),
-				fz = static_cast<float>(z + 0);
-			float contdensityNoise =
-				LerpPoints(contdensity, (contdensity.noise.GetNoise(fx, fz) + 1.0f) / 2.0f) * contdensity.noise.GetNoise(fx, fz);
-			float peakdensityNoise =
-				LerpPoints(peakdensity, (peakdensity.noise.GetNoise(fx, fz) + 1.0f) / 2.0f) * peakdensity.noise.GetNoise(fx, fz);
+		ImGui::InputInt3("Region min", &regionPos.x);
+		ImGui::InputInt3("Region size", &regionSize.x);
 
-			if (parameters.waterFill&& level < 61)
+		for (const char* extension : { ".vx", ".vox" })
+		{
+			if (ImGui::Button((std::string("Export region ") + extension).c_str()))
 			{
-				for (int y = 60; y > parameters.dimension ? level : 0; y--)
-				{
-					Plot(x, y, z, color);
-				}
+				const std::string path = "export/region_" + std::to_string(time(nullptr)) + extension;
+				std::error_code error;
+				std::filesystem::create_directories("export", error);
+				Timer timer;
+				regionResult = GetWorld()->ExportRegion(path.c_str(), regionPos, regionSize);
+				regionMilliseconds = timer.elapsed() * 1000.0f;
+				regionExported = true;
 			}
 
-			for (int y = parameters.dimension ? level : 0; y > -1; y--)
-			{
-				float fy = static_cast<float>(y);
+			ImGui::SameLine();
+		}
 
-				bool bounds = y < 40 + peakdensityNoise * 4.0f &&
-					y > 36 + peakdensityNoise * 4.0f;
-				bool noodle = abs(contdensityNoise * 10.0f +
-					density.noise.GetNoise(fx, fy, fz) * 5.0f +
-					peakdensity.noise.GetNoise(fx, fy, fz)) < 0.5f;
+		if (regionExported)
+		{
+			ImGui::Text(regionResult ? "Exported (%.1f ms)" : "Export failed", regionMilliseconds);
+		}
+		else
+		{
+			ImGui::NewLine();
+		}
 
-				/*if (parameters.dimension && y < level - 1)
-				{
-					color = colors[13];
-				}
+		if (ImGui::Checkbox("Map tiles", &mapTiles) && mapTiles)
+		{
+			mapTilesWritten = pyramid.Update(*world);
+		}
 
-				if (parameters.dimension && y < level - (density.noise.GetNoise(fx, fz) + 1.0f) * 8.0f)
-				{
-					color = colors[14];
-				}*/
+		ImGui::SameLine();
+		ImGui::Text("(%i tiles written, %.1f ms)", mapTilesWritten, Profiler::GetProfiler().GetLast("Tile pyramid"));
 
-				if (level > 60 && bounds && noodle)
-				{
-					if (parameters.caveInverted)
-					{
-						Plot(x, y, z, color);
-					}
+		ImGui::TreePop();
+	}
 
-					continue;
-				}
+	if (ImGui::TreeNode("Bricks"))
+	{
+		const BrickStats stats = GetWorld()->GetBrickStats();
+		ImGui::Text("In use %u (%u shared), cached %u, free %u", stats.inUse, stats.shared, stats.cached, stats.free);
+		ImGui::Text("Peak %u (%.1f%% of the pool)", stats.peak, stats.peak * 100.0f / BRICKCOUNT);
+		ImGui::Text("Store %.1f MB committed, peak %.1f MB", stats.committed / 1048576.0f, stats.peakCommitted / 1048576.0f);
+		ImGui::Text("Magazine refills %llu, flushes %llu", static_cast<unsigned long long>(stats.refills),
+			static_cast<unsigned long long>(stats.flushes));
 
-				if (!parameters.caveInverted)
-				{
-					Plot(x, y, z, color);
-				}
-			}
+		bool optimizeOnCommit = GetWorld()->GetOptimizeOnCommit();
+
+		if (ImGui::Checkbox("Optimize on commit", &optimizeOnCommit))
+		{
+			GetWorld()->SetOptimizeOnCommit(optimizeOnCommit);
+		}
+
+		ImGui::SameLine();
+		ImGui::Text("(%.1f ms)", Profiler::GetProfiler().GetLast("OptimizeBricks"));
+
+		if (ImGui::Button("Dedup"))
+		{
+			GetWorld()->DedupBricks();
+		}
+
+		ImGui::SameLine();
+		bool dedupOnWrite = GetWorld()->GetDedupOnWrite();
+
+		if (ImGui::Checkbox("Dedup on write", &dedupOnWrite))
+		{
+			GetWorld()->SetDedupOnWrite(dedupOnWrite);
+		}
+
+		ImGui::SameLine();
+		ImGui::Text("(%.1f ms)", Profiler::GetProfiler().GetLast("Dedup bricks"));
+
+		if (ImGui::Button("Pack"))
+		{
+			GetWorld()->PackBricks();
 		}
+
+		ImGui::SameLine();
+		ImGui::Text("%u packed in %.1f MB (%.1f ms)", stats.packed, stats.packedBytes / 1048576.0f,
+			Profiler::GetProfiler().GetLast("Pack bricks"));
+		ImGui::TreePop();
+	}
+
+	if (ImGui::TreeNode("Profiler"))
+	{
+		ProfilerPanel();
+		ImGui::TreePop();
 	}
+
+	ImGui::Render();
+	ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 }
 
 void Terrain::Tick(float deltaTime)
@@ -480,181 +492,108 @@ void Terrain::Tick(float deltaTime)
 	static size_t ticks = 0;
 	HandleInput(deltaTime);
 
-	const std::array<Layer, 7> layers =
+	// Heightmap only, the tracer shows the columns before voxelization
+	if (parameters.dirty && heightfieldPreview)
 	{
-		continentalness,
-		erosion,
-		peaks,
-		humidity,
-		contdensity,
-		density,
-		peakdensity
-	};
+		PROFILE_SCOPE("Regenerate");
+
+		SetParameters(layers);
+		voxels = GenerateHeightmap(world, layers, parameters);
+		ErodeHeightmap(world, layers, parameters);
+		tracer.Build(*world);
+
+		parameters.dirty = false;
+	}
+
+	if (heightfieldPreview)
+	{
+		tracer.Render(GetWorld()->GetCameraMatrix(), screen->buffer, screen->width, screen->height, true);
+	}
 
 	// Gather noise data
 	if (parameters.dirty)
 	{
-		SetParameters(continentalness);
-		SetParameters(erosion);
-		SetParameters(peaks);
-		SetParameters(humidity);
-		SetParameters(contdensity);
-		SetParameters(density);
-		SetParameters(peakdensity);
-
-		voxels = 0;
-		ClearWorld();
-		auto start = std::chrono::system_clock::now();
-
-		for (int x = 0; x < 1024; x++)
-		{
-			for (int z = 0; z < 1024; z++)
-			{
-				float fx = static_cast<float>(x + parameters.terrainOffsetX),
-					fz = static_cast<float>(z + parameters.terrainOffsetZ);
+		PROFILE_SCOPE("Regenerate");
 
-				float continentalnessNoise =
-					LerpPoints(continentalness, (continentalness.noise.GetNoise(fx, fz) + 1.0f) / 2.0f) * continentalness.noise.GetNoise(fx, fz);
-				float erosionNoise =
-					LerpPoints(erosion, (erosion.noise.GetNoise(fx, fz) + 1.0f) / 2.0f) * erosion.noise.GetNoise(fx, fz);
-				float peaksNoise =
-					LerpPoints(peaks, (peaks.noise.GetNoise(fx, fz) + 1.0f) / 2.0f) * peaks.noise.GetNoise(fx, fz);
+		{
+			PROFILE_SCOPE("SetParameters");
+			SetParameters(layers);
+		}
 
-				float elevationNoise = clamp(((continentalnessNoise * 200.0f +
-					(peaksNoise + 0.3f) * 40.0f) * erosionNoise + 120.0f) / 2.0f, 0.0f, 240.0f);
-				float humidityNoise =
-					0.1f * powf(2, -10.0f * powf(x / 512.0f - 1.0f, 2.0f)) +
-					humidity.noise.GetNoise(fx, fz);
+		const uint64_t key = WorldCache::Hash(layers, parameters);
+		bool cached = false;
 
-				const uint8_t biome = BiomeFunction(elevationNoise / 60.0f - 1.0f, humidityNoise);
+		{
+			PROFILE_SCOPE("Cache restore");
+			cached = cache.Restore(key, world, GetWorld(), voxels);
+		}
 
-				uint8_t level = static_cast<uint8_t>(elevationNoise);
-				level = parameters.layerIndex ?
-					static_cast<uint8_t>((layers[parameters.layerIndex - 1].
-						noise.GetNoise(fx, fz) + 1.0f) * 30.0f) : level;
+		if (!cached)
+		{
+			if (diffUpdate)
+			{
+				GetWorld()->BeginUpdate();
+			}
+			else
+			{
+				ClearWorld();
+			}
 
-				// Not entirely accurate, but way easier.
-				voxels += level;
+			{
+				PROFILE_SCOPE("Heightmap");
+				voxels = GenerateHeightmap(world, layers, parameters);
+			}
 
-				(*world)[x][z] =
-				{
-					level,
-					biome
-				};
+			{
+				PROFILE_SCOPE("Erosion");
+				ErodeHeightmap(world, layers, parameters);
 			}
-		}
 
-		for (int iteration = 0; iteration < parameters.erosionIterations; iteration++)
-		{
-next:
-			constexpr float scale = 1.0f;
-			std::array<std::pair<int, int>, 128> steps;
-
-			// Start location
-			float rx = urandom() % parameters.terrainScaleX,
-				rz = urandom() % parameters.terrainScaleZ;
-			float vx = (random() % 10) / 1000.0f,
-				vz = (random() % 10) / 1000.0f;
-			float stolen = 0;
-
-			for (int step = 0; step < 128; step++)
 			{
-				for (int x = -1; x < 2; x++)
-				{
-					// Out-of-bound check
-					if (((int)rx + x) < 0 || ((int)rx + x) > parameters.terrainScaleX - 1)
-					{
-						continue;
-					}
-
-					for (int z = -1; z < 2; z++)
-					{
-						// Out-of-bound check
-						if (((int)rz + z) < 0 || ((int)rz + z) > parameters.terrainScaleX - 1)
-						{
-							continue;
-						}
-
-						vx += x * (255 - (*world)[rx + x][rz + z].level) / 255.0f;
-						vz += z * (255 - (*world)[rx + x][rz + z].level) / 255.0f;
-					}
-				}
+				PROFILE_SCOPE("Voxels");
+
+#ifdef MULTI_THREADING
+				std::vector<std::thread> threads;
 
-				// Out-of-bound check
-				if ((int)(rx + vx * scale) < 0 || (int)(rx + vx * scale) > parameters.terrainScaleX - 1 ||
-					(int)(rz + vz * scale) < 0 || (int)(rz + vz * scale) > parameters.terrainScaleX - 1)
+				while (threads.size() < THREAD_LIMIT)
 				{
-					break;
+					threads.emplace_back(Generate, GetWorld(), world, std::cref(layers),
+						std::cref(parameters), static_cast<int>(threads.size()));
 				}
 
-				/*if ((*world)[(int)rx][(int)rz].biome != 12)
+				for (auto& thread : threads)
 				{
-					int delta = (*world)[(int)(rx + vx * scale)][(int)(rz + vz * scale)].level - (*world)[(int)rx][(int)rz].level;
-					(*world)[(int)rx][(int)rz].level += delta;
-				}*/
-
-				int delta = (*world)[(int)(rx + vx * scale)][(int)(rz + vz * scale)].level - (*world)[(int)rx][(int)rz].level;
-				if (delta < 0 && (*world)[(int)rx][(int)rz].biome != 12)
+					thread.join();
+				}
+#else
+				for (int thread = 0; thread < THREAD_LIMIT; thread++)
 				{
-					uint8_t level = (*world)[(int)(rx + vx * scale)][(int)(rz + vz * scale)].level;
-					(*world)[(int)rx][(int)rz].level = level;
-
-					/*for (int x = -2; x < 3; x++)
-					{
-						// Out-of-bound check
-						if (((int)rx + x) < 0 || ((int)rx + x) > parameters.terrainScaleX - 1)
-						{
-							continue;
-						}
-
-						for (int z = -2; z < 3; z++)
-						{
-							// Out-of-bound check
-							if (((int)rz + z) < 0 || ((int)rz + z) > parameters.terrainScaleX - 1)
-							{
-								continue;
-							}
-
-							(*world)[(int)rx + x][(int)rz + z].level = level;
-						}
-					}*/
-
-					// (*world)[(int)rx][(int)rz].level = (*world)[(int)(rx + vx * scale)][(int)(rz + vz * scale)].level;
-					// (*world)[(int)rx][(int)rz].level += delta;
+					// Threads are not used here,
+					// they are faked so the function can be re-used.
+					Generate(GetWorld(), world, layers, parameters, thread);
 				}
-				
-				// Take step, move with velocity.
-				rx += vx * scale; rz += vz * scale;
+#endif
 			}
-		}
-
 
-#ifdef MULTI_THREADING
-		std::vector<std::thread> threads;
+			if (diffUpdate)
+			{
+				PROFILE_SCOPE("Diff");
+				changedBricks = GetWorld()->EndUpdate();
+			}
+			else
+			{
+				changedBricks = GetWorld()->GetDirtyBrickCount();
+			}
 
-		while (threads.size() < THREAD_LIMIT)
-		{
-			threads.emplace_back(Generate, world, contdensity, density, peakdensity,
-				parameters, static_cast<int>(threads.size()));
+			PROFILE_SCOPE("Cache store");
+			cache.Store(key, world, GetWorld(), voxels);
 		}
 
-		for (auto& thread : threads)
-		{
-			thread.join();
-		}
-#else
-		for (int thread = 0; thread < THREAD_LIMIT; thread++)
+		if (mapTiles)
 		{
-			// Threads are not used here,
-			// they are faked so the function can be re-used.
-			Generate(world, contdensity, density, peakdensity, parameters, thread);
+			mapTilesWritten = pyramid.Update(*world);
 		}
-#endif
 
-		auto end = std::chrono::system_clock::now();
-		auto elapsed = duration_cast
-			<std::chrono::milliseconds>(end - start);
-		delay = elapsed.count();
 		parameters.dirty = false;
 	}
 
@@ -675,59 +614,29 @@ void Terrain::Shutdown()
 {
 	FILE* f;
 
-	f = fopen("layer.dat", "wb");
-	fwrite(&continentalness, 1, sizeof(continentalness), f);
-	fwrite(&erosion, 1, sizeof(erosion), f);
-	fwrite(&peaks, 1, sizeof(peaks), f);
-	fwrite(&temperature, 1, sizeof(temperature), f);
-	fwrite(&humidity, 1, sizeof(humidity), f);
-	fwrite(&contdensity, 1, sizeof(contdensity), f);
-	fwrite(&density, 1, sizeof(density), f);
-	fwrite(&peakdensity, 1, sizeof(peakdensity), f);
-	fclose(f);
+	SavePreset("layer.dat", layers);
 
 	f = fopen("camera.dat", "wb");
 	fwrite(&cameraDirection, 1, sizeof(cameraDirection), f);
 	fwrite(&cameraPosition, 1, sizeof(cameraPosition), f);
 	fclose(f);
 
-	SaveFrameBuffer("heightmap.png", world);
-
-	delete world;
-}
-
-void Terrain::SaveFrameBuffer(const char* path, Columns* world)
-{
-	std::vector<uint8_t> data;
-	uint8_t highest = 0, lowest = 255;
-
-	for (int x = 0; x < parameters.terrainScaleX; x++)
-	{
-		for (int z = 0; z < parameters.terrainScaleZ; z++)
-		{
-			uint8_t level = (*world)[x][z].level;
-			highest = max(highest, level);
-			lowest = min(lowest, level);
-		}
-	}
+	// A single 16-bit height plane, still written to heightmap.png
+	ExportSettings settings;
+	settings.width = parameters.terrainScaleZ;
+	settings.height = parameters.terrainScaleX;
+	settings.planeSuffix = false;
+	exporter.Export(*world, "heightmap", settings);
 
-	for (int x = 0; x < parameters.terrainScaleX; x++)
+	// The heightmap travels along in the snapshot's user block; in the heightfield
+	// preview the voxels lag behind the columns, so there is nothing to resume
+	if (!heightfieldPreview)
 	{
-		for (int z = 0; z < parameters.terrainScaleZ; z++)
-		{
-			uint8_t level = static_cast<uint8_t>((((*world)[x][z].level - lowest) /
-				static_cast<float>(highest)) * 255.0f);
-
-			data.push_back(level);
-			data.push_back(level);
-			data.push_back(level);
-
-			// data.push_back((*world)[x][z].level);
-			// data.push_back((*world)[x][z].level);
-			// data.push_back((*world)[x][z].level);
-		}
+		std::vector<uint8_t> saved(sizeof(Columns) + sizeof(voxels));
+		memcpy(saved.data(), world, sizeof(Columns));
+		memcpy(saved.data() + sizeof(Columns), &voxels, sizeof(voxels));
+		GetWorld()->SaveSnapshotFile("world.snap", WorldCache::Hash(layers, parameters), saved.data(), saved.size());
 	}
 
-	stbi_write_png(path, parameters.terrainScaleX, parameters.terrainScaleZ, 3,
-		data.data(), static_cast<size_t>(parameters.terrainScaleX * 3) * sizeof(char));
-}
\ No newline at end of file
+	delete world;
+}
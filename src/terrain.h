@@ -1,38 +1,21 @@
 #pragma once
 
-#include "src/world/layer.h"
+#include "src/world/generator.h"
+#include "src/world/cache.h"
+#include "src/tools/export.h"
+#include "src/tools/heightfield.h"
+#include "src/tools/pyramid.h"
 #include "lib/imgui/imgui.h"
 
 // #define MULTI_THREADING
 
 namespace Tmpl8
 {
-	constexpr int THREAD_LIMIT = 32;
-
 	struct CameraPoint
 	{
 		float3 cameraPosition, cameraDirection;
 	};
 
-	struct alignas(2) Column
-	{
-		uint8_t level, biome;
-	};
-	typedef std::array<std::array<Column, 1024>, 1024> Columns;
-
-	struct Parameters
-	{
-		bool ui = true, dirty = true, blend = true,
-			waterFill = false, waterErosion = false,
-			caveInverted = false;
-
-		int dimension = 1; // 0 = 2d, 1 = 3d
-		int presetIndex = 0, layerIndex = 0;
-		int terrainScaleX = 1024, terrainScaleZ = 1024,
-			terrainOffsetX = 0, terrainOffsetZ = 0;
-		int erosionIterations = 25000;
-	};
-
 	class Terrain : public Game
 	{
 	public:
@@ -59,8 +42,6 @@ namespace Tmpl8
 			return 0.5f * (2 * p1 + ((p2 - p0) * splineLerp) + (c * splineLerp * splineLerp) + (d * splineLerp * splineLerp * splineLerp));
 		}
 
-		void SaveFrameBuffer(const char* path, Columns* world);
-
 		// Camera
 		float3 cameraDirection = make_float3(0.0f, 0.0f, 1.0f);
 		float3 cameraPosition = make_float3(0.0f, 0.0f, 0.0f);
@@ -77,14 +58,39 @@ namespace Tmpl8
 
 		// Other data
 		int voxels = 0;
-		long long delay = 0;
 
 		// Terrain
 		Parameters parameters;
 
-		Layer continentalness, erosion, peaks,
-			contdensity, density, peakdensity,
-			temperature, humidity;
+		Layers layers;
+
+		// Re-plot into a fresh grid and keep the bricks that did not change,
+		// instead of clearing the world before each regeneration
+		bool diffUpdate = true;
+		uint changedBricks = 0;
+
+		// Previously generated worlds
+		WorldCache cache;
+		bool spillCache = false;
+
+		// Background heightmap export
+		Exporter exporter;
+		ExportSettings exportSettings;
+		int exports = 0;
+
+		// Voxel region export
+		int3 regionPos = make_int3(0, 0, 0), regionSize = make_int3(256, 256, 256);
+		float regionMilliseconds = 0.0f;
+		bool regionResult = true, regionExported = false;
+
+		// Heightfield preview: shows the columns without voxelizing them
+		HeightfieldTracer tracer;
+		bool heightfieldPreview = false;
+
+		// Web map tiles, rebuilt incrementally after each regeneration
+		TilePyramid pyramid = TilePyramid("tiles");
+		bool mapTiles = false;
+		int mapTilesWritten = 0;
 
 		// Height and biome type in a 2d array.
 		Columns* world = new Columns;
@@ -0,0 +1,219 @@
+#include "precomp.h"
+#include "batch.h"
+
+#include "src/world/biome.h"
+#include "src/world/generator.h"
+#include "src/world/preset.h"
+
+#include "stb_image_write.h"
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <thread>
+
+using namespace Tmpl8;
+
+namespace
+{
+	constexpr int THUMBNAIL_SIZE = 256;
+
+	struct BatchJob
+	{
+		int preset, seed;
+	};
+
+	struct BatchStats
+	{
+		long long voxels = 0, milliseconds = 0;
+		std::array<int, biomes.size()> histogram = {};
+		float ocean = 0.0f;
+	};
+
+	// Per worker scratch memory, reused for every world the worker generates.
+	struct BatchWorker
+	{
+		Columns* world = new Columns;
+		std::vector<uint8_t> heightmap = std::vector<uint8_t>(1024 * 1024);
+		std::vector<uint8_t> thumbnail = std::vector<uint8_t>(THUMBNAIL_SIZE * THUMBNAIL_SIZE * 3);
+
+		~BatchWorker() { delete world; }
+	};
+
+	void GenerateWorld(BatchWorker& worker, const Layers& preset, const BatchJob& job, const std::string& name, BatchStats& stats)
+	{
+		const auto start = std::chrono::steady_clock::now();
+
+		// Offset all layer seeds, so layers stay distinct within a world.
+		Layers layers = preset;
+		for (Layer* layer : { &layers.continentalness, &layers.erosion, &layers.peaks, &layers.temperature,
+			&layers.humidity, &layers.contdensity, &layers.density, &layers.peakdensity })
+		{
+			layer->seed += job.seed;
+		}
+
+		Parameters parameters;
+		SetParameters(layers);
+		stats.voxels = GenerateHeightmap(worker.world, layers, parameters);
+		ErodeHeightmap(worker.world, layers, parameters);
+
+		const Columns& world = *worker.world;
+
+		for (int x = 0; x < 1024; x++)
+		{
+			for (int z = 0; z < 1024; z++)
+			{
+				// Fixed range instead of per world normalization, so heightmaps are comparable.
+				worker.heightmap[x * 1024 + z] = static_cast<uint8_t>(min(world[x][z].level * 255 / 240, 255));
+				stats.histogram[min<int>(world[x][z].biome, biomes.size() - 1)]++;
+			}
+		}
+
+		stats.ocean = stats.histogram[12] / (1024.0f * 1024.0f);
+
+		constexpr int step = 1024 / THUMBNAIL_SIZE;
+		for (int x = 0; x < THUMBNAIL_SIZE; x++)
+		{
+			for (int z = 0; z < THUMBNAIL_SIZE; z++)
+			{
+				int r = 0, g = 0, b = 0;
+
+				for (int i = 0; i < step; i++)
+				{
+					for (int j = 0; j < step; j++)
+					{
+						const uint16_t color = colors[world[x * step + i][z * step + j].biome];
+						r += (color >> 8) & 15, g += (color >> 4) & 15, b += color & 15;
+					}
+				}
+
+				uint8_t* pixel = &worker.thumbnail[(x * THUMBNAIL_SIZE + z) * 3];
+				pixel[0] = static_cast<uint8_t>(r * 17 / (step * step));
+				pixel[1] = static_cast<uint8_t>(g * 17 / (step * step));
+				pixel[2] = static_cast<uint8_t>(b * 17 / (step * step));
+			}
+		}
+
+		stbi_write_png((name + "_height.png").c_str(), 1024, 1024, 1, worker.heightmap.data(), 1024);
+		stbi_write_png((name + "_biome.png").c_str(), THUMBNAIL_SIZE, THUMBNAIL_SIZE, 3, worker.thumbnail.data(), THUMBNAIL_SIZE * 3);
+
+		stats.milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	std::string PresetName(const int preset)
+	{
+		std::string name = presets[preset].name;
+		for (char& c : name) c = static_cast<char>(tolower(c));
+		return name;
+	}
+}
+
+int RunBatch(int argc, char* argv[])
+{
+	int seeds = 16, first = 1;
+	int threads = static_cast<int>(std::thread::hardware_concurrency());
+	std::string presetList = "default,grassland,desert,ocean", output = "batch";
+
+	for (int i = 0; i < argc; i++)
+	{
+		const bool value = i + 1 < argc;
+		if (!strcmp(argv[i], "--seeds") && value) seeds = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--first") && value) first = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--presets") && value) presetList = argv[++i];
+		else if (!strcmp(argv[i], "--threads") && value) threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--out") && value) output = argv[++i];
+		else
+		{
+			printf("unknown batch argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	// Presets are loaded once and shared read-only by all workers.
+	std::vector<int> presetIndices;
+	std::array<Layers, presets.size()> layers;
+
+	for (int i = 0; i < static_cast<int>(presets.size()); i++)
+	{
+		if (presetList.find(PresetName(i)) == std::string::npos)
+		{
+			continue;
+		}
+
+		if (!LoadPreset(presets[i].path, layers[i]))
+		{
+			printf("could not load preset %s\n", presets[i].path);
+			return 1;
+		}
+
+		presetIndices.push_back(i);
+	}
+
+	std::vector<BatchJob> jobs;
+	for (int seed = first; seed < first + seeds; seed++)
+	{
+		for (int preset : presetIndices)
+		{
+			jobs.push_back({ preset, seed });
+		}
+	}
+
+	if (jobs.empty())
+	{
+		printf("nothing to generate\n");
+		return 1;
+	}
+
+	std::filesystem::create_directories(output);
+	threads = clamp(threads, 1, static_cast<int>(jobs.size()));
+	printf("generating %zu worlds on %i threads\n", jobs.size(), threads);
+
+	std::vector<BatchStats> stats(jobs.size());
+	std::atomic<int> next = 0, done = 0;
+	const auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++)
+	{
+		workers.emplace_back([&]()
+		{
+			BatchWorker worker;
+
+			for (int i = next++; i < static_cast<int>(jobs.size()); i = next++)
+			{
+				const BatchJob& job = jobs[i];
+				const std::string name = output + "/" + PresetName(job.preset) + "_" + std::to_string(job.seed);
+				GenerateWorld(worker, layers[job.preset], job, name, stats[i]);
+				printf("[%i/%zu] %s (%lld ms)\n", ++done, jobs.size(), name.c_str(), stats[i].milliseconds);
+			}
+		});
+	}
+
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+
+	const float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+
+	FILE* f = fopen((output + "/stats.csv").c_str(), "w");
+	if (f)
+	{
+		fprintf(f, "preset,seed,voxels,ocean,ms");
+		for (const Biome& biome : biomes) fprintf(f, ",%s", biome.name);
+		fprintf(f, "\n");
+
+		for (size_t i = 0; i < jobs.size(); i++)
+		{
+			fprintf(f, "%s,%i,%lld,%.4f,%lld", PresetName(jobs[i].preset).c_str(), jobs[i].seed, stats[i].voxels, stats[i].ocean, stats[i].milliseconds);
+			for (int count : stats[i].histogram) fprintf(f, ",%i", count);
+			fprintf(f, "\n");
+		}
+
+		fclose(f);
+	}
+
+	printf("%zu worlds in %.2f s: %.1f worlds/minute\n", jobs.size(), seconds, jobs.size() * 60.0f / seconds);
+	return 0;
+}
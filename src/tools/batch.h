@@ -0,0 +1,6 @@
+#pragma once
+
+// Headless seed sweep: generates every seed x preset combination on all cores and
+// writes a heightmap, a biome thumbnail and a stats row per world.
+// Usage: --batch [--seeds N] [--first S] [--presets default,grassland,desert,ocean] [--threads N] [--out dir]
+int RunBatch(int argc, char* argv[]);
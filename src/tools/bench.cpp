@@ -0,0 +1,371 @@
+#include "precomp.h"
+#include "bench.h"
+
+#include "src/math/lerp.h"
+#include "src/world/biome.h"
+#include "src/world/generator.h"
+#include "src/world/preset.h"
+#include "src/interface/interface.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+
+using namespace Tmpl8;
+
+namespace
+{
+	struct BenchResult
+	{
+		std::string name;
+		long long items;
+		std::vector<double> milliseconds;
+	};
+
+	// Results are consumed here, so the optimizer can't remove the measured work.
+	volatile float sink = 0;
+
+	class Bench
+	{
+	public:
+		Bench(const std::string& filter, const int repeat) : filter(filter), repeat(repeat)
+		{
+			// Empty
+		}
+
+		// Runs setup (untimed) and run (timed) once to warm up, then repeat times.
+		void Measure(const std::string& name, const long long items, const std::function<void()>& setup, const std::function<void()>& run)
+		{
+			if (!filter.empty() && name.find(filter) == std::string::npos)
+			{
+				return;
+			}
+
+			BenchResult result = { name, items };
+
+			for (int i = 0; i <= repeat; i++)
+			{
+				setup();
+				const auto start = std::chrono::steady_clock::now();
+				run();
+				const double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+				if (i > 0)
+				{
+					result.milliseconds.push_back(elapsed);
+				}
+			}
+
+			std::sort(result.milliseconds.begin(), result.milliseconds.end());
+			printf("%-40s %10.3f ms (min %.3f)\n", name.c_str(), Median(result), result.milliseconds.front());
+			results.push_back(result);
+		}
+
+		void Measure(const std::string& name, const long long items, const std::function<void()>& run)
+		{
+			Measure(name, items, []() {}, run);
+		}
+
+		bool Write(const char* path) const
+		{
+			FILE* f = fopen(path, "w");
+
+			if (!f)
+			{
+				return false;
+			}
+
+			fprintf(f, "{\n\t\"repeat\": %i,\n\t\"threads\": %u,\n\t\"cases\": [\n", repeat, std::thread::hardware_concurrency());
+
+			for (size_t i = 0; i < results.size(); i++)
+			{
+				const BenchResult& result = results[i];
+				double mean = 0;
+				for (double ms : result.milliseconds) mean += ms / result.milliseconds.size();
+
+				fprintf(f, "\t\t{ \"name\": \"%s\", \"items\": %lld, \"min_ms\": %.4f, \"median_ms\": %.4f, \"mean_ms\": %.4f, \"max_ms\": %.4f, \"items_per_second\": %.1f }%s\n",
+					result.name.c_str(), result.items, result.milliseconds.front(), Median(result), mean, result.milliseconds.back(),
+					result.items / (Median(result) / 1000.0), i + 1 < results.size() ? "," : "");
+			}
+
+			fprintf(f, "\t]\n}\n");
+			fclose(f);
+			return true;
+		}
+
+	private:
+		static double Median(const BenchResult& result)
+		{
+			return result.milliseconds[result.milliseconds.size() / 2];
+		}
+
+		std::string filter;
+		int repeat;
+		std::vector<BenchResult> results;
+	};
+
+	void NoiseCases(Bench& bench)
+	{
+		constexpr int size = 256;
+		const char* noiseNames[] = { "opensimplex2", "opensimplex2s", "cellular", "perlin", "valuecubic", "value" };
+		const char* fractalNames[] = { "none", "fbm", "ridged", "pingpong" };
+
+		for (int noiseIndex = 0; noiseIndex < 6; noiseIndex++)
+		{
+			for (int fractalIndex = 0; fractalIndex < 4; fractalIndex++)
+			{
+				Layer layer;
+				layer.noiseIndex = noiseIndex;
+				layer.fractalIndex = fractalIndex;
+				SetParameters(layer);
+
+				const std::string name = std::string("noise/") + noiseNames[noiseIndex] + "/" + fractalNames[fractalIndex];
+
+				bench.Measure(name + "/2d", size * size, [&]()
+				{
+					float sum = 0;
+					for (int x = 0; x < size; x++) for (int z = 0; z < size; z++) sum += layer.noise.GetNoise(static_cast<float>(x), static_cast<float>(z));
+					sink = sum;
+				});
+
+				bench.Measure(name + "/3d", size * size * 16, [&]()
+				{
+					float sum = 0;
+					for (int x = 0; x < size; x++) for (int y = 0; y < 16; y++) for (int z = 0; z < size; z++)
+						sum += layer.noise.GetNoise(static_cast<float>(x), static_cast<float>(y), static_cast<float>(z));
+					sink = sum;
+				});
+			}
+		}
+	}
+
+	void MathCases(Bench& bench)
+	{
+		constexpr int count = 1 << 20;
+
+		Layer layer;
+		for (size_t i = 0; i < layer.points.size(); i++) layer.points[i] = i / 20.0f;
+		BuildCurve(layer);
+
+		bench.Measure("lerp/points", count, [&]()
+		{
+			float sum = 0;
+			for (int i = 0; i < count; i++) sum += LerpPoints(layer, (i & 1023) / 1024.0f);
+			sink = sum;
+		});
+
+		bench.Measure("lerp/curve", count, [&]()
+		{
+			float sum = 0;
+			for (int i = 0; i < count; i++) sum += SampleCurve(layer, (i & 1023) / 1024.0f);
+			sink = sum;
+		});
+
+		bench.Measure("lerp/colors", count, [&]()
+		{
+			uint16_t sum = 0;
+			for (int i = 0; i < count; i++) sum += LerpColors(colors[i & 15], colors[(i >> 4) & 15], (i & 255) / 256.0f);
+			sink = sum;
+		});
+
+		bench.Measure("biome/function", count, [&]()
+		{
+			int sum = 0;
+			for (int i = 0; i < count; i++) sum += BiomeFunction((i & 1023) / 512.0f - 1.0f, ((i >> 10) & 1023) / 512.0f - 1.0f);
+			sink = static_cast<float>(sum);
+		});
+	}
+
+	void GeneratorCases(Bench& bench, World* target, Layers& layers, Parameters& parameters, Columns* world)
+	{
+		Columns* backup = new Columns;
+		GenerateHeightmap(backup, layers, parameters);
+
+		bench.Measure("generator/heightmap", 1024 * 1024, [&]()
+		{
+			sink = static_cast<float>(GenerateHeightmap(world, layers, parameters));
+		});
+
+		bench.Measure("generator/erosion", parameters.erosionIterations, [&]() { *world = *backup; }, [&]()
+		{
+			ErodeHeightmap(world, layers, parameters);
+		});
+
+		bench.Measure("generator/generate", parameters.terrainScaleX * parameters.terrainScaleZ, [&]() { target->Clear(); }, [&]()
+		{
+			for (int thread = 0; thread < THREAD_LIMIT; thread++)
+			{
+				Generate(target, world, layers, parameters, thread);
+			}
+		});
+
+		delete backup;
+	}
+
+	void WorldCases(Bench& bench, World* target, Layers& layers, Parameters& parameters, Columns* world)
+	{
+		constexpr int count = 1 << 20;
+
+		// Fixed random positions, so every run touches the same voxels.
+		std::vector<uint3> positions(count);
+		uint seed = 0x12345678;
+		for (uint3& p : positions) p = make_uint3(RandomUInt(seed) & 1023, RandomUInt(seed) & 255, RandomUInt(seed) & 1023);
+
+		auto regenerate = [&]()
+		{
+			target->Clear();
+			for (int thread = 0; thread < THREAD_LIMIT; thread++) Generate(target, world, layers, parameters, thread);
+		};
+
+		bench.Measure("world/set", count, regenerate, [&]()
+		{
+			for (int i = 0; i < count; i++) target->Set(positions[i].x, positions[i].y, positions[i].z, i & 0xfff);
+		});
+
+		bench.Measure("world/get", count, [&]()
+		{
+			uint sum = 0;
+			for (int i = 0; i < count; i++) sum += target->Get(positions[i].x, positions[i].y, positions[i].z);
+			sink = static_cast<float>(sum);
+		});
+
+		bench.Measure("world/optimize", GRIDSIZE, regenerate, [&]()
+		{
+			target->OptimizeBricks();
+		});
+
+		bench.Measure("world/optimize-dirty", GRIDSIZE, regenerate, [&]()
+		{
+			target->OptimizeBricks(true);
+		});
+
+		// Touch one voxel in MAXCOMMITS bricks, so every commit gathers a full staging buffer.
+		regenerate();
+		target->Commit();
+		std::vector<uint3> touched;
+		for (int x = 0; x < 1024 && touched.size() < MAXCOMMITS; x += BRICKDIM)
+		{
+			for (int z = 0; z < 1024 && touched.size() < MAXCOMMITS; z += BRICKDIM)
+			{
+				for (int y = 0; y < 256 && touched.size() < MAXCOMMITS; y += BRICKDIM)
+				{
+					if (target->Get(x, y, z)) touched.push_back(make_uint3(x, y, z));
+				}
+			}
+		}
+
+		bench.Measure("world/commit", static_cast<long long>(touched.size()), [&]()
+		{
+			while (target->GetDirtyBrickCount() > 0) target->Commit();
+			for (const uint3& p : touched) target->Set(p.x, p.y, p.z, target->Get(p.x, p.y, p.z) ^ 1);
+		}, [&]()
+		{
+			target->Commit();
+		});
+
+		// Rays from above the terrain, looking down at an angle.
+		std::vector<float4> origins(1 << 16), directions(1 << 16);
+		for (size_t i = 0; i < origins.size(); i++)
+		{
+			origins[i] = make_float4(RandomFloat(seed) * 1024, 300, RandomFloat(seed) * 1024, 0);
+			directions[i] = make_float4(normalize(make_float3(RandomFloat(seed) - 0.5f, -0.5f, RandomFloat(seed) - 0.5f)), 0);
+		}
+
+		bench.Measure("world/traceray", static_cast<long long>(origins.size()), [&]()
+		{
+			uint sum = 0;
+			for (size_t i = 0; i < origins.size(); i++)
+			{
+				float dist;
+				float3 N;
+				sum += target->TraceRay(origins[i], directions[i], dist, N, 999999);
+			}
+			sink = static_cast<float>(sum);
+		});
+	}
+
+	// Diff updates must report (and upload) cells that lose their brick without
+	// marking a new one: an emptied cell and a brick cell that turned solid.
+	bool CheckDiffUpdate(World* target)
+	{
+		target->Clear();
+		target->Set(0, 0, 0, 1);			// cell a: brick, emptied by the update
+		target->Set(BRICKDIM, 0, 0, 1);		// cell b: brick, turns solid
+		target->Set(2 * BRICKDIM, 0, 0, 1);	// cell c: brick, unchanged
+
+		target->BeginUpdate();
+		for (int x = 0; x < BRICKDIM; x++) for (int y = 0; y < BRICKDIM; y++) for (int z = 0; z < BRICKDIM; z++)
+		{
+			target->Set(BRICKDIM + x, y, z, 2);
+		}
+		target->OptimizeBricks(true);
+		target->Set(2 * BRICKDIM, 0, 0, 1);
+		const uint changed = target->EndUpdate();
+
+		const bool ok = changed == 2 && target->Get(0, 0, 0) == 0 && target->Get(BRICKDIM + 1, 1, 1) == 2 &&
+			target->Get(2 * BRICKDIM, 0, 0) == 1;
+		printf("check diff-update: %s (%u cells changed)\n", ok ? "ok" : "FAILED", changed);
+		target->Clear();
+		return ok;
+	}
+}
+
+int RunBench(int argc, char* argv[])
+{
+	std::string output = "bench.json", filter;
+	int repeat = 5;
+
+	for (int i = 0; i < argc; i++)
+	{
+		const bool value = i + 1 < argc;
+		if (!strcmp(argv[i], "--out") && value) output = argv[++i];
+		else if (!strcmp(argv[i], "--filter") && value) filter = argv[++i];
+		else if (!strcmp(argv[i], "--repeat") && value) repeat = max(1, atoi(argv[++i]));
+		else
+		{
+			printf("unknown bench argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	Bench bench(filter, repeat);
+	NoiseCases(bench);
+	MathCases(bench);
+
+	// The default preset (or default layers, if it's missing) drives the generator and world cases.
+	Layers* layers = new Layers;
+	LoadPreset(presets[0].path, *layers);
+	SetParameters(*layers);
+
+	Parameters parameters;
+	Columns* world = new Columns;
+	GenerateHeightmap(world, *layers, parameters);
+
+	World* target = new World(0);
+
+	if (!CheckDiffUpdate(target))
+	{
+		delete target;
+		delete world;
+		delete layers;
+		return 1;
+	}
+
+	GeneratorCases(bench, target, *layers, parameters, world);
+	WorldCases(bench, target, *layers, parameters, world);
+
+	delete target;
+	delete world;
+	delete layers;
+
+	if (!bench.Write(output.c_str()))
+	{
+		printf("could not write %s\n", output.c_str());
+		return 1;
+	}
+
+	printf("results written to %s\n", output.c_str());
+	return 0;
+}
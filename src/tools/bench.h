@@ -0,0 +1,5 @@
+#pragma once
+
+// Headless microbenchmarks for the generation and world hot paths, results are written as JSON.
+// Usage: --bench [--out bench.json] [--filter name] [--repeat N]
+int RunBench(int argc, char* argv[]);
@@ -0,0 +1,481 @@
+#include "precomp.h"
+#include "export.h"
+#include "parallel.h"
+#include "pyramid.h"
+
+#include "src/world/biome.h"
+#include "src/world/preset.h"
+
+#include <chrono>
+#include <filesystem>
+
+using namespace Tmpl8;
+
+namespace
+{
+	// Rows per independently deflated piece of a single png.
+	constexpr int STRIP_ROWS = 64;
+
+	struct PlaneInfo
+	{
+		int plane;
+		const char* name;
+		int channels;
+	};
+
+	constexpr std::array<PlaneInfo, 3> planeInfo =
+	{
+		PlaneInfo{ EXPORT_HEIGHT, "height", 1 },
+		PlaneInfo{ EXPORT_BIOME, "biome", 1 },
+		PlaneInfo{ EXPORT_COLOR, "color", 3 }
+	};
+
+	void PutBigEndian(uint8_t* out, const uint value)
+	{
+		out[0] = static_cast<uint8_t>(value >> 24);
+		out[1] = static_cast<uint8_t>(value >> 16);
+		out[2] = static_cast<uint8_t>(value >> 8);
+		out[3] = static_cast<uint8_t>(value);
+	}
+
+	void PutSample(uint8_t* out, const uint16_t value)
+	{
+		out[0] = static_cast<uint8_t>(value >> 8);
+		out[1] = static_cast<uint8_t>(value);
+	}
+
+	bool WriteChunk(FILE* f, const char* type, const uint8_t* data, const uint size)
+	{
+		// crc32 with a null buffer resets, so empty chunks only hash their type.
+		uLong checksum = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+		if (size) checksum = crc32(checksum, data, size);
+
+		uint8_t length[4], crc[4];
+		PutBigEndian(length, size);
+		PutBigEndian(crc, static_cast<uint>(checksum));
+
+		return fwrite(length, 4, 1, f) == 1 && fwrite(type, 4, 1, f) == 1 &&
+			(!size || fwrite(data, size, 1, f) == 1) && fwrite(crc, 4, 1, f) == 1;
+	}
+}
+
+Exporter::Exporter(int threads) :
+	threads(threads > 0 ? threads : max(1, static_cast<int>(std::thread::hardware_concurrency())))
+{
+	height.resize(1024 * 1024 * 2);
+	biome.resize(1024 * 1024 * 2);
+	color.resize(1024 * 1024 * 6);
+	raw.resize(1024 * 1024 * 3);
+	worker = std::thread(&Exporter::Loop, this);
+}
+
+Exporter::~Exporter()
+{
+	Wait();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+
+	signal.notify_all();
+	worker.join();
+	delete snapshot;
+}
+
+bool Exporter::Submit(const Columns& world, const std::string& prefix, const ExportSettings& settings)
+{
+	if (busy.exchange(true))
+	{
+		return false;
+	}
+
+	*snapshot = world;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pendingPrefix = prefix;
+		pendingSettings = settings;
+		pending = true;
+	}
+
+	signal.notify_all();
+	return true;
+}
+
+bool Exporter::Export(const Columns& world, const std::string& prefix, const ExportSettings& settings)
+{
+	Wait();
+	return Write(world, prefix, settings);
+}
+
+void Exporter::Wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	signal.wait(lock, [this]() { return !busy; });
+}
+
+void Exporter::Loop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (true)
+	{
+		signal.wait(lock, [this]() { return pending || quit; });
+
+		if (quit)
+		{
+			return;
+		}
+
+		pending = false;
+		lock.unlock();
+		Write(*snapshot, pendingPrefix, pendingSettings);
+		lock.lock();
+
+		busy = false;
+		signal.notify_all();
+	}
+}
+
+bool Exporter::Write(const Columns& world, const std::string& prefix, const ExportSettings& requested)
+{
+	PROFILE_SCOPE("Export");
+	const auto start = std::chrono::steady_clock::now();
+
+	ExportSettings settings = requested;
+	settings.width = clamp(settings.width, 1, 1024);
+	settings.height = clamp(settings.height, 1, 1024);
+	settings.tileSize = clamp(settings.tileSize, 16, 1024);
+	settings.compression = clamp(settings.compression, 0, 9);
+
+	const std::filesystem::path directory = std::filesystem::path(prefix).parent_path();
+	std::error_code error;
+	if (!directory.empty()) std::filesystem::create_directories(directory, error);
+
+	if (settings.format != ExportFormat::RawFloat)
+	{
+		PreparePlanes(world, settings);
+	}
+
+	bool ok = true;
+
+	for (const PlaneInfo& info : planeInfo)
+	{
+		if (!(settings.planes & info.plane))
+		{
+			continue;
+		}
+
+		const std::string path = settings.planeSuffix ? prefix + "_" + info.name : prefix;
+		const uint8_t* plane = (info.plane == EXPORT_HEIGHT ? height : info.plane == EXPORT_BIOME ? biome : color).data();
+
+		switch (settings.format)
+		{
+		case ExportFormat::Png16: ok &= WritePng(path + ".png", plane, info.channels, settings); break;
+		case ExportFormat::TiledPng16: ok &= WriteTiles(path, plane, info.channels, settings); break;
+		case ExportFormat::RawFloat: ok &= WriteRaw(path + ".raw", world, info.plane, settings); break;
+		}
+	}
+
+	lastMilliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	lastResult = ok;
+	return ok;
+}
+
+void Exporter::PreparePlanes(const Columns& world, const ExportSettings& settings)
+{
+	lowest = 255, highest = 0;
+
+	for (int x = 0; x < settings.height; x++)
+	{
+		for (int z = 0; z < settings.width; z++)
+		{
+			lowest = min<int>(lowest, world[x][z].level);
+			highest = max<int>(highest, world[x][z].level);
+		}
+	}
+
+	// Normalize over the range of the map, a flat map exports as black.
+	const int range = max(highest - lowest, 1);
+
+	ParallelFor(settings.height, threads, [&](int x)
+	{
+		uint8_t* heightRow = &height[static_cast<size_t>(x) * settings.width * 2];
+		uint8_t* biomeRow = &biome[static_cast<size_t>(x) * settings.width * 2];
+		uint8_t* colorRow = &color[static_cast<size_t>(x) * settings.width * 6];
+
+		for (int z = 0; z < settings.width; z++)
+		{
+			const Column& column = world[x][z];
+			PutSample(heightRow + z * 2, static_cast<uint16_t>((column.level - lowest) * 65535 / range));
+			PutSample(biomeRow + z * 2, column.biome);
+
+			// 4-bit channels scale to 16-bit exactly by repeating the nibble.
+			const uint16_t rgb = colors[column.biome & 15];
+			PutSample(colorRow + z * 6 + 0, static_cast<uint16_t>(((rgb >> 8) & 15) * 0x1111));
+			PutSample(colorRow + z * 6 + 2, static_cast<uint16_t>(((rgb >> 4) & 15) * 0x1111));
+			PutSample(colorRow + z * 6 + 4, static_cast<uint16_t>((rgb & 15) * 0x1111));
+		}
+	});
+}
+
+// Filters rows [first, first + count) of a 16-bit image with the Up filter and
+// deflates them as one piece of a zlib stream. Pieces end on a sync flush, so
+// they can be concatenated; only the last one finishes the stream.
+void Exporter::Compress(Chunk& chunk, const uint8_t* rows, size_t stride, size_t rowBytes, int first, int count, bool last, int level)
+{
+	chunk.filteredSize = (rowBytes + 1) * count;
+	if (chunk.filtered.size() < chunk.filteredSize) chunk.filtered.resize(chunk.filteredSize);
+
+	uint8_t* out = chunk.filtered.data();
+
+	for (int r = first; r < first + count; r++)
+	{
+		const uint8_t* row = rows + r * stride;
+		*out++ = r ? 2 : 0;
+
+		if (r)
+		{
+			const uint8_t* above = row - stride;
+			for (size_t i = 0; i < rowBytes; i++) *out++ = static_cast<uint8_t>(row[i] - above[i]);
+		}
+		else
+		{
+			memcpy(out, row, rowBytes);
+			out += rowBytes;
+		}
+	}
+
+	chunk.adler = adler32(1, chunk.filtered.data(), static_cast<uInt>(chunk.filteredSize));
+
+	z_stream stream = {};
+	deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+
+	// deflateBound covers a finished stream, leave room for the flush marker.
+	const size_t bound = deflateBound(&stream, static_cast<uLong>(chunk.filteredSize)) + 16;
+	if (chunk.compressed.size() < bound) chunk.compressed.resize(bound);
+
+	stream.next_in = chunk.filtered.data();
+	stream.avail_in = static_cast<uInt>(chunk.filteredSize);
+	stream.next_out = chunk.compressed.data();
+	stream.avail_out = static_cast<uInt>(chunk.compressed.size());
+	deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+	chunk.compressedSize = stream.total_out;
+	deflateEnd(&stream);
+}
+
+bool Exporter::WritePngFile(const std::string& path, int width, int height, int channels, const Chunk* chunks, int count)
+{
+	FILE* f = fopen(path.c_str(), "wb");
+
+	if (!f)
+	{
+		return false;
+	}
+
+	static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	uint8_t header[13] = {};
+	PutBigEndian(header, width);
+	PutBigEndian(header + 4, height);
+	header[8] = 16;							// bit depth
+	header[9] = channels == 3 ? 2 : 0;		// truecolor or grayscale
+
+	bool ok = fwrite(signature, sizeof(signature), 1, f) == 1 && WriteChunk(f, "IHDR", header, sizeof(header));
+
+	// The IDAT payload is streamed piece by piece, with its crc and the zlib
+	// adler checksum stitched together from the pieces.
+	static const uint8_t zlibHeader[2] = { 0x78, 0x9c };
+	size_t size = sizeof(zlibHeader) + 4;
+	for (int i = 0; i < count; i++) size += chunks[i].compressedSize;
+
+	uint8_t length[4];
+	PutBigEndian(length, static_cast<uint>(size));
+	uLong crc = crc32(crc32(0, reinterpret_cast<const Bytef*>("IDAT"), 4), zlibHeader, sizeof(zlibHeader));
+	uLong adler = 1;
+
+	ok = ok && fwrite(length, 4, 1, f) == 1 && fwrite("IDAT", 4, 1, f) == 1 && fwrite(zlibHeader, sizeof(zlibHeader), 1, f) == 1;
+
+	for (int i = 0; i < count && ok; i++)
+	{
+		const Chunk& chunk = chunks[i];
+		ok = fwrite(chunk.compressed.data(), chunk.compressedSize, 1, f) == 1;
+		crc = crc32(crc, chunk.compressed.data(), static_cast<uInt>(chunk.compressedSize));
+		adler = adler32_combine(adler, chunk.adler, static_cast<z_off_t>(chunk.filteredSize));
+	}
+
+	uint8_t trailer[8];
+	PutBigEndian(trailer, static_cast<uint>(adler));
+	crc = crc32(crc, trailer, 4);
+	PutBigEndian(trailer + 4, static_cast<uint>(crc));
+
+	ok = ok && fwrite(trailer, sizeof(trailer), 1, f) == 1 && WriteChunk(f, "IEND", nullptr, 0);
+	return (fclose(f) == 0) && ok;
+}
+
+bool Exporter::WritePng(const std::string& path, const uint8_t* plane, int channels, const ExportSettings& settings)
+{
+	const size_t rowBytes = static_cast<size_t>(settings.width) * channels * 2;
+	const int count = (settings.height + STRIP_ROWS - 1) / STRIP_ROWS;
+	if (static_cast<int>(chunks.size()) < count) chunks.resize(count);
+
+	ParallelFor(count, threads, [&](int i)
+	{
+		const int first = i * STRIP_ROWS;
+		Compress(chunks[i], plane, rowBytes, rowBytes, first, min(STRIP_ROWS, settings.height - first), i == count - 1, settings.compression);
+	});
+
+	return WritePngFile(path, settings.width, settings.height, channels, chunks.data(), count);
+}
+
+bool Exporter::WriteTiles(const std::string& path, const uint8_t* plane, int channels, const ExportSettings& settings)
+{
+	const size_t stride = static_cast<size_t>(settings.width) * channels * 2;
+	const int tile = settings.tileSize;
+	const int columns = (settings.width + tile - 1) / tile, rows = (settings.height + tile - 1) / tile;
+	const int count = columns * rows;
+	if (static_cast<int>(chunks.size()) < count) chunks.resize(count);
+
+	// Every tile is a complete png, so encoding and writing both run in parallel.
+	std::atomic<bool> ok = true;
+
+	ParallelFor(count, threads, [&](int i)
+	{
+		const int row = i / columns, column = i % columns;
+		const int width = min(tile, settings.width - column * tile), height = min(tile, settings.height - row * tile);
+		const uint8_t* origin = plane + row * tile * stride + static_cast<size_t>(column) * tile * channels * 2;
+
+		Compress(chunks[i], origin, stride, static_cast<size_t>(width) * channels * 2, 0, height, true, settings.compression);
+
+		const std::string name = path + "_" + std::to_string(row) + "_" + std::to_string(column) + ".png";
+		if (!WritePngFile(name, width, height, channels, &chunks[i], 1)) ok = false;
+	});
+
+	return ok;
+}
+
+bool Exporter::WriteRaw(const std::string& path, const Columns& world, int plane, const ExportSettings& settings)
+{
+	const int channels = plane == EXPORT_COLOR ? 3 : 1;
+
+	ParallelFor(settings.height, threads, [&](int x)
+	{
+		float* row = &raw[static_cast<size_t>(x) * settings.width * channels];
+
+		for (int z = 0; z < settings.width; z++)
+		{
+			const Column& column = world[x][z];
+
+			if (plane == EXPORT_HEIGHT)
+			{
+				row[z] = column.level;
+			}
+			else if (plane == EXPORT_BIOME)
+			{
+				row[z] = column.biome;
+			}
+			else
+			{
+				const uint16_t rgb = colors[column.biome & 15];
+				row[z * 3 + 0] = ((rgb >> 8) & 15) / 15.0f;
+				row[z * 3 + 1] = ((rgb >> 4) & 15) / 15.0f;
+				row[z * 3 + 2] = (rgb & 15) / 15.0f;
+			}
+		}
+	});
+
+	FILE* f = fopen(path.c_str(), "wb");
+
+	if (!f)
+	{
+		return false;
+	}
+
+	const size_t count = static_cast<size_t>(settings.width) * settings.height * channels;
+	const bool ok = fwrite(raw.data(), sizeof(float), count, f) == count;
+	return (fclose(f) == 0) && ok;
+}
+
+int RunExport(int argc, char* argv[])
+{
+	std::string preset = "default", output = "export/world", pyramid;
+	int seed = 0;
+	ExportSettings settings;
+	settings.planes = EXPORT_HEIGHT | EXPORT_BIOME | EXPORT_COLOR;
+
+	for (int i = 0; i < argc; i++)
+	{
+		const bool value = i + 1 < argc;
+		if (!strcmp(argv[i], "--preset") && value) preset = argv[++i];
+		else if (!strcmp(argv[i], "--seed") && value) seed = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--tile") && value) settings.tileSize = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--out") && value) output = argv[++i];
+		else if (!strcmp(argv[i], "--pyramid") && value) pyramid = argv[++i];
+		else if (!strcmp(argv[i], "--format") && value)
+		{
+			const char* format = argv[++i];
+			if (!strcmp(format, "png16")) settings.format = ExportFormat::Png16;
+			else if (!strcmp(format, "raw")) settings.format = ExportFormat::RawFloat;
+			else if (!strcmp(format, "tiles")) settings.format = ExportFormat::TiledPng16;
+			else
+			{
+				printf("unknown export format: %s\n", format);
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[i], "--planes") && value)
+		{
+			const std::string planes = argv[++i];
+			settings.planes = 0;
+			for (const PlaneInfo& info : planeInfo)
+			{
+				if (planes.find(info.name) != std::string::npos) settings.planes |= info.plane;
+			}
+		}
+		else
+		{
+			printf("unknown export argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	const Preset* found = nullptr;
+	for (const Preset& candidate : presets)
+	{
+		if (!_stricmp(candidate.name, preset.c_str())) found = &candidate;
+	}
+
+	Layers layers;
+	if (!found || !LoadPreset(found->path, layers))
+	{
+		printf("could not load preset %s\n", preset.c_str());
+		return 1;
+	}
+
+	// Same seed offsetting as the batch sweep, so exports match its thumbnails.
+	for (Layer* layer : { &layers.continentalness, &layers.erosion, &layers.peaks, &layers.temperature,
+		&layers.humidity, &layers.contdensity, &layers.density, &layers.peakdensity })
+	{
+		layer->seed += seed;
+	}
+
+	Columns* world = new Columns;
+	Parameters parameters;
+	SetParameters(layers);
+	GenerateHeightmap(world, layers, parameters);
+	ErodeHeightmap(world, layers, parameters);
+
+	Exporter exporter;
+	bool ok = exporter.Export(*world, output, settings);
+	printf("%s %s (%.1f ms)\n", ok ? "exported" : "failed to export", output.c_str(), exporter.GetLastMilliseconds());
+
+	if (!pyramid.empty())
+	{
+		const int tiles = TilePyramid(pyramid).Update(*world);
+		printf("wrote %i map tiles to %s\n", tiles, pyramid.c_str());
+		ok &= tiles > 0;
+	}
+
+	delete world;
+	return ok ? 0 : 1;
+}
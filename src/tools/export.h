@@ -0,0 +1,98 @@
+#pragma once
+
+#include "src/world/generator.h"
+
+#include <condition_variable>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Tmpl8
+{
+	// Planes that can be exported, combined as a bitmask.
+	enum ExportPlane
+	{
+		EXPORT_HEIGHT = 1,
+		EXPORT_BIOME = 2,
+		EXPORT_COLOR = 4
+	};
+
+	enum class ExportFormat
+	{
+		Png16,		// one 16-bit png per plane, compressed in parallel strips
+		RawFloat,	// headerless little-endian float rows, width x height (x channels)
+		TiledPng16	// 16-bit png tiles named <prefix>_<plane>_<row>_<column>.png
+	};
+
+	struct ExportSettings
+	{
+		ExportFormat format = ExportFormat::Png16;
+		int planes = EXPORT_HEIGHT;
+		int width = 1024, height = 1024;	// exported columns (z) and rows (x)
+		int tileSize = 256;
+		int compression = 6;				// deflate level
+		bool planeSuffix = true;			// <prefix>_<plane>; off writes a single plane to exactly <prefix>
+	};
+
+	// Writes heightfield, biome and color planes of a heightmap. Height is
+	// normalized to the lowest/highest level of the map for png and stored
+	// in voxels for raw floats. All buffers are kept between exports.
+	class Exporter
+	{
+	public:
+		explicit Exporter(int threads = 0);
+		~Exporter();
+
+		// Copies the columns and exports on a background thread, returns
+		// false if the previous export is still running.
+		bool Submit(const Columns& world, const std::string& prefix, const ExportSettings& settings);
+
+		// Exports on the calling thread, after any pending export.
+		bool Export(const Columns& world, const std::string& prefix, const ExportSettings& settings);
+
+		void Wait();
+		bool IsBusy() const { return busy; }
+		bool GetLastResult() const { return lastResult; }
+		float GetLastMilliseconds() const { return lastMilliseconds; }
+
+	private:
+		struct Chunk
+		{
+			std::vector<uint8_t> filtered, compressed;
+			size_t filteredSize = 0, compressedSize = 0;
+			uLong adler = 1;
+		};
+
+		bool Write(const Columns& world, const std::string& prefix, const ExportSettings& settings);
+		void PreparePlanes(const Columns& world, const ExportSettings& settings);
+		bool WritePng(const std::string& path, const uint8_t* plane, int channels, const ExportSettings& settings);
+		bool WriteTiles(const std::string& path, const uint8_t* plane, int channels, const ExportSettings& settings);
+		bool WriteRaw(const std::string& path, const Columns& world, int plane, const ExportSettings& settings);
+		static bool WritePngFile(const std::string& path, int width, int height, int channels, const Chunk* chunks, int count);
+		void Compress(Chunk& chunk, const uint8_t* rows, size_t stride, size_t rowBytes, int first, int count, bool last, int level);
+		void Loop();
+
+		int threads;
+
+		// Planes as big-endian 16-bit samples, rows of x, columns of z.
+		std::vector<uint8_t> height, biome, color;
+		std::vector<float> raw;
+		std::vector<Chunk> chunks;
+		int lowest = 0, highest = 0;
+
+		// Background export state.
+		Columns* snapshot = new Columns;
+		std::string pendingPrefix;
+		ExportSettings pendingSettings;
+		std::thread worker;
+		std::mutex mutex;
+		std::condition_variable signal;
+		std::atomic<bool> busy = false, lastResult = true;
+		std::atomic<float> lastMilliseconds = 0.0f;
+		bool pending = false, quit = false;
+	};
+}
+
+// Headless export of a generated world.
+// Usage: --export [--preset name] [--seed N] [--format png16|raw|tiles] [--planes height,biome,color] [--tile N] [--out prefix] [--pyramid dir]
+int RunExport(int argc, char* argv[]);
@@ -0,0 +1,254 @@
+#include "precomp.h"
+#include "heightfield.h"
+
+#include "src/world/biome.h"
+
+using namespace Tmpl8;
+
+// Rows are dealt out round-robin over a fixed set of jobs on the template's
+// JobManager, like the bulk operations of World.
+#define HEIGHTFIELDJOBS 64
+
+namespace
+{
+	// Same mapping as World::Render: rows of pixels top to bottom, p0 top left.
+	struct View
+	{
+		float3 E, p0, right, down;
+	};
+}
+
+// One level of the pyramid: rows x = first, first + HEIGHTFIELDJOBS, ...
+class HeightfieldTracer::MipJob : public Job
+{
+public:
+	void Main()
+	{
+		for (int x = first; x < size.x; x += HEIGHTFIELDJOBS)
+		{
+			const uint8_t* row0 = source + static_cast<size_t>(x * 2) * below.y;
+			const uint8_t* row1 = source + static_cast<size_t>(min(x * 2 + 1, below.x - 1)) * below.y;
+
+			for (int z = 0; z < size.y; z++)
+			{
+				const int z1 = min(z * 2 + 1, below.y - 1);
+				target[static_cast<size_t>(x) * size.y + z] = max(max(row0[z * 2], row0[z1]), max(row1[z * 2], row1[z1]));
+			}
+		}
+	}
+
+	const uint8_t* source;
+	uint8_t* target;
+	int2 below, size;
+	int first;
+};
+
+// Pixel rows y = first, first + HEIGHTFIELDJOBS, ...
+class HeightfieldTracer::RenderJob : public Job
+{
+public:
+	void Main()
+	{
+		for (int y = first; y < height; y += HEIGHTFIELDJOBS)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				const float3 P = view.p0 + view.right * (static_cast<float>(x) / width) + view.down * (static_cast<float>(y) / height);
+				const float3 D = normalize(P - view.E);
+
+				Hit hit;
+				float3 color = tracer->Trace(view.E, D, hit) ? tracer->Shade(D, hit) :
+					lerp(make_float3(0.75f, 0.85f, 0.95f), make_float3(0.35f, 0.55f, 0.85f), clamp(D.y, 0.0f, 1.0f));
+				color = make_float3(clamp(color.x, 0.0f, 1.0f), clamp(color.y, 0.0f, 1.0f), clamp(color.z, 0.0f, 1.0f));
+
+				if (window)
+				{
+					pixels[static_cast<size_t>(y) * width + x] = 0xff000000 | (static_cast<uint>(color.x * 255.0f + 0.5f) << 16) |
+						(static_cast<uint>(color.y * 255.0f + 0.5f) << 8) | static_cast<uint>(color.z * 255.0f + 0.5f);
+					continue;
+				}
+
+				const uint r = static_cast<uint>(sqrtf(color.x) * 255.0f + 0.5f);
+				const uint g = static_cast<uint>(sqrtf(color.y) * 255.0f + 0.5f);
+				const uint b = static_cast<uint>(sqrtf(color.z) * 255.0f + 0.5f);
+				pixels[static_cast<size_t>(y) * width + x] = 0xff000000 | (b << 16) | (g << 8) | r;
+			}
+		}
+	}
+
+	const HeightfieldTracer* tracer;
+	View view;
+	uint* pixels;
+	int width, height, first;
+	bool window;
+};
+
+void HeightfieldTracer::Build(const Column* columns, int width, int depth)
+{
+	PROFILE_SCOPE("Heightfield pyramid");
+	sizeX = width, sizeZ = depth;
+	mips.resize(1), mipSizes.assign(1, make_int2(sizeX, sizeZ));
+	mips[0].resize(static_cast<size_t>(sizeX) * sizeZ);
+	biomes.resize(mips[0].size());
+
+	for (size_t i = 0; i < mips[0].size(); i++)
+	{
+		mips[0][i] = columns[i].level;
+		biomes[i] = columns[i].biome;
+	}
+
+	// Halve until a single cell covers the map; odd edges keep their last row.
+	while (mipSizes.back().x > 1 || mipSizes.back().y > 1)
+	{
+		const int2 below = mipSizes.back(), size = make_int2((below.x + 1) / 2, (below.y + 1) / 2);
+		const std::vector<uint8_t>& source = mips.back();
+		std::vector<uint8_t> target(static_cast<size_t>(size.x) * size.y);
+
+		static JobManager* jm = JobManager::GetJobManager();
+		static MipJob mj[HEIGHTFIELDJOBS];
+
+		for (int i = 0; i < HEIGHTFIELDJOBS; i++)
+		{
+			mj[i].source = source.data(), mj[i].target = target.data();
+			mj[i].below = below, mj[i].size = size, mj[i].first = i;
+			jm->AddJob2(&mj[i]);
+		}
+
+		jm->RunJobs();
+
+		mips.push_back(std::move(target));
+		mipSizes.push_back(size);
+	}
+}
+
+int HeightfieldTracer::Height(int x, int z) const
+{
+	x = clamp(x, 0, sizeX - 1), z = clamp(z, 0, sizeZ - 1);
+	return mips[0][static_cast<size_t>(x) * sizeZ + z];
+}
+
+// A column of level h is solid from y = 0 up to h + 1, like the voxels Generate
+// plots. The ray walks the cells of the current mip level; it climbs a level when
+// it steps out of a parent cell and descends only when it dips below the highest
+// column of a cell.
+bool HeightfieldTracer::Trace(const float3& O, const float3& direction, Hit& hit) const
+{
+	float3 D = direction;
+	if (fabsf(D.x) < 1e-8f) D.x = 1e-8f;
+	if (fabsf(D.z) < 1e-8f) D.z = 1e-8f;
+	const float3 R = make_float3(1.0f / D.x, D.y != 0 ? 1.0f / D.y : 1e30f, 1.0f / D.z);
+
+	// Clip against the bounds of the map; the pyramid top is its highest column.
+	const float top = mips.back()[0] + 1.0f;
+	const float tx0 = -O.x * R.x, tx1 = (sizeX - O.x) * R.x;
+	const float ty0 = -O.y * R.y, ty1 = (top - O.y) * R.y;
+	const float tz0 = -O.z * R.z, tz1 = (sizeZ - O.z) * R.z;
+	const float3 tmin = make_float3(min(tx0, tx1), min(ty0, ty1), min(tz0, tz1));
+	const float3 tmax = make_float3(max(tx0, tx1), max(ty0, ty1), max(tz0, tz1));
+	const float tEnter = max(max(tmin.x, tmin.y), max(tmin.z, 0.0f));
+	const float tExit = min(min(tmax.x, tmax.y), tmax.z);
+	if (tEnter >= tExit) return false;
+
+	// Walk in whole columns; the column after a step is known, so no epsilons.
+	float t = tEnter;
+	int axis = tEnter == tmin.x ? 0 : tEnter == tmin.z ? 2 : 1;
+	int level = static_cast<int>(mips.size()) - 1;
+	const float3 entry = O + D * t;
+	int ix = clamp(static_cast<int>(entry.x), 0, sizeX - 1), iz = clamp(static_cast<int>(entry.z), 0, sizeZ - 1);
+
+	while (t < tExit)
+	{
+		const int x = ix >> level, z = iz >> level;
+		const float h = mips[level][static_cast<size_t>(x) * mipSizes[level].y + z] + 1.0f;
+
+		// Leave the cell through its nearest x or z boundary.
+		const int bx = (D.x > 0 ? x + 1 : x) << level, bz = (D.z > 0 ? z + 1 : z) << level;
+		const float cx = (bx - O.x) * R.x, cz = (bz - O.z) * R.z;
+		const float tCell = min(min(cx, cz), tExit);
+		const float y = O.y + D.y * t;
+
+		if (min(y, O.y + D.y * tCell) >= h)
+		{
+			// Passes over the whole cell.
+			const int x0 = x << level, z0 = z << level, x1 = ((x + 1) << level) - 1, z1 = ((z + 1) << level) - 1;
+			const int px = ix, pz = iz;
+			t = tCell;
+
+			if (cx < cz)
+			{
+				axis = 0, ix = D.x > 0 ? bx : bx - 1;
+				iz = clamp(static_cast<int>(O.z + D.z * t), z0, z1);
+			}
+			else
+			{
+				axis = 2, iz = D.z > 0 ? bz : bz - 1;
+				ix = clamp(static_cast<int>(O.x + D.x * t), x0, x1);
+			}
+
+			if (ix < 0 || iz < 0 || ix >= sizeX || iz >= sizeZ) return false;
+
+			// Climb when the step left the parent cell too. A descending ray can't clear
+			// the parent it dipped into, so within the same parent the climb is wasted.
+			if (level + 1 < static_cast<int>(mips.size()) && (D.y > 0 || ((px ^ ix) | (pz ^ iz)) >> (level + 1))) level++;
+		}
+		else if (level > 0)
+		{
+			level--;
+		}
+		else
+		{
+			// Hits this column: its side where the ray enters below the top, else the top.
+			if (y >= h) t = (h - O.y) * R.y, axis = 1;
+			hit.t = t, hit.x = x, hit.z = z, hit.axis = axis;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+float3 HeightfieldTracer::Shade(const float3& D, const Hit& hit) const
+{
+	// Light from the low x, low z corner, as the map tiles do.
+	const float3 L = normalize(make_float3(-1.0f, 1.5f, -1.0f));
+	float3 N;
+
+	if (hit.axis == 1)
+	{
+		// Top faces get the slope of the heightfield, so hills read without voxel detail.
+		N = normalize(make_float3(static_cast<float>(Height(hit.x - 1, hit.z) - Height(hit.x + 1, hit.z)), 2.0f,
+			static_cast<float>(Height(hit.x, hit.z - 1) - Height(hit.x, hit.z + 1))));
+	}
+	else
+	{
+		N = hit.axis == 0 ? make_float3(D.x > 0 ? -1.0f : 1.0f, 0, 0) : make_float3(0, 0, D.z > 0 ? -1.0f : 1.0f);
+	}
+
+	const uint16_t color = colors[biomes[static_cast<size_t>(hit.x) * sizeZ + hit.z] & 15];
+	const float3 albedo = make_float3(((color >> 8) & 15) / 15.0f, ((color >> 4) & 15) / 15.0f, (color & 15) / 15.0f);
+	return albedo * (0.35f + 0.75f * max(dot(N, L), 0.0f));
+}
+
+void HeightfieldTracer::Render(const mat4& camera, uint* pixels, int width, int height, bool window) const
+{
+	PROFILE_SCOPE("Heightfield render");
+	const float aspectRatio = static_cast<float>(width) / height;
+
+	View view;
+	view.E = TransformPosition(make_float3(0), camera);
+	view.p0 = TransformPosition(make_float3(aspectRatio, 1, 2.2f), camera);
+	view.right = TransformPosition(make_float3(-aspectRatio, 1, 2.2f), camera) - view.p0;
+	view.down = TransformPosition(make_float3(aspectRatio, -1, 2.2f), camera) - view.p0;
+
+	static JobManager* jm = JobManager::GetJobManager();
+	static RenderJob rj[HEIGHTFIELDJOBS];
+
+	for (int i = 0; i < HEIGHTFIELDJOBS; i++)
+	{
+		rj[i].tracer = this, rj[i].view = view, rj[i].pixels = pixels;
+		rj[i].width = width, rj[i].height = height, rj[i].first = i, rj[i].window = window;
+		jm->AddJob2(&rj[i]);
+	}
+
+	jm->RunJobs();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "src/world/generator.h"
+
+#include <vector>
+
+namespace Tmpl8
+{
+	// CPU raymarcher for heightfield previews: no voxels needed, so a world can be
+	// looked at as soon as its heightmap exists. A max-mip pyramid over the column
+	// levels lets rays skip every cell they pass over: a ray only descends into a
+	// cell whose highest column it actually dips below.
+	class HeightfieldTracer
+	{
+	public:
+		// Rebuilds the pyramid over sizeX x sizeZ columns, laid out like Columns:
+		// column (x, z) at columns[x * sizeZ + z].
+		void Build(const Column* columns, int sizeX, int sizeZ);
+		void Build(const Columns& world) { Build(&world[0][0], 1024, 1024); }
+
+		// Renders the heightfield for a camera matrix, with the camera setup of
+		// World::Render. Pixels are RGBA bytes, ready for stbi_write_png; for the
+		// window they are BGRA and linear, as the display shader applies the sqrt.
+		void Render(const mat4& camera, uint* pixels, int width, int height, bool window = false) const;
+
+		int GetLevels() const { return static_cast<int>(mips.size()); }
+
+	private:
+		class MipJob;
+		class RenderJob;
+
+		struct Hit
+		{
+			float t;
+			int x, z, axis;		// column, face normal axis (0 x, 1 y, 2 z)
+		};
+
+		bool Trace(const float3& O, const float3& D, Hit& hit) const;
+		float3 Shade(const float3& D, const Hit& hit) const;
+		int Height(int x, int z) const;
+
+		int sizeX = 0, sizeZ = 0;
+		std::vector<uint8_t> biomes;
+
+		// mips[0] holds the column levels, mips[k] the maximum of 2^k x 2^k columns.
+		std::vector<std::vector<uint8_t>> mips;
+		std::vector<int2> mipSizes;
+	};
+}
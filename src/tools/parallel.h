@@ -0,0 +1,34 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace Tmpl8
+{
+	// Runs f(i) for i in [0, count) on up to threads threads, the calling
+	// thread included. Indices are handed out dynamically, so uneven work
+	// (compression, file writes) balances itself.
+	template <typename F> void ParallelFor(const int count, const int threads, F&& f)
+	{
+		std::atomic<int> next = 0;
+		auto run = [&]()
+		{
+			for (int i = next++; i < count; i = next++) f(i);
+		};
+
+		std::vector<std::thread> helpers;
+		for (int t = 1; t < std::min(threads, count); t++)
+		{
+			helpers.emplace_back(run);
+		}
+
+		run();
+
+		for (auto& helper : helpers)
+		{
+			helper.join();
+		}
+	}
+}
@@ -0,0 +1,214 @@
+#include "precomp.h"
+#include "pyramid.h"
+#include "parallel.h"
+
+#include "src/world/biome.h"
+
+#include "stb_image_write.h"
+
+#include <filesystem>
+
+using namespace Tmpl8;
+
+namespace
+{
+	// 2x2 box filter of two RGBA8 rows into one row of width pixels, four
+	// output pixels per iteration with 16-bit sums and round to nearest.
+	void DownsampleRow(const uint* top, const uint* bottom, uint* out, const int width)
+	{
+		const __m128i zero = _mm_setzero_si128(), bias = _mm_set1_epi16(2);
+		int x = 0;
+
+		for (; x + 4 <= width; x += 4)
+		{
+			__m128i result[2];
+
+			for (int half = 0; half < 2; half++)
+			{
+				const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(top + x * 2 + half * 4));
+				const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom + x * 2 + half * 4));
+
+				// Vertical sums of source pixels 0, 1 and 2, 3.
+				const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+				const __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+
+				// Horizontal pairs: (0 + 1), (2 + 3).
+				const __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+				result[half] = _mm_srli_epi16(_mm_add_epi16(sum, bias), 2);
+			}
+
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm_packus_epi16(result[0], result[1]));
+		}
+
+		for (; x < width; x++)
+		{
+			const uint p[4] = { top[x * 2], top[x * 2 + 1], bottom[x * 2], bottom[x * 2 + 1] };
+			uint pixel = 0;
+
+			for (int shift = 0; shift < 32; shift += 8)
+			{
+				const uint sum = ((p[0] >> shift) & 255) + ((p[1] >> shift) & 255) + ((p[2] >> shift) & 255) + ((p[3] >> shift) & 255);
+				pixel |= ((sum + 2) >> 2) << shift;
+			}
+
+			out[x] = pixel;
+		}
+	}
+}
+
+TilePyramid::TilePyramid(const std::string& directory, int threads) :
+	directory(directory),
+	threads(threads > 0 ? threads : max(1, static_cast<int>(std::thread::hardware_concurrency())))
+{
+	for (int zoom = 0; zoom <= BASE_ZOOM; zoom++)
+	{
+		levels[zoom].resize(static_cast<size_t>(Size(zoom)) * Size(zoom));
+		dirty[zoom].resize(Tiles(zoom) * Tiles(zoom));
+	}
+
+	hashes.resize(Tiles(BASE_ZOOM) * Tiles(BASE_ZOOM));
+}
+
+int TilePyramid::Update(const Columns& world)
+{
+	PROFILE_SCOPE("Tile pyramid");
+	const int base = Tiles(BASE_ZOOM);
+
+	// Base tiles: rehash the source columns, reshade only what changed.
+	ParallelFor(base * base, threads, [&](int i)
+	{
+		const uint64_t hash = Hash(world, i / base, i % base);
+		dirty[BASE_ZOOM][i] = !valid || hash != hashes[i];
+
+		if (dirty[BASE_ZOOM][i])
+		{
+			hashes[i] = hash;
+			Shade(world, i / base, i % base);
+		}
+	});
+
+	valid = true;
+
+	// Coarser levels: a tile is stale when any of its four children is.
+	for (int zoom = BASE_ZOOM - 1; zoom >= 0; zoom--)
+	{
+		const int tiles = Tiles(zoom), children = Tiles(zoom + 1);
+		std::vector<int> stale;
+
+		for (int i = 0; i < tiles * tiles; i++)
+		{
+			const int row = i / tiles, column = i % tiles;
+			const uint8_t* below = &dirty[zoom + 1][row * 2 * children + column * 2];
+			dirty[zoom][i] = below[0] | below[1] | below[children] | below[children + 1];
+			if (dirty[zoom][i]) stale.push_back(i);
+		}
+
+		ParallelFor(static_cast<int>(stale.size()), threads, [&](int i)
+		{
+			Downsample(zoom, stale[i] / tiles, stale[i] % tiles);
+		});
+	}
+
+	std::vector<Tile> tiles;
+
+	for (int zoom = 0; zoom <= BASE_ZOOM; zoom++)
+	{
+		for (int i = 0; i < Tiles(zoom) * Tiles(zoom); i++)
+		{
+			if (dirty[zoom][i]) tiles.push_back({ zoom, i / Tiles(zoom), i % Tiles(zoom) });
+		}
+
+		for (int column = 0; column < Tiles(zoom); column++)
+		{
+			std::error_code error;
+			std::filesystem::create_directories(directory + "/" + std::to_string(zoom) + "/" + std::to_string(column), error);
+		}
+	}
+
+	std::atomic<int> written = 0;
+
+	ParallelFor(static_cast<int>(tiles.size()), threads, [&](int i)
+	{
+		if (Encode(tiles[i])) written++;
+	});
+
+	return written;
+}
+
+// Hashes the columns of a base tile plus a one column apron, since shading
+// at the tile border depends on the neighbouring heights.
+uint64_t TilePyramid::Hash(const Columns& world, int row, int column) const
+{
+	const int x0 = max(row * TILE_SIZE - 1, 0), x1 = min((row + 1) * TILE_SIZE + 1, 1024);
+	const int z0 = max(column * TILE_SIZE - 1, 0), z1 = min((column + 1) * TILE_SIZE + 1, 1024);
+	uint64_t hash = 14695981039346656037ull;
+
+	for (int x = x0; x < x1; x++)
+	{
+		const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&world[x][z0]);
+		const size_t size = (z1 - z0) * sizeof(Column);
+		size_t i = 0;
+
+		for (; i + 8 <= size; i += 8)
+		{
+			uint64_t word;
+			memcpy(&word, bytes + i, 8);
+			hash = (hash ^ word) * 1099511628211ull;
+		}
+
+		for (; i < size; i++)
+		{
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+	}
+
+	return hash;
+}
+
+void TilePyramid::Shade(const Columns& world, int row, int column)
+{
+	std::vector<uint>& image = levels[BASE_ZOOM];
+
+	for (int x = row * TILE_SIZE; x < (row + 1) * TILE_SIZE; x++)
+	{
+		for (int z = column * TILE_SIZE; z < (column + 1) * TILE_SIZE; z++)
+		{
+			// Light from the low x, low z corner, brighter on slopes facing it.
+			const int slope = (world[max(x - 1, 0)][z].level - world[min(x + 1, 1023)][z].level) +
+				(world[x][max(z - 1, 0)].level - world[x][min(z + 1, 1023)].level);
+			const float shade = clamp(0.8f + slope * 0.04f, 0.45f, 1.25f);
+
+			const uint16_t color = colors[world[x][z].biome & 15];
+			const uint r = min(static_cast<uint>(((color >> 8) & 15) * 17 * shade), 255u);
+			const uint g = min(static_cast<uint>(((color >> 4) & 15) * 17 * shade), 255u);
+			const uint b = min(static_cast<uint>((color & 15) * 17 * shade), 255u);
+
+			image[static_cast<size_t>(x) * Size(BASE_ZOOM) + z] = 0xff000000 | (b << 16) | (g << 8) | r;
+		}
+	}
+}
+
+void TilePyramid::Downsample(int zoom, int row, int column)
+{
+	const std::vector<uint>& source = levels[zoom + 1];
+	std::vector<uint>& target = levels[zoom];
+	const size_t sourceSize = Size(zoom + 1), targetSize = Size(zoom);
+
+	for (int y = 0; y < TILE_SIZE; y++)
+	{
+		const size_t x = static_cast<size_t>(row) * TILE_SIZE + y;
+		const uint* top = &source[(x * 2) * sourceSize + column * TILE_SIZE * 2];
+		DownsampleRow(top, top + sourceSize, &target[x * targetSize + column * TILE_SIZE], TILE_SIZE);
+	}
+}
+
+bool TilePyramid::Encode(const Tile& tile)
+{
+	// Slippy map x runs along the columns (z), y along the rows (x).
+	const std::string path = directory + "/" + std::to_string(tile.zoom) + "/" +
+		std::to_string(tile.column) + "/" + std::to_string(tile.row) + ".png";
+	const size_t size = Size(tile.zoom);
+	const uint* origin = &levels[tile.zoom][tile.row * TILE_SIZE * size + tile.column * TILE_SIZE];
+
+	return stbi_write_png(path.c_str(), TILE_SIZE, TILE_SIZE, 4, origin, static_cast<int>(size * sizeof(uint))) != 0;
+}
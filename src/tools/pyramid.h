@@ -0,0 +1,54 @@
+#pragma once
+
+#include "src/world/generator.h"
+
+#include <string>
+#include <vector>
+
+namespace Tmpl8
+{
+	// Slippy-map pyramid of the biome colored, hill shaded heightfield, written
+	// as <directory>/<zoom>/<x>/<y>.png with 256x256 tiles. The full 1024x1024
+	// columns sit at BASE_ZOOM, every zoom level above is a 2x2 box filter of the
+	// level below it.
+	class TilePyramid
+	{
+	public:
+		static constexpr int TILE_SIZE = 256;
+		static constexpr int BASE_ZOOM = 2;
+
+		explicit TilePyramid(const std::string& directory, int threads = 0);
+
+		// Rebuilds and writes every tile whose source columns changed since
+		// the previous update, returns the number of tiles written.
+		int Update(const Columns& world);
+
+		// Forces the next update to rebuild the whole pyramid.
+		void Invalidate() { valid = false; }
+
+		const std::string& GetDirectory() const { return directory; }
+
+	private:
+		struct Tile
+		{
+			int zoom, row, column;
+		};
+
+		static int Tiles(const int zoom) { return 1 << zoom; }
+		static int Size(const int zoom) { return TILE_SIZE << zoom; }
+
+		uint64_t Hash(const Columns& world, int row, int column) const;
+		void Shade(const Columns& world, int row, int column);
+		void Downsample(int zoom, int row, int column);
+		bool Encode(const Tile& tile);
+
+		std::string directory;
+		int threads;
+		bool valid = false;
+
+		// RGBA8 image per zoom level, Size(zoom) pixels square.
+		std::vector<uint> levels[BASE_ZOOM + 1];
+		std::vector<uint8_t> dirty[BASE_ZOOM + 1];
+		std::vector<uint64_t> hashes;
+	};
+}
@@ -0,0 +1,191 @@
+#include "precomp.h"
+#include "render.h"
+#include "heightfield.h"
+
+#include "src/world/generator.h"
+#include "src/world/preset.h"
+
+#include "stb_image_write.h"
+
+#include <filesystem>
+#include <string>
+
+using namespace Tmpl8;
+
+namespace
+{
+	struct CameraPoint
+	{
+		float3 position, target;
+	};
+
+	// Same curve as the spline playback in Terrain::Tick.
+	float3 CatmullRom(const float3& p0, const float3& p1, const float3& p2, const float3& p3, const float t)
+	{
+		const float3 c = 2 * p0 - 5 * p1 + 4 * p2 - p3, d = 3 * (p1 - p2) + p3 - p0;
+		return 0.5f * (2 * p1 + ((p2 - p0) * t) + (c * t * t) + (d * t * t * t));
+	}
+
+	// camera.dat holds the view direction, then the position.
+	bool LoadCamera(const std::string& path, std::vector<mat4>& views)
+	{
+		FILE* f = fopen(path.c_str(), "rb");
+		if (!f) return false;
+
+		float3 direction, position;
+		const bool ok = fread(&direction, sizeof(direction), 1, f) == 1 && fread(&position, sizeof(position), 1, f) == 1;
+		fclose(f);
+
+		if (ok) views.push_back(mat4::LookAt(position, position + direction));
+		return ok;
+	}
+
+	// spline.bin holds position, target pairs; the path is closed, like the playback.
+	bool LoadSpline(const std::string& path, int frames, std::vector<mat4>& views)
+	{
+		FILE* f = fopen(path.c_str(), "rb");
+		if (!f) return false;
+
+		std::vector<CameraPoint> points;
+		CameraPoint point;
+		while (fread(&point, sizeof(point), 1, f) == 1) points.push_back(point);
+		fclose(f);
+
+		const int N = static_cast<int>(points.size());
+		if (N == 0) return false;
+		if (frames <= 0) frames = N;
+
+		for (int frame = 0; frame < frames; frame++)
+		{
+			const float position = static_cast<float>(frame) * N / frames;
+			const int index = static_cast<int>(position);
+			const float t = position - index;
+
+			const CameraPoint& p0 = points[(index + N - 1) % N], & p1 = points[index];
+			const CameraPoint& p2 = points[(index + 1) % N], & p3 = points[(index + 2) % N];
+			views.push_back(mat4::LookAt(CatmullRom(p0.position, p1.position, p2.position, p3.position, t),
+				CatmullRom(p0.target, p1.target, p2.target, p3.target, t)));
+		}
+
+		return true;
+	}
+}
+
+int RunRender(int argc, char* argv[])
+{
+	std::string preset = "default", camera = "camera.dat", spline, sky = "assets/sky.hdr", output = "render";
+	int seed = 0, frames = 0, width = SCRWIDTH, height = SCRHEIGHT;
+	bool heightfield = false;
+
+	for (int i = 0; i < argc; i++)
+	{
+		const bool value = i + 1 < argc;
+		if (!strcmp(argv[i], "--preset") && value) preset = argv[++i];
+		else if (!strcmp(argv[i], "--seed") && value) seed = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--camera") && value) camera = argv[++i];
+		else if (!strcmp(argv[i], "--spline") && value) spline = argv[++i];
+		else if (!strcmp(argv[i], "--frames") && value) frames = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--sky") && value) sky = argv[++i];
+		else if (!strcmp(argv[i], "--out") && value) output = argv[++i];
+		else if (!strcmp(argv[i], "--heightfield")) heightfield = true;
+		else if (!strcmp(argv[i], "--size") && value)
+		{
+			if (sscanf(argv[++i], "%ix%i", &width, &height) != 2 || width <= 0 || height <= 0)
+			{
+				printf("invalid render size: %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else
+		{
+			printf("unknown render argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	std::vector<mat4> views;
+	if (spline.empty() ? !LoadCamera(camera, views) : !LoadSpline(spline, frames, views))
+	{
+		printf("could not load camera from %s\n", spline.empty() ? camera.c_str() : spline.c_str());
+		return 1;
+	}
+
+	if (!heightfield && !std::filesystem::exists(sky))
+	{
+		printf("could not find sky %s\n", sky.c_str());
+		return 1;
+	}
+
+	const Preset* found = nullptr;
+	for (const Preset& candidate : presets)
+	{
+		if (!_stricmp(candidate.name, preset.c_str())) found = &candidate;
+	}
+
+	Layers layers;
+	if (!found || !LoadPreset(found->path, layers))
+	{
+		printf("could not load preset %s\n", preset.c_str());
+		return 1;
+	}
+
+	// Same seed offsetting as the batch sweep and the export.
+	for (Layer* layer : { &layers.continentalness, &layers.erosion, &layers.peaks, &layers.temperature,
+		&layers.humidity, &layers.contdensity, &layers.density, &layers.peakdensity })
+	{
+		layer->seed += seed;
+	}
+
+	Columns* world = new Columns;
+	Parameters parameters;
+	SetParameters(layers);
+	GenerateHeightmap(world, layers, parameters);
+	ErodeHeightmap(world, layers, parameters);
+
+	// The heightfield preview traces the columns directly; otherwise voxelize and load the sky
+	// and light scale as set up by Terrain::Init.
+	HeightfieldTracer tracer;
+	World* target = nullptr;
+
+	if (heightfield)
+	{
+		tracer.Build(*world);
+	}
+	else
+	{
+		target = new World(0);
+		for (int thread = 0; thread < THREAD_LIMIT; thread++) Generate(target, world, layers, parameters, thread);
+
+		Game::skyDomeLightScale = 6.0f;
+		target->LoadSky(sky.c_str(), Game::skyDomeScale);
+	}
+
+	std::vector<uint> pixels(static_cast<size_t>(width) * height);
+	int written = 0;
+
+	for (size_t i = 0; i < views.size(); i++)
+	{
+		Timer timer;
+		if (heightfield) tracer.Render(views[i], pixels.data(), width, height);
+		else target->RenderCPU(views[i], pixels.data(), width, height);
+		const float milliseconds = timer.elapsed() * 1000.0f;
+
+		char suffix[16] = "";
+		if (views.size() > 1) snprintf(suffix, sizeof(suffix), "_%04i", static_cast<int>(i));
+		const std::string path = output + suffix + ".png";
+
+		if (stbi_write_png(path.c_str(), width, height, 4, pixels.data(), width * sizeof(uint)))
+		{
+			printf("rendered %s (%.1f ms)\n", path.c_str(), milliseconds);
+			written++;
+		}
+		else
+		{
+			printf("could not write %s\n", path.c_str());
+		}
+	}
+
+	delete target;
+	delete world;
+	return written == static_cast<int>(views.size()) ? 0 : 1;
+}
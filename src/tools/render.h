@@ -0,0 +1,7 @@
+#pragma once
+
+// Headless CPU rendering of a generated world: one png for a camera pose (camera.dat)
+// or a sequence along a recorded spline path (spline.bin), as the window would show it.
+// --heightfield skips voxelization and renders a shaded preview of the columns instead.
+// Usage: --render [--preset name] [--seed N] [--camera camera.dat] [--spline spline.bin] [--frames N] [--size WxH] [--sky file.hdr] [--heightfield] [--out prefix]
+int RunRender(int argc, char* argv[]);
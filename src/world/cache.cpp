@@ -0,0 +1,216 @@
+#include "precomp.h"
+#include "cache.h"
+
+#include <filesystem>
+
+namespace Tmpl8
+{
+	namespace
+	{
+		constexpr uint SPILL_MAGIC = 0x48435757; // "WWCH"
+		constexpr uint SPILL_VERSION = 1;
+
+		// FNV-1a, fed field by field.
+		struct Hasher
+		{
+			uint64_t hash = 14695981039346656037ull;
+
+			void Add(const void* data, const size_t size)
+			{
+				const uint8_t* bytes = static_cast<const uint8_t*>(data);
+				for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+			}
+
+			void Add(const int value) { Add(&value, sizeof(value)); }
+			void Add(const bool value) { Add(static_cast<int>(value)); }
+			void Add(const float value) { Add(&value, sizeof(value)); }
+
+			void Add(const Layer& layer)
+			{
+				for (int value : { layer.seed, layer.noiseIndex, layer.rotationIndex, layer.fractalIndex,
+					layer.fractalOctaves, layer.distanceIndex, layer.returnIndex, layer.domainIndex })
+				{
+					Add(value);
+				}
+
+				for (float value : { layer.frequency, layer.fractalLacunarity, layer.fractalGain, layer.fractalWeightedStrength,
+					layer.fractalPingPongStrength, layer.cellularJitter, layer.domainAmplitude })
+				{
+					Add(value);
+				}
+
+				for (float point : layer.points) Add(point);
+			}
+		};
+
+		template <typename T> void Write(gzFile f, const std::vector<T>& data)
+		{
+			const uint size = static_cast<uint>(data.size());
+			gzwrite(f, &size, sizeof(size));
+			if (size) gzwrite(f, data.data(), size * sizeof(T));
+		}
+
+		template <typename T> bool Read(gzFile f, std::vector<T>& data)
+		{
+			uint size = 0;
+			if (gzread(f, &size, sizeof(size)) != sizeof(size)) return false;
+			data.resize(size);
+			return size == 0 || gzread(f, data.data(), size * sizeof(T)) == static_cast<int>(size * sizeof(T));
+		}
+	}
+
+	uint64_t WorldCache::Hash(const Layers& layers, const Parameters& parameters)
+	{
+		Hasher hasher;
+
+		for (const Layer* layer : { &layers.continentalness, &layers.erosion, &layers.peaks, &layers.temperature,
+			&layers.humidity, &layers.contdensity, &layers.density, &layers.peakdensity })
+		{
+			hasher.Add(*layer);
+		}
+
+		// Interface state (ui, dirty, presetIndex) doesn't change the generated world.
+		for (bool value : { parameters.blend, parameters.waterFill, parameters.waterErosion, parameters.caveInverted })
+		{
+			hasher.Add(value);
+		}
+
+		for (int value : { parameters.dimension, parameters.layerIndex, parameters.terrainScaleX, parameters.terrainScaleZ,
+			parameters.terrainOffsetX, parameters.terrainOffsetZ, parameters.erosionIterations })
+		{
+			hasher.Add(value);
+		}
+
+		return hasher.hash;
+	}
+
+	bool WorldCache::Restore(const uint64_t key, Columns* world, World* target, int& voxels)
+	{
+		auto entry = std::find_if(entries.begin(), entries.end(), [key](const Entry& e) { return e.key == key; });
+
+		if (entry == entries.end())
+		{
+			Entry spilled;
+
+			if (spill.empty() || !Unspill(key, spilled))
+			{
+				return false;
+			}
+
+			bytes += spilled.Bytes();
+			entries.push_front(std::move(spilled));
+			Evict();
+		}
+		else
+		{
+			// Most recently used moves to the front.
+			entries.splice(entries.begin(), entries, entry);
+		}
+
+		const Entry& hit = entries.front();
+		*world = *hit.columns;
+		target->LoadSnapshot(hit.snapshot);
+		voxels = hit.voxels;
+		return true;
+	}
+
+	void WorldCache::Store(const uint64_t key, const Columns* world, World* target, const int voxels)
+	{
+		entries.remove_if([&](const Entry& e) { if (e.key == key) bytes -= e.Bytes(); return e.key == key; });
+
+		Entry entry;
+		entry.key = key;
+		entry.voxels = voxels;
+		*entry.columns = *world;
+		target->SaveSnapshot(entry.snapshot);
+
+		bytes += entry.Bytes();
+		entries.push_front(std::move(entry));
+		Evict();
+	}
+
+	void WorldCache::Evict()
+	{
+		// Always keep the most recent world, even if it's over budget by itself.
+		while (bytes > budget && entries.size() > 1)
+		{
+			const Entry& last = entries.back();
+
+			if (!spill.empty())
+			{
+				Spill(last);
+			}
+
+			bytes -= last.Bytes();
+			entries.pop_back();
+		}
+	}
+
+	std::string WorldCache::SpillPath(const uint64_t key) const
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.world", static_cast<unsigned long long>(key));
+		return spill + "/" + name;
+	}
+
+	bool WorldCache::Spill(const Entry& entry) const
+	{
+		const std::string path = SpillPath(entry.key);
+
+		if (std::filesystem::exists(path))
+		{
+			return true; // same key, same world
+		}
+
+		std::filesystem::create_directories(spill);
+		gzFile f = gzopen(path.c_str(), "wb1");
+
+		if (!f)
+		{
+			return false;
+		}
+
+		const uint header[2] = { SPILL_MAGIC, SPILL_VERSION };
+		gzwrite(f, header, sizeof(header));
+		gzwrite(f, &entry.key, sizeof(entry.key));
+		gzwrite(f, &entry.voxels, sizeof(entry.voxels));
+		gzwrite(f, entry.columns.get(), sizeof(Columns));
+		Write(f, entry.snapshot.cells);
+		Write(f, entry.snapshot.values);
+		Write(f, entry.snapshot.bricks);
+		Write(f, entry.snapshot.zeroes);
+		gzclose(f);
+		return true;
+	}
+
+	bool WorldCache::Unspill(const uint64_t key, Entry& entry) const
+	{
+		gzFile f = gzopen(SpillPath(key).c_str(), "rb");
+
+		if (!f)
+		{
+			return false;
+		}
+
+		uint header[2] = {};
+		bool valid = gzread(f, header, sizeof(header)) == sizeof(header) &&
+			header[0] == SPILL_MAGIC && header[1] == SPILL_VERSION &&
+			gzread(f, &entry.key, sizeof(entry.key)) == sizeof(entry.key) && entry.key == key &&
+			gzread(f, &entry.voxels, sizeof(entry.voxels)) == sizeof(entry.voxels) &&
+			gzread(f, entry.columns.get(), sizeof(Columns)) == sizeof(Columns) &&
+			Read(f, entry.snapshot.cells) && Read(f, entry.snapshot.values) &&
+			Read(f, entry.snapshot.bricks) && Read(f, entry.snapshot.zeroes) &&
+			entry.snapshot.cells.size() == entry.snapshot.values.size() &&
+			entry.snapshot.bricks.size() == entry.snapshot.zeroes.size() * BRICKSIZE;
+		gzclose(f);
+
+		// A damaged file must not index outside the grid or the snapshot bricks.
+		for (size_t i = 0; valid && i < entry.snapshot.cells.size(); i++)
+		{
+			const uint value = entry.snapshot.values[i];
+			valid = entry.snapshot.cells[i] < GRIDSIZE && ((value & 1) == 0 || (value >> 1) < entry.snapshot.zeroes.size());
+		}
+
+		return valid;
+	}
+}
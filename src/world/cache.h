@@ -0,0 +1,53 @@
+#pragma once
+
+#include "src/world/generator.h"
+
+#include <list>
+#include <memory>
+#include <string>
+
+namespace Tmpl8
+{
+	// LRU cache of generated worlds: the columns plus a compact snapshot of the voxel world,
+	// keyed by a hash of everything that affects generation. Least recently used worlds are
+	// dropped (or spilled to disk, if a spill directory is set) once the memory budget is exceeded.
+	class WorldCache
+	{
+	public:
+		WorldCache(const size_t budget = size_t(512) << 20) : budget(budget)
+		{
+			// Empty
+		}
+
+		// Stable over runs and builds: hashes field values, not struct memory.
+		static uint64_t Hash(const Layers& layers, const Parameters& parameters);
+
+		// Restores columns, voxel world and voxel count; returns false on a miss.
+		bool Restore(const uint64_t key, Columns* world, World* target, int& voxels);
+		void Store(const uint64_t key, const Columns* world, World* target, const int voxels);
+
+		void SetSpillDirectory(const std::string& directory) { spill = directory; }
+		size_t GetCount() const { return entries.size(); }
+		size_t GetBytes() const { return bytes; }
+
+	private:
+		struct Entry
+		{
+			uint64_t key = 0;
+			int voxels = 0;
+			std::unique_ptr<Columns> columns = std::make_unique<Columns>();
+			WorldSnapshot snapshot;
+
+			size_t Bytes() const { return sizeof(Columns) + snapshot.Bytes(); }
+		};
+
+		std::string SpillPath(const uint64_t key) const;
+		bool Spill(const Entry& entry) const;
+		bool Unspill(const uint64_t key, Entry& entry) const;
+		void Evict();
+
+		std::list<Entry> entries; // most recently used first
+		size_t budget, bytes = 0;
+		std::string spill;
+	};
+}
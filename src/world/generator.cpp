@@ -0,0 +1,221 @@
+#include "precomp.h"
+#include "generator.h"
+
+#include "src/math/lerp.h"
+#include "src/world/biome.h"
+#include "src/interface/interface.h"
+
+#include <cmath>
+
+namespace Tmpl8
+{
+	void SetParameters(Layers& layers)
+	{
+		SetParameters(layers.continentalness);
+		SetParameters(layers.erosion);
+		SetParameters(layers.peaks);
+		SetParameters(layers.humidity);
+		SetParameters(layers.contdensity);
+		SetParameters(layers.density);
+		SetParameters(layers.peakdensity);
+	}
+
+	int GenerateHeightmap(Columns* world, const Layers& layers, const Parameters& parameters)
+	{
+		// Layers that can be visualized, in interface order.
+		const std::array<const Layer*, 7> visualized =
+		{
+			&layers.continentalness,
+			&layers.erosion,
+			&layers.peaks,
+			&layers.humidity,
+			&layers.contdensity,
+			&layers.density,
+			&layers.peakdensity
+		};
+
+		int voxels = 0;
+
+		for (int x = 0; x < 1024; x++)
+		{
+			for (int z = 0; z < 1024; z++)
+			{
+				float fx = static_cast<float>(x + parameters.terrainOffsetX),
+					fz = static_cast<float>(z + parameters.terrainOffsetZ);
+
+				float continentalnessNoise =
+					SampleCurve(layers.continentalness, (layers.continentalness.noise.GetNoise(fx, fz) + 1.0f) / 2.0f) * layers.continentalness.noise.GetNoise(fx, fz);
+				float erosionNoise =
+					SampleCurve(layers.erosion, (layers.erosion.noise.GetNoise(fx, fz) + 1.0f) / 2.0f) * layers.erosion.noise.GetNoise(fx, fz);
+				float peaksNoise =
+					SampleCurve(layers.peaks, (layers.peaks.noise.GetNoise(fx, fz) + 1.0f) / 2.0f) * layers.peaks.noise.GetNoise(fx, fz);
+
+				float elevationNoise = clamp(((continentalnessNoise * 200.0f +
+					(peaksNoise + 0.3f) * 40.0f) * erosionNoise + 120.0f) / 2.0f, 0.0f, 240.0f);
+				float humidityNoise =
+					0.1f * powf(2, -10.0f * powf(x / 512.0f - 1.0f, 2.0f)) +
+					layers.humidity.noise.GetNoise(fx, fz);
+
+				const uint8_t biome = BiomeFunction(elevationNoise / 60.0f - 1.0f, humidityNoise);
+
+				uint8_t level = static_cast<uint8_t>(elevationNoise);
+				level = parameters.layerIndex ?
+					static_cast<uint8_t>((visualized[parameters.layerIndex - 1]->
+						noise.GetNoise(fx, fz) + 1.0f) * 30.0f) : level;
+
+				// Not entirely accurate, but way easier.
+				voxels += level;
+
+				(*world)[x][z] =
+				{
+					level,
+					biome
+				};
+			}
+		}
+
+		return voxels;
+	}
+
+	void ErodeHeightmap(Columns* world, const Layers& layers, const Parameters& parameters)
+	{
+		// Local random state, so equal layers erode equally (and threads don't share state).
+		uint seed = 362436069u + static_cast<uint>(layers.erosion.seed) * 2654435761u;
+		seed = seed ? seed : 1;
+
+		for (int iteration = 0; iteration < parameters.erosionIterations; iteration++)
+		{
+			constexpr float scale = 1.0f;
+
+			// Start location
+			float rx = RandomUInt(seed) % parameters.terrainScaleX,
+				rz = RandomUInt(seed) % parameters.terrainScaleZ;
+			float vx = (static_cast<int>(RandomUInt(seed)) % 10) / 1000.0f,
+				vz = (static_cast<int>(RandomUInt(seed)) % 10) / 1000.0f;
+
+			for (int step = 0; step < 128; step++)
+			{
+				for (int x = -1; x < 2; x++)
+				{
+					// Out-of-bound check
+					if (((int)rx + x) < 0 || ((int)rx + x) > parameters.terrainScaleX - 1)
+					{
+						continue;
+					}
+
+					for (int z = -1; z < 2; z++)
+					{
+						// Out-of-bound check
+						if (((int)rz + z) < 0 || ((int)rz + z) > parameters.terrainScaleX - 1)
+						{
+							continue;
+						}
+
+						vx += x * (255 - (*world)[rx + x][rz + z].level) / 255.0f;
+						vz += z * (255 - (*world)[rx + x][rz + z].level) / 255.0f;
+					}
+				}
+
+				// Out-of-bound check
+				if ((int)(rx + vx * scale) < 0 || (int)(rx + vx * scale) > parameters.terrainScaleX - 1 ||
+					(int)(rz + vz * scale) < 0 || (int)(rz + vz * scale) > parameters.terrainScaleX - 1)
+				{
+					break;
+				}
+
+				int delta = (*world)[(int)(rx + vx * scale)][(int)(rz + vz * scale)].level - (*world)[(int)rx][(int)rz].level;
+				if (delta < 0 && (*world)[(int)rx][(int)rz].biome != 12)
+				{
+					(*world)[(int)rx][(int)rz].level = (*world)[(int)(rx + vx * scale)][(int)(rz + vz * scale)].level;
+				}
+
+				// Take step, move with velocity.
+				rx += vx * scale; rz += vz * scale;
+			}
+		}
+	}
+
+	void Generate(World* target, const Columns* world, const Layers& layers, const Parameters& parameters, const int thread)
+	{
+		PROFILE_SCOPE("Voxel section");
+
+		const Layer& contdensity = layers.contdensity;
+		const Layer& density = layers.density;
+		const Layer& peakdensity = layers.peakdensity;
+
+		int section = parameters.terrainScaleX / THREAD_LIMIT;
+		int start = thread * section;
+		int end = start + section;
+
+		for (int x = start; x < end; x++)
+		{
+			for (int z = 0; z < parameters.terrainScaleZ; z++)
+			{
+				const Column& column = (*world)[x][z];
+				const uint8_t level = column.level;
+
+				const uint16_t water = (0x006 + (static_cast<int>(0x006 * level / 60.0f) << 4));
+				uint16_t color = (level < 61 && parameters.dimension) ? water : colors[column.biome];
+
+				if (parameters.blend)
+				{
+					uint16_t nearby = LerpColors
+					(
+						LerpColors(colors[(*world)[max(x - 4, 0)][z].biome], colors[(*world)[min(x + 4, 1023)][z].biome], 0.5f),
+						LerpColors(colors[(*world)[x][max(z - 4, 0)].biome], colors[(*world)[x][min(z + 4, 1023)].biome], 0.5f),
+						0.5f
+					);
+
+					color = LerpColors(nearby, color, 0.5f);
+				}
+
+				if (parameters.layerIndex)
+				{
+					int f = max(static_cast<int>(0x00f * level / 60.0f), 0x001);
+					color = (f << 8) | (f << 4) | f;
+				}
+
+				const float fx = static_cast<float>(x + 0),
+					fz = static_cast<float>(z + 0);
+				float contdensityNoise =
+					SampleCurve(contdensity, (contdensity.noise.GetNoise(fx, fz) + 1.0f) / 2.0f) * contdensity.noise.GetNoise(fx, fz);
+				float peakdensityNoise =
+					SampleCurve(peakdensity, (peakdensity.noise.GetNoise(fx, fz) + 1.0f) / 2.0f) * peakdensity.noise.GetNoise(fx, fz);
+
+				if (parameters.waterFill && level < 61)
+				{
+					for (int y = 60; y > parameters.dimension ? level : 0; y--)
+					{
+						target->Set(x, y, z, color);
+					}
+				}
+
+				for (int y = parameters.dimension ? level : 0; y > -1; y--)
+				{
+					float fy = static_cast<float>(y);
+
+					bool bounds = y < 40 + peakdensityNoise * 4.0f &&
+						y > 36 + peakdensityNoise * 4.0f;
+					bool noodle = abs(contdensityNoise * 10.0f +
+						density.noise.GetNoise(fx, fy, fz) * 5.0f +
+						peakdensity.noise.GetNoise(fx, fy, fz)) < 0.5f;
+
+					if (level > 60 && bounds && noodle)
+					{
+						if (parameters.caveInverted)
+						{
+							target->Set(x, y, z, color);
+						}
+
+						continue;
+					}
+
+					if (!parameters.caveInverted)
+					{
+						target->Set(x, y, z, color);
+					}
+				}
+			}
+		}
+	}
+}
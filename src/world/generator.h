@@ -0,0 +1,44 @@
+#pragma once
+
+#include "src/world/layer.h"
+
+#include <array>
+#include <cstdint>
+
+namespace Tmpl8
+{
+	class World;
+
+	constexpr int THREAD_LIMIT = 32;
+
+	struct alignas(2) Column
+	{
+		uint8_t level, biome;
+	};
+	typedef std::array<std::array<Column, 1024>, 1024> Columns;
+
+	struct Parameters
+	{
+		bool ui = true, dirty = true, blend = true,
+			waterFill = false, waterErosion = false,
+			caveInverted = false;
+
+		int dimension = 1; // 0 = 2d, 1 = 3d
+		int presetIndex = 0, layerIndex = 0;
+		int terrainScaleX = 1024, terrainScaleZ = 1024,
+			terrainOffsetX = 0, terrainOffsetZ = 0;
+		int erosionIterations = 25000;
+	};
+
+	// Apply the layer settings to their noise generators.
+	void SetParameters(Layers& layers);
+
+	// Fill the height and biome columns, returns the (estimated) voxel count.
+	int GenerateHeightmap(Columns* world, const Layers& layers, const Parameters& parameters);
+
+	// Simulated erosion, deterministic for a given erosion layer seed.
+	void ErodeHeightmap(Columns* world, const Layers& layers, const Parameters& parameters);
+
+	// Plot the columns of one of the THREAD_LIMIT sections into the voxel world.
+	void Generate(World* target, const Columns* world, const Layers& layers, const Parameters& parameters, const int thread);
+}
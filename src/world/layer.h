@@ -5,6 +5,10 @@
 
 struct Layer
 {
+	// Resolution of the tabulated amplitude curve, a multiple of the 20
+	// control point segments so the table reproduces LerpPoints exactly.
+	static constexpr int CURVESAMPLES = 320;
+
 	int
 		seed = 1337,
 		noiseIndex = 0,
@@ -49,5 +53,21 @@ struct Layer
 		0.5f
 	};
 
+	// Derived from points by BuildCurve, kept in sync by every writer of points.
+	std::array<float, CURVESAMPLES + 1> curve = []
+	{
+		std::array<float, CURVESAMPLES + 1> table;
+		table.fill(0.5f);
+		return table;
+	}();
+
 	FastNoiseLite noise;
-};
\ No newline at end of file
+};
+
+// All layers of a preset, in preset file order.
+struct Layers
+{
+	Layer continentalness, erosion, peaks,
+		temperature, humidity,
+		contdensity, density, peakdensity;
+};
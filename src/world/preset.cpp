@@ -0,0 +1,238 @@
+#include "precomp.h"
+#include "preset.h"
+
+#include "src/math/lerp.h"
+#include "src/interface/interface.h"
+
+#include <cstddef>
+
+namespace Tmpl8
+{
+	namespace
+	{
+		constexpr uint PRESETMAGIC = 0x53525054; // "TPRS"
+		constexpr uint PRESETVERSION = 1;
+		constexpr int LAYERCOUNT = 8;
+
+		// Raw struct dumps written before the versioned format: eight Layer
+		// images whose parameter fields sit at fixed offsets.
+		constexpr size_t LEGACYPARAMETERS = 8 * sizeof(int) + 7 * sizeof(float) + 20 * sizeof(float);
+
+		struct PresetHeader
+		{
+			uint magic;
+			uint version;
+			uint layerCount;
+			uint layerSize;		// bytes per record, at least the parameters plus curveSamples + 1 floats
+			uint curveSamples;	// Layer::CURVESAMPLES of the writer, curves are rebuilt on mismatch
+			uint checksum;		// FNV-1a over all layer records
+		};
+
+		// On-disk layer record, fields are copied by name so Layer can change freely.
+		struct PresetLayer
+		{
+			int seed, noiseIndex, rotationIndex, fractalIndex,
+				fractalOctaves, distanceIndex, returnIndex, domainIndex;
+			float frequency, fractalLacunarity, fractalGain, fractalWeightedStrength,
+				fractalPingPongStrength, cellularJitter, domainAmplitude;
+			float points[20];
+			float curve[Layer::CURVESAMPLES + 1];
+		};
+
+		static_assert(sizeof(PresetHeader) == 24, "PresetHeader layout changed");
+		static_assert(offsetof(PresetLayer, curve) == LEGACYPARAMETERS, "PresetLayer layout changed");
+
+		std::array<Layer*, LAYERCOUNT> Order(Layers& layers)
+		{
+			return { &layers.continentalness, &layers.erosion, &layers.peaks, &layers.temperature,
+				&layers.humidity, &layers.contdensity, &layers.density, &layers.peakdensity };
+		}
+
+		std::array<const Layer*, LAYERCOUNT> Order(const Layers& layers)
+		{
+			return { &layers.continentalness, &layers.erosion, &layers.peaks, &layers.temperature,
+				&layers.humidity, &layers.contdensity, &layers.density, &layers.peakdensity };
+		}
+
+		uint Checksum(const uchar* data, const size_t size)
+		{
+			uint hash = 2166136261u;
+
+			for (size_t i = 0; i < size; i++)
+			{
+				hash = (hash ^ data[i]) * 16777619u;
+			}
+
+			return hash;
+		}
+
+		// Copies the parameter fields shared by both formats, the record is
+		// read through memcpy as mapped data carries no alignment guarantee.
+		void ReadParameters(const uchar* data, Layer& layer)
+		{
+			PresetLayer record;
+			memcpy(&record, data, LEGACYPARAMETERS);
+
+			layer.seed = record.seed;
+			layer.noiseIndex = record.noiseIndex;
+			layer.rotationIndex = record.rotationIndex;
+			layer.fractalIndex = record.fractalIndex;
+			layer.fractalOctaves = record.fractalOctaves;
+			layer.distanceIndex = record.distanceIndex;
+			layer.returnIndex = record.returnIndex;
+			layer.domainIndex = record.domainIndex;
+			layer.frequency = record.frequency;
+			layer.fractalLacunarity = record.fractalLacunarity;
+			layer.fractalGain = record.fractalGain;
+			layer.fractalWeightedStrength = record.fractalWeightedStrength;
+			layer.fractalPingPongStrength = record.fractalPingPongStrength;
+			layer.cellularJitter = record.cellularJitter;
+			layer.domainAmplitude = record.domainAmplitude;
+			memcpy(layer.points.data(), record.points, sizeof(record.points));
+		}
+
+		bool LoadVersioned(const MappedFile& file, Layers& layers)
+		{
+			PresetHeader header;
+			memcpy(&header, file.GetData(), sizeof(header));
+
+			// The curve table follows the parameters at the writer's resolution,
+			// which can differ from ours; anything after it is appended fields.
+			const size_t curveSize = (static_cast<size_t>(header.curveSamples) + 1) * sizeof(float);
+
+			if (header.version != PRESETVERSION || header.layerCount != LAYERCOUNT ||
+				header.layerSize < LEGACYPARAMETERS + curveSize ||
+				file.GetSize() != sizeof(header) + static_cast<size_t>(header.layerSize) * LAYERCOUNT)
+			{
+				return false;
+			}
+
+			const uchar* records = file.GetData() + sizeof(header);
+
+			if (Checksum(records, static_cast<size_t>(header.layerSize) * LAYERCOUNT) != header.checksum)
+			{
+				return false;
+			}
+
+			int index = 0;
+
+			for (Layer* layer : Order(layers))
+			{
+				const uchar* record = records + static_cast<size_t>(header.layerSize) * index++;
+				ReadParameters(record, *layer);
+
+				if (header.curveSamples == Layer::CURVESAMPLES)
+				{
+					memcpy(layer->curve.data(), record + LEGACYPARAMETERS, curveSize);
+				}
+				else
+				{
+					BuildCurve(*layer);
+				}
+			}
+
+			return true;
+		}
+
+		bool LoadLegacy(const MappedFile& file, Layers& layers)
+		{
+			const size_t stride = file.GetSize() / LAYERCOUNT;
+
+			if (file.GetSize() % LAYERCOUNT || stride < LEGACYPARAMETERS)
+			{
+				return false;
+			}
+
+			int index = 0;
+
+			for (Layer* layer : Order(layers))
+			{
+				ReadParameters(file.GetData() + stride * index++, *layer);
+				BuildCurve(*layer);
+			}
+
+			return true;
+		}
+	}
+
+	bool LoadPreset(const char* path, Layers& layers)
+	{
+		MappedFile file(path);
+
+		if (!file.IsValid())
+		{
+			return false;
+		}
+
+		// Parse into a copy so a rejected file leaves layers untouched.
+		Layers loaded = layers;
+		uint magic = 0;
+
+		if (file.GetSize() >= sizeof(PresetHeader))
+		{
+			memcpy(&magic, file.GetData(), sizeof(magic));
+		}
+
+		if (!(magic == PRESETMAGIC ? LoadVersioned(file, loaded) : LoadLegacy(file, loaded)))
+		{
+			return false;
+		}
+
+		for (Layer* layer : Order(loaded))
+		{
+			SetParameters(*layer);
+		}
+
+		layers = loaded;
+		return true;
+	}
+
+	bool SavePreset(const char* path, const Layers& layers)
+	{
+		std::array<PresetLayer, LAYERCOUNT> records = {};
+		int index = 0;
+
+		for (const Layer* layer : Order(layers))
+		{
+			PresetLayer& record = records[index++];
+			record.seed = layer->seed;
+			record.noiseIndex = layer->noiseIndex;
+			record.rotationIndex = layer->rotationIndex;
+			record.fractalIndex = layer->fractalIndex;
+			record.fractalOctaves = layer->fractalOctaves;
+			record.distanceIndex = layer->distanceIndex;
+			record.returnIndex = layer->returnIndex;
+			record.domainIndex = layer->domainIndex;
+			record.frequency = layer->frequency;
+			record.fractalLacunarity = layer->fractalLacunarity;
+			record.fractalGain = layer->fractalGain;
+			record.fractalWeightedStrength = layer->fractalWeightedStrength;
+			record.fractalPingPongStrength = layer->fractalPingPongStrength;
+			record.cellularJitter = layer->cellularJitter;
+			record.domainAmplitude = layer->domainAmplitude;
+			memcpy(record.points, layer->points.data(), sizeof(record.points));
+			memcpy(record.curve, layer->curve.data(), sizeof(record.curve));
+		}
+
+		PresetHeader header = {};
+		header.magic = PRESETMAGIC;
+		header.version = PRESETVERSION;
+		header.layerCount = LAYERCOUNT;
+		header.layerSize = sizeof(PresetLayer);
+		header.curveSamples = Layer::CURVESAMPLES;
+		header.checksum = Checksum(reinterpret_cast<const uchar*>(records.data()), sizeof(records));
+
+		FILE* f = fopen(path, "wb");
+
+		if (!f)
+		{
+			return false;
+		}
+
+		const bool written = fwrite(&header, sizeof(header), 1, f) == 1 &&
+			fwrite(records.data(), sizeof(records), 1, f) == 1;
+		fclose(f);
+
+		return written;
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "src/world/layer.h"
+
+#include <array>
+
+namespace Tmpl8
+{
+	struct Preset
+	{
+		const char* name;
+		const char* path;
+	};
+
+	constexpr std::array<Preset, 4> presets =
+	{
+		Preset{ "Default", "layer_default.dat" },
+		Preset{ "Grassland", "layer_grassland.dat" },
+		Preset{ "Desert", "layer_desert.dat" },
+		Preset{ "Ocean", "layer_ocean.dat" }
+	};
+
+	// Returns false (and leaves layers untouched) if the file can't be opened.
+	bool LoadPreset(const char* path, Layers& layers);
+	bool SavePreset(const char* path, const Layers& layers);
+}
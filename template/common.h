@@ -102,6 +102,7 @@ struct RenderParams
 #define UBERWIDTH	(GRIDWIDTH / 4)
 #define UBERHEIGHT	(GRIDHEIGHT / 4)
 #define UBERDEPTH	(GRIDDEPTH / 4)
+#define UBERSIZE	(UBERWIDTH * UBERHEIGHT * UBERDEPTH)
 // note: we reserve 50% of the theoretical peak; a normal scene shouldn't come close to
 // using that many unique (non-empty!) bricks.
 #define BRICKCOUNT	((((MAPWIDTH / BRICKDIM) * (MAPHEIGHT / BRICKDIM) * (MAPDEPTH / BRICKDIM))) / 2)
@@ -112,6 +113,7 @@ struct RenderParams
 // experimental
 #define ONEBRICKBUFFER	1 // use a single (large) brick buffer; set to 0 on low mem devices
 #define MORTONBRICKS	0 // store bricks in morton order to improve data locality (slower)
+#define MORTONHOST		0 // store the host-side grid and bricks in morton order; the device copy stays linear
 
 // constants
 #define PI			3.14159265358979323846264f
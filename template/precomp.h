@@ -14,6 +14,10 @@
 #include <list>
 #include <string>
 #include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
 #include <math.h>
 #include <algorithm>
 #include <assert.h>
@@ -271,6 +275,23 @@ string TextFileRead( const char* _File );
 int LineCount( const string s );
 void TextFileWrite( const string& text, const char* _File );
 
+// read-only memory mapped view of a file; IsValid() is false if the file can't be mapped
+class MappedFile
+{
+public:
+	MappedFile( const char* f );
+	~MappedFile();
+	MappedFile( const MappedFile& ) = delete;
+	MappedFile& operator=( const MappedFile& ) = delete;
+	bool IsValid() const { return data != 0; }
+	const uchar* GetData() const { return data; }
+	size_t GetSize() const { return size; }
+private:
+	HANDLE file = INVALID_HANDLE_VALUE, mapping = 0;
+	const uchar* data = 0;
+	size_t size = 0;
+};
+
 // math
 inline float fminf( float a, float b ) { return a < b ? a : b; }
 inline float fmaxf( float a, float b ) { return a > b ? a : b; }
@@ -1252,6 +1273,9 @@ public:
 	}
 };
 
+// stage profiling
+#include "profiler.h"
+
 // voxel world engine
 #include "world.h"
 #include "worldapi.h"
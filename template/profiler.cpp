@@ -0,0 +1,100 @@
+#include "precomp.h"
+
+// Profiler::GetProfiler
+// ----------------------------------------------------------------------------
+Profiler& Profiler::GetProfiler()
+{
+	static Profiler profiler;
+	return profiler;
+}
+
+// Profiler::Record
+// ----------------------------------------------------------------------------
+void Profiler::Record( const char* name, const int64_t start, const int64_t end )
+{
+	// small lane indices per thread, in order of their first event
+	static atomic<uint> laneCount = 0;
+	thread_local uint lane = laneCount++;
+	scoped_lock guard( lock );
+	events[eventCount++ % MAXEVENTS] = Event{ name, start, end, lane };
+	// stages are identified by name pointer first, so a lookup is usually cheap
+	Stage* stage = 0;
+	for (Stage& s : stages) if (s.name == name || strcmp( s.name, name ) == 0) { stage = &s; break; }
+	if (!stage) stages.push_back( Stage{ name } ), stage = &stages.back();
+	if (!stage->active) stage->frameStart = start, stage->frameEnd = end, stage->active = true;
+	else stage->frameStart = min( stage->frameStart, start ), stage->frameEnd = max( stage->frameEnd, end );
+}
+
+// Profiler::EndFrame
+// ----------------------------------------------------------------------------
+void Profiler::EndFrame()
+{
+	scoped_lock guard( lock );
+	for (Stage& s : stages) if (s.active)
+	{
+		s.last = (s.frameEnd - s.frameStart) * 1e-6f;
+		s.history[s.samples++ % HISTORY] = s.last;
+		const uint n = min( s.samples, HISTORY );
+		float sum = 0;
+		for (uint i = 0; i < n; i++) sum += s.history[i];
+		s.average = sum / n;
+		s.active = false;
+	}
+}
+
+// Profiler::GetLast
+// ----------------------------------------------------------------------------
+float Profiler::GetLast( const char* name ) const
+{
+	scoped_lock guard( lock );
+	for (const Stage& s : stages) if (strcmp( s.name, name ) == 0) return s.last;
+	return 0;
+}
+
+// Profiler::SortedEvents: recorded events, oldest first
+// ----------------------------------------------------------------------------
+vector<Profiler::Event> Profiler::SortedEvents()
+{
+	scoped_lock guard( lock );
+	vector<Event> sorted;
+	const uint64_t first = eventCount > MAXEVENTS ? eventCount - MAXEVENTS : 0;
+	for (uint64_t i = first; i < eventCount; i++) sorted.push_back( events[i % MAXEVENTS] );
+	return sorted;
+}
+
+// Profiler::ExportTrace: Chrome trace event format, timestamps in microseconds
+// ----------------------------------------------------------------------------
+bool Profiler::ExportTrace( const char* filename )
+{
+	FILE* f = fopen( filename, "w" );
+	if (!f) return false;
+	const vector<Event> sorted = SortedEvents();
+	uint lanes = 0;
+	for (const Event& e : sorted) lanes = max( lanes, e.lane + 1 );
+	fprintf( f, "{\"traceEvents\":[\n" );
+	for (uint i = 0; i < lanes; i++)
+		fprintf( f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}},\n",
+			i, i == 0 ? "main" : "worker", i );
+	for (size_t i = 0; i < sorted.size(); i++)
+		fprintf( f, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+			sorted[i].name, sorted[i].lane, sorted[i].start * 1e-3, (sorted[i].end - sorted[i].start) * 1e-3,
+			i + 1 < sorted.size() ? "," : "" );
+	fprintf( f, "]}\n" );
+	fclose( f );
+	return true;
+}
+
+// Profiler::ExportCSV
+// ----------------------------------------------------------------------------
+bool Profiler::ExportCSV( const char* filename )
+{
+	FILE* f = fopen( filename, "w" );
+	if (!f) return false;
+	fprintf( f, "stage,lane,start_us,duration_us\n" );
+	for (const Event& e : SortedEvents())
+		fprintf( f, "%s,%u,%.3f,%.3f\n", e.name, e.lane, e.start * 1e-3, (e.end - e.start) * 1e-3 );
+	fclose( f );
+	return true;
+}
+
+// EOF
@@ -0,0 +1,68 @@
+#pragma once
+
+// Stage profiler overview:
+// Code marks a stage with PROFILE_SCOPE( "name" ); the scope is timed with a steady clock
+// and recorded as an event, tagged with a small per-thread lane index. Events are kept in a
+// ring buffer, so the most recent ones can be exported as a Chrome trace (chrome://tracing,
+// one lane per thread) or as CSV. Profiler::EndFrame, called once per frame, folds the
+// events of the frame into per-stage statistics: the time between the first start and the
+// last end of a stage in that frame, and a rolling average over the frames it ran in.
+// Stage names must be string literals (or otherwise outlive the profiler).
+
+namespace Tmpl8
+{
+
+class Profiler
+{
+public:
+	static constexpr uint HISTORY = 64;
+	static constexpr uint MAXEVENTS = 65536;
+	struct Event
+	{
+		const char* name;
+		int64_t start, end;				// nanoseconds since profiler creation
+		uint lane;						// per-thread lane
+	};
+	struct Stage
+	{
+		const char* name;
+		float last = 0;					// duration in the last frame it ran in (ms)
+		float average = 0;				// rolling average over the last HISTORY frames it ran in (ms)
+		float history[HISTORY] = {};		// ring buffer of durations (ms)
+		uint samples = 0;				// number of recorded frames
+		int64_t frameStart, frameEnd;	// span in the current frame
+		bool active = false;			// ran in the current frame
+	};
+	static Profiler& GetProfiler();
+	int64_t Now() const { return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count(); }
+	void Record( const char* name, const int64_t start, const int64_t end );
+	void EndFrame();
+	vector<Stage> GetStages() const { scoped_lock guard( lock ); return stages; }	// snapshot; Record runs on other threads
+	float GetLast( const char* name ) const;
+	bool ExportTrace( const char* filename );
+	bool ExportCSV( const char* filename );
+private:
+	Profiler() : epoch( chrono::steady_clock::now() ), events( MAXEVENTS ) {}
+	vector<Event> SortedEvents();
+	chrono::steady_clock::time_point epoch;
+	mutable mutex lock;
+	vector<Event> events;				// ring buffer of recent events
+	uint64_t eventCount = 0;			// total number of recorded events
+	vector<Stage> stages;				// per-stage statistics, in order of first appearance
+};
+
+class ProfileScope
+{
+public:
+	ProfileScope( const char* name ) : name( name ), start( Profiler::GetProfiler().Now() ) {}
+	~ProfileScope() { Profiler& p = Profiler::GetProfiler(); p.Record( name, start, p.Now() ); }
+private:
+	const char* name;
+	int64_t start;
+};
+
+#define PROFILE_CONCAT_( a, b ) a##b
+#define PROFILE_CONCAT( a, b ) PROFILE_CONCAT_( a, b )
+#define PROFILE_SCOPE( name ) ProfileScope PROFILE_CONCAT( profileScope, __LINE__ )( name )
+
+} // namespace Tmpl8
@@ -40,6 +40,7 @@ static const CPUCaps cpucaps;
 
 // find the game implementation
 Game* CreateGame();
+int RunCommandLine( int argc, char* argv[] ); // returns -1 if the game should start normally
 
 // world access / C API implementation
 World* GetWorld() { return world; }
@@ -55,6 +56,8 @@ void Plot( const int3 pos, const uint c ) { world->Set( pos.x, pos.y, pos.z, c )
 uint Read( const int x, const int y, const int z ) { return world->Get( x, y, z ); }
 uint Read( const int3 pos ) { return world->Get( pos.x, pos.y, pos.z ); }
 uint Read( const uint3 pos ) { return world->Get( pos.x, pos.y, pos.z ); }
+int SurfaceHeight( const int x, const int z ) { return world->SurfaceHeight( x, z ); }
+uint SurfaceColor( const int x, const int z ) { return world->SurfaceColor( x, z ); }
 void Sphere( const float x, const float y, const float z, const float r, const uint c )
 {
 	world->Sphere( x, y, z, r, c );
@@ -278,19 +281,21 @@ Intersection TraceToVoid( const Ray& r )
 }
 Ray* GetBatchBuffer()
 {
-	if (Game::autoRendering) FatalError( "disable autoRendering for inline ray batch processing." );
 	return world->GetBatchBuffer();
 }
-Intersection* TraceBatch( const uint batchSize )
+Intersection* TraceBatch( const uint batchSize, const uint backend )
 {
-	if (Game::autoRendering) FatalError( "disable autoRendering for inline ray batch processing." );
-	return world->TraceBatch( batchSize );
+	// a CPU backend chosen by the caller does not touch the device, so it works with autoRendering too
+	if (Game::autoRendering && world->BatchOnDevice( batchSize, backend )) FatalError( "disable autoRendering for inline ray batch processing." );
+	return world->TraceBatch( batchSize, backend );
 }
-Intersection* TraceBatchToVoid( const uint batchSize )
+Intersection* TraceBatchToVoid( const uint batchSize, const uint backend )
 {
-	if (Game::autoRendering) FatalError( "disable autoRendering for inline ray batch processing." );
-	return world->TraceBatchToVoid( batchSize );
+	if (Game::autoRendering && world->BatchOnDevice( batchSize, backend )) FatalError( "disable autoRendering for inline ray batch processing." );
+	return world->TraceBatchToVoid( batchSize, backend );
 }
+void TraceBatchCPU( const Ray* rays, Intersection* hits, const uint count ) { world->TraceBatchCPU( rays, hits, count ); }
+void TraceBatchToVoidCPU( const Ray* rays, Intersection* hits, const uint count ) { world->TraceBatchToVoidCPU( rays, hits, count ); }
 
 uint RGB32to8( const uint c ) { return ((c >> 6) & 3) + (((c >> 13) & 7) << 2) + (((c >> 21) & 7) << 5); }
 uint RGB32to16( const uint c ) { return ((c >> 4) & 15) + (((c >> 12) & 15) << 4) + (((c >> 20) & 15) << 8); }
@@ -338,6 +343,21 @@ void ErrorCallback( int error, const char* description )
 // Application entry point
 int main(int argc, char* argv[])
 {
+	// headless tools run from the command line, without a window or OpenCL
+	if (argc > 1)
+	{
+#ifdef _MSC_VER
+		// we are a windows subsystem application; reuse the console we were started from
+		FILE* file = nullptr;
+		if (AttachConsole( ATTACH_PARENT_PROCESS ))
+		{
+			freopen_s( &file, "CONOUT$", "w", stdout );
+			freopen_s( &file, "CONOUT$", "w", stderr );
+		}
+#endif
+		const int result = RunCommandLine( argc, argv );
+		if (result >= 0) return result;
+	}
 	// open a window
 	if (!glfwInit()) FatalError( "glfwInit failed." );
 	glfwSetErrorCallback( ErrorCallback );
@@ -423,6 +443,8 @@ int main(int argc, char* argv[])
 			glfwSwapBuffers( window );
 			glfwPollEvents();
 		}
+		// fold this frame's profiler events into the per-stage statistics
+		Profiler::GetProfiler().EndFrame();
 		if (!running) break;
 	}
 	// close down
@@ -1009,6 +1031,25 @@ void TextFileWrite( const string& text, const char* _File )
 	s.write( text.c_str(), len );
 }
 
+MappedFile::MappedFile( const char* f )
+{
+	file = CreateFileA( f, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if (file == INVALID_HANDLE_VALUE) return;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx( file, &fileSize ) || fileSize.QuadPart == 0) return; // empty files can't be mapped
+	mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+	if (!mapping) return;
+	data = (const uchar*)MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+	if (data) size = (size_t)fileSize.QuadPart;
+}
+
+MappedFile::~MappedFile()
+{
+	if (data) UnmapViewOfFile( data );
+	if (mapping) CloseHandle( mapping );
+	if (file != INVALID_HANDLE_VALUE) CloseHandle( file );
+}
+
 void FatalError( const char* fmt, ... )
 {
 	char t[16384];
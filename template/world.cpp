@@ -12,6 +12,108 @@ using namespace Tmpl8;
 
 static const uint gridSize = GRIDSIZE * sizeof( uint );
 static const uint commitSize = BRICKCOMMITSIZE + gridSize;
+static const size_t brickStoreSize = (size_t)CHUNKCOUNT * CHUNKSIZE;
+static const size_t poolPageSize = (size_t)POOLPAGE * BRICKSIZE * PAYLOADSIZE;
+
+// snapshot files: header, top-level grid, bricks, brick info and an optional user block.
+// Sections start at multiples of the allocation granularity, so the brick section can
+// be mapped straight into the brick store.
+#define SNAPSHOTMAGIC	0x504e5357 // "WSNP"
+#define SNAPSHOTVERSION	(1 + MORTONHOST * 256) // grid and bricks are stored in host layout
+#define SNAPSHOTALIGN	65536
+struct SnapshotFileHeader
+{
+	uint magic, version;
+	uint gridSize, brickBytes;			// GRIDSIZE and BRICKSIZE * PAYLOADSIZE of the writer
+	uint brickCount, infoBytes;			// stored bricks are numbered 0..brickCount-1
+	uint64_t tag;						// caller-supplied tag, e.g. a hash of the generator settings
+	uint64_t gridOffset, brickOffset, infoOffset, userOffset, userSize;
+};
+static uint64_t SnapshotAlign( const uint64_t offset ) { return (offset + SNAPSHOTALIGN - 1) & ~(uint64_t)(SNAPSHOTALIGN - 1); }
+
+// region files: a .vx stream split over gzip members that each carry their own size in
+// a 'VX' extra field. gzread reads them as one stream; LoadSprite locates all members
+// up front and inflates them in parallel.
+#define MEMBERHEADER	20		// gzip header + extra field
+#define MEMBERTRAILER	8		// crc32, input size
+#define REGIONCELLS		512		// grid cells per compressed range
+static void DeflateMember( const void* data, const uint bytes, vector<uchar>& member )
+{
+	static const uchar header[MEMBERHEADER] = {
+		0x1f, 0x8b, 8, 4 /* FEXTRA */, 0, 0, 0, 0, 0, 255, 8, 0 /* XLEN */, 'V', 'X', 4, 0 /* LEN */, 0, 0, 0, 0 };
+	z_stream s = {};
+	deflateInit2( &s, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY );
+	member.resize( MEMBERHEADER + deflateBound( &s, bytes ) + MEMBERTRAILER );
+	memcpy( member.data(), header, MEMBERHEADER );
+	s.next_in = (Bytef*)data, s.avail_in = bytes;
+	s.next_out = member.data() + MEMBERHEADER, s.avail_out = (uInt)(member.size() - MEMBERHEADER - MEMBERTRAILER);
+	deflate( &s, Z_FINISH );
+	const uint memberSize = MEMBERHEADER + (uint)s.total_out + MEMBERTRAILER;
+	const uint crc = (uint)crc32( crc32( 0, 0, 0 ), (const Bytef*)data, bytes );
+	deflateEnd( &s );
+	memcpy( member.data() + MEMBERHEADER - 4, &memberSize, 4 );
+	memcpy( member.data() + memberSize - 8, &crc, 4 );
+	memcpy( member.data() + memberSize - 4, &bytes, 4 );
+	member.resize( memberSize );
+}
+class InflateJob : public Job
+{
+public:
+	void Main()
+	{
+		z_stream s = {};
+		inflateInit2( &s, -15 );
+		s.next_in = (Bytef*)src, s.avail_in = srcBytes;
+		s.next_out = dst, s.avail_out = dstBytes;
+		ok = inflate( &s, Z_FINISH ) == Z_STREAM_END && s.total_out == dstBytes &&
+			crc32( crc32( 0, 0, 0 ), dst, dstBytes ) == crc;
+		inflateEnd( &s );
+	}
+	const uchar* src;
+	uchar* dst;
+	size_t dstOffset;					// position of the member in the inflated stream
+	uint srcBytes, dstBytes, crc;
+	bool ok;
+};
+static bool InflateMembers( const uchar* data, const size_t size, vector<uchar>& raw )
+{
+	// index the members; a single member without the size field means a plain gzip file
+	vector<InflateJob> job;
+	size_t rawSize = 0;
+	for (size_t offset = 0; offset < size;)
+	{
+		const uchar* m = data + offset;
+		uint memberSize = 0;
+		if (size - offset < MEMBERHEADER + MEMBERTRAILER || m[0] != 0x1f || m[1] != 0x8b || m[2] != 8 ||
+			m[3] != 4 || m[10] != 8 || m[11] != 0 || m[12] != 'V' || m[13] != 'X') return false;
+		memcpy( &memberSize, m + MEMBERHEADER - 4, 4 );
+		if (memberSize < MEMBERHEADER + MEMBERTRAILER || memberSize > size - offset) return false;
+		InflateJob j;
+		j.src = m + MEMBERHEADER, j.srcBytes = memberSize - MEMBERHEADER - MEMBERTRAILER;
+		memcpy( &j.crc, m + memberSize - 8, 4 );
+		memcpy( &j.dstBytes, m + memberSize - 4, 4 );
+		j.dstOffset = rawSize;
+		rawSize += j.dstBytes;
+		job.push_back( j );
+		offset += memberSize;
+	}
+	raw.resize( rawSize );
+	JobManager* jm = JobManager::GetJobManager();
+	for (size_t first = 0; first < job.size(); first += 256)
+	{
+		const size_t last = min( job.size(), first + 256 );
+		for (size_t i = first; i < last; i++) job[i].dst = raw.data() + job[i].dstOffset, jm->AddJob2( &job[i] );
+		jm->RunJobs();
+		for (size_t i = first; i < last; i++) if (!job[i].ok) return false;
+	}
+	return true;
+}
+
+// adaptive commit budget, see World::UpdateCommitBudget
+#define COMMITFRAME	(1.0f / 60)	// frame time to stay within
+#define COMMITSHARE	0.5f		// share of the headroom spent on uploads
+#define MINCOMMITS	1024		// budget floor, so a slow frame never stalls syncing
+#define BULKFRAMES	8			// backlogs over this many frames of budget are bulk-synced
 
 // helper defines for inline ray tracing
 #define OFFS_X		((bits >> 5) & 1)			// extract grid plane offset over x (0 or 1)
@@ -26,6 +128,7 @@ static const uint commitSize = BRICKCOMMITSIZE + gridSize;
 #define BPMY		(MAPHEIGHT - BRICKDIM)
 #define BPMZ		(MAPDEPTH - BRICKDIM)
 #define TOPMASK3	(((1023 - BMSK) << 20) + ((1023 - BMSK) << 10) + (1023 - BMSK))
+#define UBERMASK3	((1020 << 20) + (1020 << 10) + 1020)
 #define SELECT(a,b,c) ((c)?(b):(a))
 
 // helpers for skydome sampling
@@ -43,47 +146,66 @@ float SphericalPhi( const float3& v ) { const float p = atan2f( v.y, v.x ); retu
 // ----------------------------------------------------------------------------
 World::World( const uint targetID )
 {
-	// create the staging buffer, used to sync CPU-side changes to the GPU
-	if (!Kernel::InitCL()) FATALERROR( "Failed to initialize OpenCL" );
-	devmem = clCreateBuffer( Kernel::GetContext(), CL_MEM_READ_ONLY, commitSize, 0, 0 );
+	// without a render target the world is headless: host-side data only, no OpenCL / OpenGL
+	headless = targetID == 0;
+	if (!headless)
+	{
+		// create the staging buffer, used to sync CPU-side changes to the GPU
+		if (!Kernel::InitCL()) FATALERROR( "Failed to initialize OpenCL" );
+		devmem = clCreateBuffer( Kernel::GetContext(), CL_MEM_READ_ONLY, commitSize, 0, 0 );
+		// store top-level grid in a 3D texture
+		cl_image_format fmt;
+		fmt.image_channel_order = CL_R;
+		fmt.image_channel_data_type = CL_UNSIGNED_INT32;
+		cl_image_desc desc;
+		memset( &desc, 0, sizeof( cl_image_desc ) );
+		desc.image_type = CL_MEM_OBJECT_IMAGE3D;
+		desc.image_width = GRIDWIDTH, desc.image_height = GRIDHEIGHT, desc.image_depth = GRIDDEPTH;
+		gridMap = clCreateImage( Kernel::GetContext(), CL_MEM_HOST_NO_ACCESS, &fmt, &desc, 0, 0 );
+	}
 	modified = new uint[BRICKCOUNT / 32]; // 1 bit per brick, to track 'dirty' bricks
-	// store top-level grid in a 3D texture
-	cl_image_format fmt;
-	fmt.image_channel_order = CL_R;
-	fmt.image_channel_data_type = CL_UNSIGNED_INT32;
-	cl_image_desc desc;
-	memset( &desc, 0, sizeof( cl_image_desc ) );
-	desc.image_type = CL_MEM_OBJECT_IMAGE3D;
-	desc.image_width = GRIDWIDTH, desc.image_height = GRIDHEIGHT, desc.image_depth = GRIDDEPTH;
-	gridMap = clCreateImage( Kernel::GetContext(), CL_MEM_HOST_NO_ACCESS, &fmt, &desc, 0, 0 );
-	// create brick storage
-	brick = (PAYLOAD*)_aligned_malloc( CHUNKCOUNT * CHUNKSIZE, 64 );
-#if ONEBRICKBUFFER == 1
-	brickBuffer = new Buffer( CHUNKSIZE * CHUNKCOUNT / 4 /* dwords */, Buffer::DEFAULT, (uchar*)brick );
-	brickBuffer->CopyToDevice();
-#else
-	brick = (PAYLOAD*)_aligned_malloc( CHUNKCOUNT * CHUNKSIZE, 64 );
-	for (int i = 0; i < CHUNKCOUNT; i++)
+	// create brick storage; page-granular, so a snapshot file can be mapped over it later.
+	// The device buffers mirror the whole store, so only a headless world can keep it sparse:
+	// there the store is merely reserved, and pages get committed as bricks are handed out.
+	sparsePool = headless;
+	AllocateBricks( 0 );
+	pageState = new uchar[POOLPAGES];
+	ResetPool( 0 );
+	if (!headless)
 	{
-		brickBuffer[i] = new Buffer( CHUNKSIZE / 4 /* dwords */, Buffer::DEFAULT, (uchar*)brick + CHUNKSIZE * i );
-		brickBuffer[i]->CopyToDevice();
+	#if ONEBRICKBUFFER == 1
+		brickBuffer = new Buffer( CHUNKSIZE * CHUNKCOUNT / 4 /* dwords */, Buffer::DEFAULT, (uchar*)brick );
+		brickBuffer->CopyToDevice();
+	#else
+		for (int i = 0; i < CHUNKCOUNT; i++)
+		{
+			brickBuffer[i] = new Buffer( CHUNKSIZE / 4 /* dwords */, Buffer::DEFAULT, (uchar*)brick + CHUNKSIZE * i );
+			brickBuffer[i]->CopyToDevice();
+		}
+	#endif
 	}
-#endif
 	brickInfo = (BrickInfo*)_aligned_malloc( BRICKCOUNT * sizeof( BrickInfo ), 64 );
 	// create a cyclic array for unused bricks (all of them, for now)
 	trash = (uint*)_aligned_malloc( BRICKCOUNT * 4, 64 );
 	memset( trash, 0, BRICKCOUNT * 4 );
-	for (uint i = 0; i < BRICKCOUNT; i++) trash[(i * 31 /* prevent false sharing*/) & (BRICKCOUNT - 1)] = i;
+	for (uint i = 0; i < BRICKCOUNT; i++) trash[(i * TRASHSTRIDE /* prevent false sharing*/) & (BRICKCOUNT - 1)] = i;
 	// prepare a test world
 	grid = gridOrig = (uint*)_aligned_malloc( GRIDWIDTH * GRIDHEIGHT * GRIDDEPTH * 4, 64 );
 	memset( grid, 0, GRIDWIDTH * GRIDHEIGHT * GRIDDEPTH * sizeof( uint ) );
+	occupancy = (uint64_t*)_aligned_malloc( UBERSIZE * 8, 64 );
+	memset( occupancy, 0, UBERSIZE * 8 );
 	//DummyWorld();
 	ClearMarks(); // clear 'modified' bit array
 	// report memory usage
 	printf( "Allocated %iMB on CPU and GPU for the top-level grid.\n", (int)(gridSize >> 20) );
-	printf( "Allocated %iMB on CPU and GPU for %ik bricks.\n", (int)((BRICKCOUNT * BRICKSIZE) >> 20), (int)(BRICKCOUNT >> 10) );
+	if (sparsePool) printf( "Reserved %iMB on CPU for %ik bricks.\n", (int)((BRICKCOUNT * BRICKSIZE) >> 20), (int)(BRICKCOUNT >> 10) );
+	else printf( "Allocated %iMB on CPU and GPU for %ik bricks.\n", (int)((BRICKCOUNT * BRICKSIZE) >> 20), (int)(BRICKCOUNT >> 10) );
 	printf( "Allocated %iKB on CPU for bitfield.\n", (int)(BRICKCOUNT >> 15) );
 	printf( "Allocated %iMB on CPU for brickInfo.\n", (int)((BRICKCOUNT * sizeof( BrickInfo )) >> 20) );
+	// load a bitmap font for the print command
+	font = new Surface( "assets/font.png" );
+	// a headless world needs no kernels or device buffers
+	if (headless) return;
 	// initialize kernels
 	paramBuffer = new Buffer( sizeof( RenderParams ) / 4, Buffer::DEFAULT | Buffer::READONLY, &params );
 	history[0] = new Buffer( 4 * SCRWIDTH * SCRHEIGHT );
@@ -154,39 +276,78 @@ World::World( const uint targetID )
 	blueNoise = new Buffer( 65536 * 5, Buffer::READONLY, data32 );
 	blueNoise->CopyToDevice();
 	delete[] data32;
-	// load a bitmap font for the print command
-	font = new Surface( "assets/font.png" );
 }
 
 // World Destructor
 // ----------------------------------------------------------------------------
 World::~World()
 {
+	{
+		// magazines of other threads must not return bricks to this world; one that is
+		// handing bricks back right now holds the lock until it is done
+		lock_guard<mutex> lock( self->lock );
+		self->world = 0;
+	}
+	_aligned_free( gridOrig ); // grid itself gets changed after allocation
+	_aligned_free( gridShadow );
+	_aligned_free( occupancy );
+	_aligned_free( surface );
+	ReleaseBricks();
+	delete[] pageState;
+	_aligned_free( brickInfo );
+	_aligned_free( brickRefs );
+	_aligned_free( packHandle );
+	_aligned_free( trash );
+	delete[] modified;
+	delete font;
+	if (headless)
+	{
+		_aligned_free( pinnedMemPtr );
+		return;
+	}
 	cl_program sharedProgram = renderer->GetProgram();
 	delete committer;
 	delete renderer;
-	_aligned_free( gridOrig ); // grid itself gets changed after allocation
-	_aligned_free( brick );
 #if ONEBRICKBUFFER == 1
 	delete brickBuffer;
 #else
 	for (int i = 0; i < 4; i++) delete brickBuffer[i];
 #endif
-	_aligned_free( brickInfo );
-	_aligned_free( trash );
 	delete screen;
 	delete paramBuffer;
 	delete sky;
 	delete blueNoise;
-	delete font;
 	clReleaseProgram( sharedProgram );
 }
 
+// helper for MORTONHOST: reorder the voxels of one brick to the linear device layout
+#define SYNCSLICE	16384 // bricks converted per upload in ForceSyncAllBricks
+static void LinearBrick( const PAYLOAD* src, PAYLOAD* dst )
+{
+	for (uint z = 0, i = 0; z < BRICKDIM; z++) for (uint y = 0; y < BRICKDIM; y++) for (uint x = 0; x < BRICKDIM; x++)
+		dst[i++] = src[World::VoxelIndex( x, y, z )];
+}
+
 // World::ForceSyncAllBricks: send brick array to GPU
 // ----------------------------------------------------------------------------
 void World::ForceSyncAllBricks()
 {
-#if ONEBRICKBUFFER == 1
+	if (headless) return;
+#if MORTONHOST == 1
+	// the device stores bricks linearly; convert the store in slices
+	vector<PAYLOAD> slice( (size_t)SYNCSLICE * BRICKSIZE );
+	alignas(32) PAYLOAD scratch[BRICKSIZE];
+	for (uint first = 0; first < BRICKCOUNT; first += SYNCSLICE)
+	{
+		for (uint i = 0; i < SYNCSLICE; i++) LinearBrick( BrickVoxels( first + i, scratch ), slice.data() + (size_t)i * BRICKSIZE );
+		const size_t offset = (size_t)first * BRICKSIZE * PAYLOADSIZE, bytes = slice.size() * PAYLOADSIZE;
+	#if ONEBRICKBUFFER == 1
+		clEnqueueWriteBuffer( Kernel::GetQueue(), brickBuffer->deviceBuffer, CL_TRUE, offset, bytes, slice.data(), 0, 0, 0 );
+	#else
+		clEnqueueWriteBuffer( Kernel::GetQueue(), brickBuffer[offset / CHUNKSIZE]->deviceBuffer, CL_TRUE, offset % CHUNKSIZE, bytes, slice.data(), 0, 0, 0 );
+	#endif
+	}
+#elif ONEBRICKBUFFER == 1
 	brickBuffer->CopyToDevice();
 #if MORTONBRICKS == 1
 	encodeBricks->SetArgument( 0, BRICKCOUNT );
@@ -198,36 +359,385 @@ void World::ForceSyncAllBricks()
 #endif
 }
 
-// World::OptimizeBricks: replace single-color solid bricks
+// helper for OptimizeBricks: compare all voxels against the first one, 256 bytes at a time
+static bool UniformBrick( const PAYLOAD* voxels )
+{
+#if PAYLOADSIZE == 1
+	const __m256i first = _mm256_set1_epi8( (char)voxels[0] );
+#else
+	const __m256i first = _mm256_set1_epi16( (short)voxels[0] );
+#endif
+	const __m256i* v = (const __m256i*)voxels;
+	for (int i = 0; i < BRICKSIZE * PAYLOADSIZE / 32; i += 8)
+	{
+		__m256i d = _mm256_xor_si256( _mm256_load_si256( v + i ), first );
+		for (int j = 1; j < 8; j++) d = _mm256_or_si256( d, _mm256_xor_si256( _mm256_load_si256( v + i + j ), first ) );
+		if (!_mm256_testz_si256( d, d )) return false;
+	}
+	return true;
+}
+
+// World::OptimizeJob::Main: replace the uniform bricks of a slab of grid cells
+// ----------------------------------------------------------------------------
+void World::OptimizeJob::Main()
+{
+	replaced = 0;
+	for (uint c = first; c < last; c++)
+	{
+		const uint g = world->grid[c], idx = g >> 1;
+		if (!(g & 1)) continue; // already solid, or empty
+		if (dirtyOnly && !(atomic_ref<uint>( world->modified[idx >> 5] ).load( memory_order_relaxed ) & (1u << (idx & 31)))) continue;
+		if (world->packHandle && world->packHandle[idx]) continue; // PackBricks made uniform bricks solid already
+		const PAYLOAD* voxels = world->brick + idx * BRICKSIZE;
+		if (!UniformBrick( voxels )) continue;
+		// this one has 8x8x8 times the same voxel; replace by solid brick in grid, and recycle the brick
+		world->grid[c] = (uint)voxels[0] << 1;
+		if (!voxels[0]) { const int3 b = CellCoord( c ); world->ClearOccupied( b.x, b.y, b.z ); }
+		world->ReleaseBrick( idx );
+		replaced++;
+	}
+}
+
+// World::OptimizeBricks: replace single-color solid bricks. With dirtyOnly set, only the
+// bricks modified since the last commit are checked; cheap enough to run every frame,
+// and it also catches bricks that became uniform while editing.
 // ----------------------------------------------------------------------------
-void World::OptimizeBricks()
+#define OPTIMIZEJOBS	64	// slabs of GRIDHEIGHT / OPTIMIZEJOBS layers
+uint World::OptimizeBricks( const bool dirtyOnly )
 {
+	PROFILE_SCOPE( "OptimizeBricks" );
+	if (dirtyOnly && GetDirtyBrickCount() == 0) return 0; // also merges the dirty maps
 	Timer t;
-	int replaced = 0;
-	for( int i = 0; i < GRIDWIDTH * GRIDHEIGHT * GRIDDEPTH; i++ )
-	{
-		const uint value = grid[i];
-		if (!(value & 1)) continue; // already solid, or empty
-		bool solid = true; // let's start with this assumption
-		uint brickOffset = (value >> 1) * BRICKSIZE;
-		uint firstVoxel = brick[brickOffset];
-		for( int j = 1; j < BRICKSIZE; j++ ) if (brick[brickOffset + j] != firstVoxel)
+	static JobManager* jm = JobManager::GetJobManager();
+	static OptimizeJob oj[OPTIMIZEJOBS];
+	for (uint i = 0; i < OPTIMIZEJOBS; i++)
+	{
+		oj[i].world = this, oj[i].dirtyOnly = dirtyOnly;
+		oj[i].first = i * (GRIDSIZE / OPTIMIZEJOBS), oj[i].last = (i + 1) * (GRIDSIZE / OPTIMIZEJOBS);
+		jm->AddJob2( &oj[i] );
+	}
+	jm->RunJobs();
+	uint replaced = 0;
+	for (uint i = 0; i < OPTIMIZEJOBS; i++) replaced += oj[i].replaced;
+	gridDirty |= replaced > 0; // replaced bricks no longer get committed, but the grid changed
+	if (!dirtyOnly) printf( "optimizing world data took %5.2fms; replaced %u bricks.\n", t.elapsed() * 1000.0f, replaced );
+	return replaced;
+}
+
+// World::SaveSnapshot: compact copy of the grid and the bricks in use
+// ----------------------------------------------------------------------------
+void World::SaveSnapshot( WorldSnapshot& snapshot )
+{
+	snapshot.cells.clear(), snapshot.values.clear();
+	snapshot.bricks.clear(), snapshot.zeroes.clear();
+	unordered_map<uint, uint> sharedBricks; // brick -> snapshot brick, for bricks used by several cells
+	for (uint i = 0; i < GRIDSIZE; i++)
+	{
+		const uint g = grid[i];
+		if (g == 0) continue; // empty
+		snapshot.cells.push_back( i );
+		if ((g & 1) == 0) { snapshot.values.push_back( g ); continue; }
+		// store uniform bricks as solid cells
+		alignas(32) PAYLOAD scratch[BRICKSIZE];
+		const PAYLOAD* voxels = BrickVoxels( g >> 1, scratch );
+		bool uniform = true;
+		for (int j = 1; j < BRICKSIZE; j++) if (voxels[j] != voxels[0]) { uniform = false; break; }
+		if (uniform) { snapshot.values.push_back( (uint)voxels[0] << 1 ); continue; }
+		if (brickRefs && brickRefs[g >> 1] > 0)
+		{
+			// store shared bricks once
+			const auto [it, inserted] = sharedBricks.try_emplace( g >> 1, (uint)snapshot.zeroes.size() );
+			if (!inserted) { snapshot.values.push_back( (it->second << 1) | 1 ); continue; }
+		}
+		snapshot.values.push_back( ((uint)snapshot.zeroes.size() << 1) | 1 );
+		snapshot.zeroes.push_back( brickInfo[g >> 1].zeroes );
+		snapshot.bricks.insert( snapshot.bricks.end(), voxels, voxels + BRICKSIZE );
+	}
+}
+
+// World::LoadSnapshot: replace the world contents by a snapshot
+// ----------------------------------------------------------------------------
+void World::LoadSnapshot( const WorldSnapshot& snapshot )
+{
+	Clear();
+	vector<uint> loaded( snapshot.zeroes.size(), 0 ); // per snapshot brick: brick index + 1, once loaded
+	for (size_t i = 0; i < snapshot.cells.size(); i++)
+	{
+		const uint v = snapshot.values[i];
+		if ((v & 1) == 0) { grid[snapshot.cells[i]] = v; continue; }
+		const uint src = v >> 1;
+		if (loaded[src] > 0)
+		{
+			// the snapshot brick is shared by several cells
+			if (!brickRefs) brickRefs = (uint*)_aligned_malloc( BRICKCOUNT * 4, 64 ), memset( brickRefs, 0, BRICKCOUNT * 4 );
+			brickRefs[loaded[src] - 1]++;
+			grid[snapshot.cells[i]] = ((loaded[src] - 1) << 1) | 1;
+			continue;
+		}
+		const uint idx = NewBrick();
+		loaded[src] = idx + 1;
+		memcpy( brick + idx * BRICKSIZE, snapshot.bricks.data() + src * BRICKSIZE, BRICKSIZE * PAYLOADSIZE );
+		brickInfo[idx].zeroes = snapshot.zeroes[src];
+		grid[snapshot.cells[i]] = (idx << 1) | 1;
+		Mark( idx ); // tag to be synced with GPU
+	}
+	gridDirty = true; // solid cells and an empty snapshot mark no bricks
+	RebuildOccupancy();
+	if (surface) RebuildSurface();
+}
+
+// World::SaveSnapshotFile: write the world in the memory mappable snapshot format
+// ----------------------------------------------------------------------------
+bool World::SaveSnapshotFile( const char* file, const uint64_t tag, const void* user, const size_t userSize )
+{
+	PROFILE_SCOPE( "Save snapshot file" );
+	WorldSnapshot snapshot;
+	SaveSnapshot( snapshot );
+	// expand the compact cell list back into a full grid; brick cells already use snapshot indices
+	vector<uint> cells( GRIDSIZE, 0 );
+	for (size_t i = 0; i < snapshot.cells.size(); i++) cells[snapshot.cells[i]] = snapshot.values[i];
+	SnapshotFileHeader header;
+	memset( &header, 0, sizeof( header ) );
+	header.magic = SNAPSHOTMAGIC, header.version = SNAPSHOTVERSION;
+	header.gridSize = GRIDSIZE, header.brickBytes = BRICKSIZE * PAYLOADSIZE;
+	header.brickCount = (uint)snapshot.zeroes.size(), header.infoBytes = sizeof( BrickInfo );
+	header.tag = tag;
+	header.gridOffset = SNAPSHOTALIGN;
+	header.brickOffset = SnapshotAlign( header.gridOffset + (uint64_t)GRIDSIZE * 4 );
+	header.infoOffset = SnapshotAlign( header.brickOffset + (uint64_t)header.brickCount * header.brickBytes );
+	header.userOffset = header.infoOffset + (uint64_t)header.brickCount * sizeof( BrickInfo );
+	header.userSize = user ? userSize : 0;
+	vector<BrickInfo> info( header.brickCount );
+	for (uint i = 0; i < header.brickCount; i++) info[i].zeroes = snapshot.zeroes[i];
+	FILE* f = fopen( file, "wb" );
+	if (!f) return false;
+	// sections are written in order; the zero padding between them keeps the offsets aligned
+	const auto WriteAt = [f]( const uint64_t offset, const void* data, const size_t bytes )
+	{
+		static const uchar zeroes[4096] = { 0 };
+		for (int64_t pad = (int64_t)offset - _ftelli64( f ); pad > 0; pad -= sizeof( zeroes ))
+			if (fwrite( zeroes, (size_t)min<int64_t>( pad, sizeof( zeroes ) ), 1, f ) != 1) return false;
+		return bytes == 0 || fwrite( data, bytes, 1, f ) == 1;
+	};
+	bool ok = WriteAt( 0, &header, sizeof( header ) );
+	ok = ok && WriteAt( header.gridOffset, cells.data(), GRIDSIZE * 4 );
+	ok = ok && WriteAt( header.brickOffset, snapshot.bricks.data(), snapshot.bricks.size() * PAYLOADSIZE );
+	ok = ok && WriteAt( header.infoOffset, info.data(), info.size() * sizeof( BrickInfo ) );
+	ok = ok && WriteAt( header.userOffset, user, (size_t)header.userSize );
+	return (fclose( f ) == 0) && ok;
+}
+
+// World::LoadSnapshotFile: adopt a snapshot file as the world contents; the bricks
+// are mapped copy-on-write, so only the pages that get used are ever read
+// ----------------------------------------------------------------------------
+bool World::LoadSnapshotFile( const char* file, const uint64_t tag, void* user, const size_t userSize )
+{
+	PROFILE_SCOPE( "Load snapshot file" );
+	HANDLE handle = CreateFileA( file, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if (handle == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = 0;
+	if (GetFileSizeEx( handle, &fileSize ) && fileSize.QuadPart >= (LONGLONG)sizeof( SnapshotFileHeader ))
+		mapping = CreateFileMappingA( handle, NULL, PAGE_WRITECOPY, 0, 0, NULL );
+	CloseHandle( handle ); // views keep the file open
+	if (!mapping) return false;
+	const uchar* data = (const uchar*)MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+	if (!data) { CloseHandle( mapping ); return false; }
+	// validate before touching the world
+	SnapshotFileHeader header;
+	memcpy( &header, data, sizeof( header ) );
+	const uint64_t size = (uint64_t)fileSize.QuadPart;
+	const uint64_t brickBytes = (uint64_t)header.brickCount * BRICKSIZE * PAYLOADSIZE;
+	bool valid = header.magic == SNAPSHOTMAGIC && header.version == SNAPSHOTVERSION &&
+		header.gridSize == GRIDSIZE && header.brickBytes == BRICKSIZE * PAYLOADSIZE &&
+		header.infoBytes == sizeof( BrickInfo ) && header.brickCount <= BRICKCOUNT && header.tag == tag &&
+		header.userSize == (user ? userSize : header.userSize) &&
+		header.gridOffset + (uint64_t)GRIDSIZE * 4 <= size && header.brickOffset % SNAPSHOTALIGN == 0 &&
+		header.brickOffset + brickBytes <= size &&
+		header.infoOffset + (uint64_t)header.brickCount * sizeof( BrickInfo ) <= size &&
+		header.userOffset + header.userSize <= size;
+	// every brick cell must refer to a stored brick; a stale or damaged file would otherwise
+	// leave cells pointing past the loaded bricks, at slots the trash ring still hands out
+	const uint* cells = (const uint*)(data + header.gridOffset);
+	for (uint i = 0; valid && i < GRIDSIZE; i++) if ((cells[i] & 1) && (cells[i] >> 1) >= header.brickCount) valid = false;
+	if (valid)
+	{
+		Clear();
+		memcpy( grid, data + header.gridOffset, GRIDSIZE * 4 );
+		memcpy( brickInfo, data + header.infoOffset, header.brickCount * sizeof( BrickInfo ) );
+		if (user) memcpy( user, data + header.userOffset, userSize );
+		// map the brick section in place; the file pads it to the allocation granularity
+		const size_t mappedBytes = (size_t)min<uint64_t>( SnapshotAlign( brickBytes ), brickStoreSize );
+		if (header.brickCount > 0 && (mappedBytes > size - header.brickOffset || !MapBricks( mapping, header.brickOffset, mappedBytes )))
 		{
-			// we found a voxel that is not identical to the first one; stop
-			solid = false;
-			break;
+			if (sparsePool) for (uint p = 0; p < (header.brickCount + POOLPAGE - 1) / POOLPAGE; p++) CommitPage( p );
+			memcpy( brick, data + header.brickOffset, brickBytes );
 		}
-		if (solid)
+		// stored bricks occupy indices 0..brickCount-1, which are the first ones the trash ring hands out
+		trashTail = header.brickCount * TRASHSTRIDE;
+		for (uint i = 0; i < header.brickCount; i++) Mark( i ); // tag to be synced with GPU
+		// bricks referenced by several cells were shared when the file was written
+		vector<uchar> seen( header.brickCount, 0 );
+		for (uint i = 0; i < GRIDSIZE; i++) if (grid[i] & 1)
+		{
+			const uint idx = grid[i] >> 1;
+			if (!seen[idx]) { seen[idx] = 1; continue; }
+			if (!brickRefs) brickRefs = (uint*)_aligned_malloc( BRICKCOUNT * 4, 64 ), memset( brickRefs, 0, BRICKCOUNT * 4 );
+			brickRefs[idx]++;
+		}
+		gridDirty = true; // with brickCount == 0 nothing is marked, yet the grid changed
+		RebuildOccupancy();
+		if (surface) RebuildSurface();
+	}
+	UnmapViewOfFile( data );
+	CloseHandle( mapping );
+	return valid;
+}
+
+// Placeholder API (Windows 10 1803+), resolved at runtime. A placeholder keeps the
+// address range of the brick store reserved while a snapshot view replaces its
+// memory; without it, snapshots get copied into the store instead of mapped.
+// ----------------------------------------------------------------------------
+static decltype(&VirtualAlloc2) pVirtualAlloc2 = 0;
+static decltype(&MapViewOfFile3) pMapViewOfFile3 = 0;
+static decltype(&UnmapViewOfFile2) pUnmapViewOfFile2 = 0;
+static bool PlaceholdersAvailable()
+{
+	static const bool available = []()
+	{
+		const HMODULE kernel = GetModuleHandleA( "kernelbase.dll" );
+		if (!kernel) return false;
+		pVirtualAlloc2 = (decltype(&VirtualAlloc2))GetProcAddress( kernel, "VirtualAlloc2" );
+		pMapViewOfFile3 = (decltype(&MapViewOfFile3))GetProcAddress( kernel, "MapViewOfFile3" );
+		pUnmapViewOfFile2 = (decltype(&UnmapViewOfFile2))GetProcAddress( kernel, "UnmapViewOfFile2" );
+		return pVirtualAlloc2 && pMapViewOfFile3 && pUnmapViewOfFile2;
+	}();
+	return available;
+}
+
+// World::AllocateBricks: plain brick store memory; with a base, it replaces the
+// placeholder there, otherwise a new store (in a new placeholder, if possible)
+// ----------------------------------------------------------------------------
+void World::AllocateBricks( void* base )
+{
+	const DWORD allocation = sparsePool ? MEM_RESERVE : MEM_RESERVE | MEM_COMMIT;
+	if (!base && PlaceholdersAvailable())
+	{
+		base = pVirtualAlloc2( 0, 0, brickStoreSize, MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, 0, 0 );
+		placeholderStore = base != 0;
+	}
+	if (placeholderStore) brick = (PAYLOAD*)pVirtualAlloc2( 0, base, brickStoreSize, allocation | MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE, 0, 0 );
+	else brick = (PAYLOAD*)VirtualAlloc( 0, brickStoreSize, allocation, PAGE_READWRITE );
+	if (!brick || (base && brick != base)) FATALERROR( "Failed to allocate the brick store" );
+}
+
+// World::BricksToPlaceholder: turn the brick store, mapped or not, back into a
+// single placeholder; the address range is never released in between
+// ----------------------------------------------------------------------------
+void World::BricksToPlaceholder()
+{
+	if (brickView)
+	{
+		pUnmapViewOfFile2( GetCurrentProcess(), brickView, MEM_PRESERVE_PLACEHOLDER );
+		if (brickRest)
 		{
-			// this one has 8x8x8 times the same voxel; replace by solid brick in grid
-			grid[i] = firstVoxel << 1;
-			// recycle brick
-			FreeBrick( value >> 1 );
-			// statistics
-			replaced++;
+			VirtualFree( brickRest, brickStoreSize - viewBytes, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER );
+			VirtualFree( brick, brickStoreSize, MEM_RELEASE | MEM_COALESCE_PLACEHOLDERS );
 		}
+		brickView = brickRest = 0, viewBytes = 0;
 	}
-	printf( "optimizing world data took %5.2fms; replaced %i bricks.\n", t.elapsed() * 1000.0f, replaced );
+	else VirtualFree( brick, brickStoreSize, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER );
+}
+
+// World::MapBricks: replace the start of the brick store by a copy-on-write view
+// of a snapshot file, at the same address (the OpenCL brick buffers point there)
+// ----------------------------------------------------------------------------
+bool World::MapBricks( HANDLE mapping, const uint64_t offset, const size_t bytes )
+{
+	if (!placeholderStore) return false; // the range would be up for grabs between unmap and map
+	uchar* base = (uchar*)brick;
+	BricksToPlaceholder();
+	// split the placeholder, so the view and the rest of the store each replace one part
+	if (bytes < brickStoreSize) VirtualFree( base, bytes, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER );
+	brickView = pMapViewOfFile3( mapping, 0, base, offset, bytes, MEM_REPLACE_PLACEHOLDER, PAGE_WRITECOPY, 0, 0 );
+	const DWORD allocation = (sparsePool ? MEM_RESERVE : MEM_RESERVE | MEM_COMMIT) | MEM_REPLACE_PLACEHOLDER;
+	if (brickView && bytes < brickStoreSize)
+		brickRest = pVirtualAlloc2( 0, base + bytes, brickStoreSize - bytes, allocation, PAGE_READWRITE, 0, 0 );
+	if (brickView && (brickRest || bytes == brickStoreSize))
+	{
+		viewBytes = bytes;
+		ResetPool( (uint)(bytes / poolPageSize) );
+		return true;
+	}
+	// mapping failed; rejoin the placeholder and go back to a plain store at the same address
+	if (brickView) pUnmapViewOfFile2( GetCurrentProcess(), brickView, MEM_PRESERVE_PLACEHOLDER );
+	brickView = brickRest = 0;
+	if (bytes < brickStoreSize) VirtualFree( base, brickStoreSize, MEM_RELEASE | MEM_COALESCE_PLACEHOLDERS );
+	AllocateBricks( base );
+	ResetPool( 0 );
+	return false;
+}
+
+// World::ResetPool: page bookkeeping for a freshly allocated or mapped brick store
+// ----------------------------------------------------------------------------
+void World::ResetPool( const uint mappedPages )
+{
+	// a mapped snapshot view is always accessible; the rest is committed unless sparse
+	viewPages = mappedPages;
+	memset( pageState, sparsePool ? 0 : 1, POOLPAGES );
+	memset( pageState, 1, mappedPages );
+	committedBytes = sparsePool ? mappedPages * poolPageSize : brickStoreSize;
+	peakCommitted = max( peakCommitted, committedBytes );
+}
+
+// World::CommitPage: back a page of a sparse brick store with memory
+// ----------------------------------------------------------------------------
+void World::CommitPage( const uint page )
+{
+	lock_guard<mutex> lock( poolLock );
+	if (atomic_ref<uchar>( pageState[page] ).load( memory_order_relaxed )) return; // another thread was first
+	if (!VirtualAlloc( (uchar*)brick + page * poolPageSize, poolPageSize, MEM_COMMIT, PAGE_READWRITE ))
+		FATALERROR( "Failed to commit %iKB of brick memory", (int)(poolPageSize >> 10) );
+	committedBytes += poolPageSize;
+	peakCommitted = max( peakCommitted, committedBytes );
+	atomic_ref<uchar>( pageState[page] ).store( 1, memory_order_release );
+}
+
+// World::TrimBricks: decommit the pages of a sparse brick store whose bricks have all been
+// free for POOLIDLE calls, so a world that shrinks gives its memory back. Bricks still
+// cached in magazines may sit on such pages; NewBrick recommits them when handed out.
+// Must not run while other threads modify the world.
+// ----------------------------------------------------------------------------
+uint World::TrimBricks()
+{
+	if (!sparsePool || updating) return 0; // during a diff update, the old bricks live in gridShadow
+	PROFILE_SCOPE( "Trim bricks" );
+	// a page is in use when the grid references one of its plain bricks, or one is waiting
+	// to be committed; GatherBricks reads dirty bricks, even stale ones
+	MergeMarks();
+	vector<uchar> used( POOLPAGES, 0 );
+	for (uint i = 0; i < GRIDSIZE; i++) if ((grid[i] & 1) && !(packHandle && packHandle[grid[i] >> 1]))
+		used[(grid[i] >> 1) / POOLPAGE] = 1; // packed bricks do not need their plain slot
+	for (uint j = 0; j < BRICKCOUNT / 32; j++) if (modified[j]) used[j * 32 / POOLPAGE] = 1;
+	uint released = 0;
+	for (uint p = viewPages; p < POOLPAGES; p++)
+	{
+		if (pageState[p] == 0) continue; // not committed
+		if (used[p]) { pageState[p] = 1; continue; }
+		if (++pageState[p] <= POOLIDLE) continue;
+		VirtualFree( (uchar*)brick + p * poolPageSize, poolPageSize, MEM_DECOMMIT );
+		pageState[p] = 0, committedBytes -= poolPageSize;
+		released++;
+	}
+	return released;
+}
+
+// World::ReleaseBricks: free the brick store, mapped or not
+// ----------------------------------------------------------------------------
+void World::ReleaseBricks()
+{
+	if (placeholderStore) BricksToPlaceholder(); // then release the placeholder itself
+	VirtualFree( brick, 0, MEM_RELEASE );
 }
 
 // World::DummyWorld: box
@@ -259,10 +769,462 @@ void World::Clear()
 {
 	// easiest top just clear the top-level grid and recycle all bricks
 	memset( grid, 0, GRIDWIDTH * GRIDHEIGHT * GRIDDEPTH * sizeof( uint ) );
+	memset( occupancy, 0, UBERSIZE * 8 );
+	if (surface) memset( surface, 0, MAPWIDTH * MAPDEPTH * 4 );
 	memset( trash, 0, BRICKCOUNT * 4 );
-	for (uint i = 0; i < BRICKCOUNT; i++) trash[(i * 31 /* prevent false sharing*/) & (BRICKCOUNT - 1)] = i;
+	for (uint i = 0; i < BRICKCOUNT; i++) trash[(i * TRASHSTRIDE /* prevent false sharing*/) & (BRICKCOUNT - 1)] = i;
 	trashHead = BRICKCOUNT, trashTail = 0;
+	trashEpoch++, peakBricks = 0; // bricks cached in magazines are back in the ring
 	ClearMarks();
+	if (brickRefs) memset( brickRefs, 0, BRICKCOUNT * 4 );
+	if (packHandle) memset( packHandle, 0, BRICKCOUNT * 4 );
+	packStore.clear(), packFree[0].clear(), packFree[1].clear(), packFree[2].clear(), packedBricks = 0;
+	brickHashes.clear();
+	updating = false; // all bricks were recycled; nothing left to compare against
+	gridDirty = true; // cells change without dirty bricks; Commit must upload the grid
+}
+
+// World::RefillMagazine: take BRICKBATCH bricks from the shared ring
+// ----------------------------------------------------------------------------
+void World::RefillMagazine( BrickMagazine& m )
+{
+	// one atomic add claims the whole batch; stored in reverse, so the bricks are
+	// handed out in ring order (the first N after Clear are 0..N-1)
+	const uint first = trashTail.fetch_add( TRASHSTRIDE * BRICKBATCH, memory_order_relaxed );
+	for (uint i = 0; i < BRICKBATCH; i++) m.brick[BRICKBATCH - 1 - i] = trash[(first + i * TRASHSTRIDE) & (BRICKCOUNT - 1)];
+	m.count = BRICKBATCH;
+	refills++;
+	const uint taken = BricksInUse();
+	for (uint peak = peakBricks; taken > peak && !peakBricks.compare_exchange_weak( peak, taken );)
+		;
+}
+
+// World::FlushMagazine: return the least recently freed bricks to the shared ring
+// ----------------------------------------------------------------------------
+void World::FlushMagazine( BrickMagazine& m, const uint bricks )
+{
+	const uint first = trashHead.fetch_add( TRASHSTRIDE * bricks, memory_order_relaxed );
+	for (uint i = 0; i < bricks; i++) trash[(first + i * TRASHSTRIDE) & (BRICKCOUNT - 1)] = m.brick[i];
+	m.count -= bricks;
+	memmove( m.brick, m.brick + bricks, m.count * sizeof( uint ) );
+	flushes++;
+}
+
+// World::BindMagazine: make the magazine of the calling thread work on this world
+// ----------------------------------------------------------------------------
+void World::BindMagazine( BrickMagazine& m )
+{
+	// bricks cached for another world go back to that world; bricks cached before
+	// our own ring was rebuilt are back in the ring already, so those are dropped
+	if (m.owner != self) m.Release();
+	m.owner = self, m.epoch = trashEpoch, m.count = 0;
+}
+
+// World::BrickMagazine::Release: a thread that exits or moves on to another world
+// hands its bricks back
+// ----------------------------------------------------------------------------
+void World::BrickMagazine::Release()
+{
+	if (owner && count > 0)
+	{
+		lock_guard<mutex> lock( owner->lock );
+		World* world = owner->world;
+		if (world && epoch == world->trashEpoch) world->FlushMagazine( *this, count );
+	}
+	owner = 0, count = 0;
+}
+
+// World::GetBrickStats
+// ----------------------------------------------------------------------------
+BrickStats World::GetBrickStats()
+{
+	BrickStats stats = {};
+	for (uint i = 0; i < GRIDSIZE; i++) stats.inUse += grid[i] & 1;
+	if (brickRefs) for (uint i = 0; i < BRICKCOUNT; i++) stats.shared += brickRefs[i];
+	const uint taken = BricksInUse(), distinct = stats.inUse - stats.shared;
+	stats.cached = taken > distinct ? taken - distinct : 0;
+	stats.free = BRICKCOUNT - taken;
+	stats.peak = peakBricks, stats.refills = refills, stats.flushes = flushes;
+	stats.committed = committedBytes, stats.peakCommitted = peakCommitted;
+	stats.packed = packedBricks, stats.packedBytes = packStore.size() * PACKUNIT;
+	return stats;
+}
+
+// World::BeginUpdate: like Clear, but the bricks of the current world stay allocated,
+// so EndUpdate can compare the re-plotted world against them
+// ----------------------------------------------------------------------------
+void World::BeginUpdate()
+{
+	// the old and the new bricks must fit side by side; otherwise simply start over
+	if (BricksInUse() > BRICKCOUNT / 2)
+	{
+		Clear();
+		return;
+	}
+	if (!gridShadow) gridShadow = (uint*)_aligned_malloc( gridSize, 64 );
+	memcpy( gridShadow, grid, gridSize );
+	memset( grid, 0, gridSize );
+	memset( occupancy, 0, UBERSIZE * 8 ); // Set marks the re-plotted cells again
+	if (surface) memset( surface, 0, MAPWIDTH * MAPDEPTH * 4 ); // and raises the columns again
+	updating = true;
+}
+
+// World::EndUpdate: swap unchanged bricks back in, so only real changes get committed
+// ----------------------------------------------------------------------------
+#define DIFFJOBS	64
+uint World::EndUpdate()
+{
+	if (!updating) return GetDirtyBrickCount(); // BeginUpdate fell back to Clear
+	updating = false;
+	MergeMarks(); // marks of the re-plotted bricks, so UnMark below clears them for good
+	static JobManager* jm = JobManager::GetJobManager();
+	static DiffJob dj[DIFFJOBS];
+	for (uint i = 0; i < DIFFJOBS; i++)
+	{
+		dj[i].world = this, dj[i].first = i * (GRIDSIZE / DIFFJOBS), dj[i].last = (i + 1) * (GRIDSIZE / DIFFJOBS);
+		jm->AddJob2( &dj[i] );
+	}
+	jm->RunJobs();
+	uint changed = 0;
+	for (uint i = 0; i < DIFFJOBS; i++) changed += dj[i].changed;
+	gridDirty |= changed > 0; // the device grid may still point at bricks that were just released
+	return changed;
+}
+
+// helper for EndUpdate: compare brick contents, 256 bytes at a time
+static bool SameBrick( const PAYLOAD* a, const PAYLOAD* b )
+{
+	const __m256i* va = (const __m256i*)a, * vb = (const __m256i*)b;
+	for (int i = 0; i < BRICKSIZE * PAYLOADSIZE / 32; i += 8)
+	{
+		__m256i d = _mm256_xor_si256( _mm256_load_si256( va + i ), _mm256_load_si256( vb + i ) );
+		for (int j = 1; j < 8; j++) d = _mm256_or_si256( d, _mm256_xor_si256( _mm256_load_si256( va + i + j ), _mm256_load_si256( vb + i + j ) ) );
+		if (!_mm256_testz_si256( d, d )) return false;
+	}
+	return true;
+}
+
+// World::DiffJob::Main: settle a range of grid cells after a diff update
+// ----------------------------------------------------------------------------
+void World::DiffJob::Main()
+{
+	changed = 0;
+	alignas(32) PAYLOAD scratch[BRICKSIZE];
+	for (uint c = first; c < last; c++)
+	{
+		const uint o = world->gridShadow[c], n = world->grid[c];
+		if ((n & 1) && (o & 1) && SameBrick( world->BrickVoxels( o >> 1, scratch ), world->brick + (n >> 1) * BRICKSIZE ))
+		{
+			// identical contents: keep the old brick, which the GPU already has
+			world->grid[c] = o;
+			world->UnMark( n >> 1 );
+			world->FreeBrick( n >> 1 );
+			continue;
+		}
+		// the old brick is gone or replaced
+		if (o & 1) world->ReleaseBrick( o >> 1 );
+		changed += n != o; // includes cells that were emptied or turned solid, which mark no brick
+	}
+}
+
+// World::UnshareBrick: copy-on-write for Set; gives a cell its own copy of a shared brick
+// ----------------------------------------------------------------------------
+uint World::UnshareBrick( const uint cellIdx, const uint idx )
+{
+	// cells sharing the brick may be unsharing it at the same time; whoever leaves last
+	// keeps the original. The count drops after the copy, so a writer that sees zero
+	// never modifies a brick that is still being copied.
+	lock_guard<mutex> lock( shareLock );
+	atomic_ref<uint> refs( brickRefs[idx] );
+	if (refs.load( memory_order_acquire ) == 0) return idx;
+	const uint copy = NewBrick();
+	PAYLOAD* voxels = brick + copy * BRICKSIZE;
+	const PAYLOAD* src = BrickVoxels( idx, voxels );
+	if (src != voxels) memcpy( voxels, src, BRICKSIZE * PAYLOADSIZE );
+	brickInfo[copy].zeroes = brickInfo[idx].zeroes;
+	for (uint r = refs.load(); r > 0;) if (refs.compare_exchange_weak( r, r - 1, memory_order_release ))
+	{
+		grid[cellIdx] = (copy << 1) | 1;
+		return copy;
+	}
+	// the other users released the brick in the meantime
+	FreeBrick( copy );
+	return idx;
+}
+
+// helper for DedupBricks: 64-bit hash of brick contents, four lanes to keep the multiplies apart
+static uint64_t BrickHash( const PAYLOAD* voxels )
+{
+	const uint64_t* w = (const uint64_t*)voxels;
+	uint64_t h[4] = { 0xcbf29ce484222325ull, 0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full, 0x165667b19e3779f9ull };
+	for (int i = 0; i < BRICKSIZE * PAYLOADSIZE / 8; i += 4) for (int j = 0; j < 4; j++) h[j] = (h[j] ^ w[i + j]) * 0x100000001b3ull;
+	uint64_t r = h[0];
+	for (int j = 1; j < 4; j++) r = (r ^ (h[j] + (r >> 31))) * 0x9e3779b97f4a7c15ull;
+	return r ^ (r >> 32);
+}
+
+// World::DedupJob::Main: hash the bricks of a range of grid cells
+// ----------------------------------------------------------------------------
+void World::DedupJob::Main()
+{
+	hash.clear(), cell.clear();
+	alignas(32) PAYLOAD scratch[BRICKSIZE];
+	for (uint c = first; c < last; c++)
+	{
+		const uint g = world->grid[c], idx = g >> 1;
+		if (!(g & 1) || (dirtyOnly && !(world->modified[idx >> 5] & (1u << (idx & 31))))) continue;
+		hash.push_back( BrickHash( world->BrickVoxels( idx, scratch ) ) );
+		cell.push_back( c );
+	}
+}
+
+// World::DedupBricks: cells with identical brick contents share a single brick, which cuts
+// the host and device footprint and the commit volume. Writes to a shared brick copy it
+// first (see UnshareBrick). With dirtyOnly set, only bricks waiting to be committed are
+// hashed and matched against the bricks seen in earlier passes; shared dirty bricks are
+// recycled before they are ever uploaded. Returns the number of cells that now share.
+// ----------------------------------------------------------------------------
+#define DEDUPJOBS	64
+uint World::DedupBricks( const bool dirtyOnly )
+{
+	PROFILE_SCOPE( "Dedup bricks" );
+	if (!brickRefs) brickRefs = (uint*)_aligned_malloc( BRICKCOUNT * 4, 64 ), memset( brickRefs, 0, BRICKCOUNT * 4 );
+	if (!dirtyOnly) brickHashes.clear();
+	else if (GetDirtyBrickCount() == 0) return 0; // also merges the dirty maps
+	static JobManager* jm = JobManager::GetJobManager();
+	static DedupJob dj[DEDUPJOBS];
+	for (uint i = 0; i < DEDUPJOBS; i++)
+	{
+		dj[i].world = this, dj[i].dirtyOnly = dirtyOnly;
+		dj[i].first = i * (GRIDSIZE / DEDUPJOBS), dj[i].last = (i + 1) * (GRIDSIZE / DEDUPJOBS);
+		jm->AddJob2( &dj[i] );
+	}
+	jm->RunJobs();
+	// match in grid order; the table only holds hints, since the cell it names may have
+	// changed since it was hashed, so contents are always compared before sharing
+	uint shared = 0;
+	alignas(32) PAYLOAD scratch[2][BRICKSIZE];
+	for (uint i = 0; i < DEDUPJOBS; i++) for (size_t j = 0; j < dj[i].cell.size(); j++)
+	{
+		const uint c = dj[i].cell[j], g = grid[c];
+		const auto [it, inserted] = brickHashes.try_emplace( dj[i].hash[j], c );
+		if (inserted) continue;
+		const uint o = grid[it->second];
+		if (o == g) continue; // same cell, or already sharing
+		if (!(o & 1) || !SameBrick( BrickVoxels( o >> 1, scratch[0] ), BrickVoxels( g >> 1, scratch[1] ) ))
+		{
+			it->second = c; // stale entry or hash collision; the newest cell takes over
+			continue;
+		}
+		brickRefs[o >> 1]++;
+		ReleaseBrick( g >> 1 );
+		grid[c] = o;
+		shared++;
+	}
+	gridDirty |= shared > 0;
+	return shared;
+}
+
+// World::DecodeBrick: expand a palette-packed brick
+// ----------------------------------------------------------------------------
+void World::DecodeBrick( const uint handle, PAYLOAD* voxels ) const
+{
+	const uint bits = 1 << ((handle & 3) - 1), mask = (1 << bits) - 1, perByte = 8 / bits;
+	const PAYLOAD* palette = (const PAYLOAD*)(packStore.data() + (handle >> 2));
+	const uchar* indices = (const uchar*)(palette + (1 << bits));
+	for (uint i = 0; i < BRICKSIZE / perByte; i++) for (uint j = 0, byte = indices[i]; j < perByte; j++, byte >>= bits)
+		*voxels++ = palette[byte & mask];
+}
+
+// World::UnpackBrick: turn a packed brick back into a plain one, before it gets written to.
+// Without decode, the packed form is simply dropped, e.g. when the brick is recycled.
+// ----------------------------------------------------------------------------
+void World::UnpackBrick( const uint idx, const bool decode )
+{
+	lock_guard<mutex> lock( packLock );
+	const uint handle = packHandle[idx];
+	if (handle == 0) return; // another thread was first
+	if (decode)
+	{
+		// in a sparse store, the plain slot may have been decommitted in the meantime
+		if (sparsePool && !atomic_ref<uchar>( pageState[idx / POOLPAGE] ).load( memory_order_acquire )) CommitPage( idx / POOLPAGE );
+		DecodeBrick( handle, brick + idx * BRICKSIZE );
+	}
+	// readers that fetched the handle before this point may still decode the packed form;
+	// its slot is only reused by the next PackBricks
+	atomic_ref<uint>( packHandle[idx] ).store( 0, memory_order_release );
+	packFree[(handle & 3) - 1].push_back( handle >> 2 );
+	packedBricks--;
+}
+
+// World::PackJob::Main: encode the bricks of a range of grid cells
+// ----------------------------------------------------------------------------
+void World::PackJob::Main()
+{
+	cell.clear(), bits.clear(), offset.clear(), units.clear();
+	for (uint c = first; c < last; c++)
+	{
+		const uint g = world->grid[c], idx = g >> 1;
+		if (!(g & 1) || world->packHandle[idx]) continue;
+		// collect the distinct values; more than 16 and the brick stays plain
+		const PAYLOAD* voxels = world->brick + idx * BRICKSIZE;
+		PAYLOAD palette[16];
+		uint count = 0, i = 0;
+		for (; i < BRICKSIZE; i++)
+		{
+			uint k = 0;
+			while (k < count && palette[k] != voxels[i]) k++;
+			if (k < count) continue;
+			if (count == 16) break;
+			palette[count++] = voxels[i];
+		}
+		if (i < BRICKSIZE) continue;
+		const uint b = count == 1 ? 0 : count <= 2 ? 1 : count <= 4 ? 2 : 4;
+		cell.push_back( c ), bits.push_back( (uchar)b );
+		if (b == 0) { offset.push_back( palette[0] ); continue; } // uniform: becomes a solid cell
+		const uint base = (uint)units.size();
+		offset.push_back( base );
+		units.resize( base + PACKUNITS( b ) ); // zeroed, so indices can be or'ed in
+		PAYLOAD* packed = (PAYLOAD*)units[base].bytes;
+		memcpy( packed, palette, count * PAYLOADSIZE );
+		uchar* indices = (uchar*)(packed + (1 << b));
+		for (uint v = 0, k = 0; v < BRICKSIZE; v++)
+		{
+			if (palette[k] != voxels[v]) for (k = 0; palette[k] != voxels[v]; k++);
+			indices[(v * b) >> 3] |= k << ((v * b) & 7);
+		}
+	}
+}
+
+// World::PackBricks: store every brick with at most 16 distinct values as a palette plus
+// 1-, 2- or 4-bit indices, which is most of a generated terrain. Get and TraceRay decode
+// packed bricks on the fly, Set expands a brick before writing to it, and GatherBricks
+// sends the device plain bricks. The plain slots keep their contents, since the device
+// buffers mirror them; a sparse store gives their pages back in TrimBricks. Uniform
+// bricks become solid cells. Must not run while other threads access the world.
+// ----------------------------------------------------------------------------
+#define PACKJOBS	64
+uint World::PackBricks()
+{
+	PROFILE_SCOPE( "Pack bricks" );
+	if (!packHandle) packHandle = (uint*)_aligned_malloc( BRICKCOUNT * 4, 64 ), memset( packHandle, 0, BRICKCOUNT * 4 );
+	static JobManager* jm = JobManager::GetJobManager();
+	static PackJob pj[PACKJOBS];
+	for (uint i = 0; i < PACKJOBS; i++)
+	{
+		pj[i].world = this, pj[i].first = i * (GRIDSIZE / PACKJOBS), pj[i].last = (i + 1) * (GRIDSIZE / PACKJOBS);
+		jm->AddJob2( &pj[i] );
+	}
+	jm->RunJobs();
+	// place the encoded bricks in the store, reusing free slots of the same index width
+	uint packed = 0, solid = 0;
+	for (uint i = 0; i < PACKJOBS; i++) for (size_t j = 0; j < pj[i].cell.size(); j++)
+	{
+		const uint c = pj[i].cell[j], idx = grid[c] >> 1, b = pj[i].bits[j];
+		if (b == 0)
+		{
+			grid[c] = pj[i].offset[j] << 1;
+			if (!pj[i].offset[j]) { const int3 b = CellCoord( c ); ClearOccupied( b.x, b.y, b.z ); }
+			ReleaseBrick( idx );
+			solid++;
+			continue;
+		}
+		if (packHandle[idx]) continue; // shared with a cell that came first
+		const uint width = b == 4 ? 2 : b - 1, units = PACKUNITS( b );
+		uint slot;
+		if (!packFree[width].empty()) slot = packFree[width].back(), packFree[width].pop_back();
+		else slot = (uint)packStore.size(), packStore.resize( slot + units );
+		memcpy( packStore.data() + slot, pj[i].units.data() + pj[i].offset[j], units * PACKUNIT );
+		packHandle[idx] = (slot << 2) | (width + 1);
+		packed++;
+	}
+	packedBricks += packed;
+	gridDirty |= solid > 0;
+	return packed;
+}
+
+// World::RebuildOccupancy: after bulk changes to the top-level grid
+// ----------------------------------------------------------------------------
+#define OCCUPANCYJOBS	32	// slabs of UBERHEIGHT / OCCUPANCYJOBS layers
+void World::RebuildOccupancy()
+{
+	static JobManager* jm = JobManager::GetJobManager();
+	static OccupancyJob oj[OCCUPANCYJOBS];
+	for (uint i = 0; i < OCCUPANCYJOBS; i++)
+	{
+		oj[i].world = this, oj[i].first = i * (UBERSIZE / OCCUPANCYJOBS), oj[i].last = (i + 1) * (UBERSIZE / OCCUPANCYJOBS);
+		jm->AddJob2( &oj[i] );
+	}
+	jm->RunJobs();
+}
+void World::OccupancyJob::Main()
+{
+	for (uint u = first; u < last; u++)
+	{
+		const uint ux = (u % UBERWIDTH) * 4, uz = ((u / UBERWIDTH) % UBERDEPTH) * 4, uy = (u / (UBERWIDTH * UBERDEPTH)) * 4;
+		uint64_t mask = 0;
+		for (uint y = 0; y < 4; y++) for (uint z = 0; z < 4; z++) for (uint x = 0; x < 4; x++)
+			if (world->grid[CellIndex( ux + x, uy + y, uz + z )]) mask |= 1ull << UberBit( x, y, z );
+		world->occupancy[u] = mask;
+	}
+}
+
+// World::EnableSurfaceMap: maintain the highest solid voxel of each column, so
+// surface queries don't have to read or trace down from the top of the map.
+// Set keeps the map current; bulk operations that bypass Set rebuild or reset it.
+// ----------------------------------------------------------------------------
+#define SURFACEJOBS	64	// slabs of MAPDEPTH / SURFACEJOBS rows
+void World::EnableSurfaceMap( const bool enabled )
+{
+	if (enabled == (surface != 0)) return;
+	if (!enabled) { _aligned_free( surface ); surface = 0; return; }
+	surface = (uint*)_aligned_malloc( MAPWIDTH * MAPDEPTH * 4, 64 );
+	RebuildSurface();
+}
+void World::RebuildSurface()
+{
+	static JobManager* jm = JobManager::GetJobManager();
+	static SurfaceJob sj[SURFACEJOBS];
+	for (uint i = 0; i < SURFACEJOBS; i++)
+	{
+		sj[i].world = this, sj[i].first = i * (MAPDEPTH / SURFACEJOBS), sj[i].last = (i + 1) * (MAPDEPTH / SURFACEJOBS);
+		jm->AddJob2( &sj[i] );
+	}
+	jm->RunJobs();
+}
+void World::SurfaceJob::Main()
+{
+	for (uint z = first; z < last; z++) for (uint x = 0; x < MAPWIDTH; x++)
+		world->surface[x + z * MAPWIDTH] = world->ColumnTop( x, MAPHEIGHT, z );
+}
+// World::ColumnTop: highest solid voxel of a column below height 'below', encoded
+// as a surface map entry. Empty uber cells and empty grid cells are skipped whole.
+uint World::ColumnTop( const uint x, const uint below, const uint z )
+{
+	const uint bx = x / BRICKDIM, bz = z / BRICKDIM;
+	for (int by = ((int)below - 1) / BRICKDIM; by >= 0; by--)
+	{
+		if (!occupancy[UberIndex( bx, by, bz )]) { by &= ~3; continue; }
+		const uint g = grid[CellIndex( bx, by, bz )];
+		if (g == 0) continue;
+		const uint ly = min( (uint)BRICKDIM, below - by * BRICKDIM ); // voxels of this cell below 'below'
+		if ((g & 1) == 0) return ((by * BRICKDIM + ly) << 16) + ((g >> 1) & 0xffff);
+		for (int y = by * BRICKDIM + ly - 1; y >= by * BRICKDIM; y--)
+		{
+			const uint v = Get( x, y, z );
+			if (v) return ((y + 1) << 16) + (v & 0xffff);
+		}
+	}
+	return 0;
+}
+// World::UpdateSurfaceCell: a whole cell was written without Set (tiles); columns
+// topped at or below the cell get their top again from the cell downward.
+void World::UpdateSurfaceCell( const uint cellIdx )
+{
+	const int3 b = CellCoord( cellIdx );
+	const uint cellTop = (b.y + 1) * BRICKDIM;
+	for (uint z = b.z * BRICKDIM; z < (b.z + 1) * BRICKDIM; z++) for (uint x = b.x * BRICKDIM; x < (b.x + 1) * BRICKDIM; x++)
+		if ((surface[x + z * MAPWIDTH] >> 16) <= cellTop) surface[x + z * MAPWIDTH] = ColumnTop( x, cellTop, z );
 }
 
 // World::Fill
@@ -270,12 +1232,20 @@ void World::Clear()
 void World::Fill( const uint c )
 {
 	// fill the top-level grid and recycle all bricks
-	for (int y = 0; y < GRIDHEIGHT; y++) for (int z = 0; z < GRIDDEPTH; z++) for (int x = 0; x < GRIDWIDTH; x++)
-		grid[x + z * GRIDWIDTH + y * GRIDWIDTH * GRIDDEPTH] = c << 1;
+	for (uint i = 0; i < GRIDSIZE; i++) grid[i] = c << 1;
+	memset( occupancy, c ? 255 : 0, UBERSIZE * 8 );
+	if (surface) for (uint i = 0; i < MAPWIDTH * MAPDEPTH; i++) surface[i] = c ? (MAPHEIGHT << 16) + (c & 0xffff) : 0;
 	memset( trash, 0, BRICKCOUNT * 4 );
-	for (uint i = 0; i < BRICKCOUNT; i++) trash[(i * 31 /* prevent false sharing*/) & (BRICKCOUNT - 1)] = i;
+	for (uint i = 0; i < BRICKCOUNT; i++) trash[(i * TRASHSTRIDE /* prevent false sharing*/) & (BRICKCOUNT - 1)] = i;
 	trashHead = BRICKCOUNT, trashTail = 0;
+	trashEpoch++, peakBricks = 0; // bricks cached in magazines are back in the ring
 	ClearMarks();
+	if (brickRefs) memset( brickRefs, 0, BRICKCOUNT * 4 );
+	if (packHandle) memset( packHandle, 0, BRICKCOUNT * 4 );
+	packStore.clear(), packFree[0].clear(), packFree[1].clear(), packFree[2].clear(), packedBricks = 0;
+	brickHashes.clear();
+	updating = false; // all bricks were recycled; nothing left to compare against
+	gridDirty = true; // cells change without dirty bricks; Commit must upload the grid
 }
 
 // World::ScrollX
@@ -286,8 +1256,8 @@ void World::ScrollX( const int offset )
 	const int o = abs( offset / BRICKDIM );
 	for (uint z = 0; z < GRIDDEPTH; z++) for (uint y = 0; y < GRIDHEIGHT; y++)
 	{
-		uint* line = grid + z * GRIDWIDTH + y * GRIDWIDTH * GRIDDEPTH;
-		uint backup[GRIDWIDTH];
+		uint line[GRIDWIDTH], backup[GRIDWIDTH];
+		for (uint x = 0; x < GRIDWIDTH; x++) line[x] = grid[CellIndex( x, y, z )];
 		if (offset < 0)
 		{
 			for (int x = 0; x < o; x++) backup[x] = line[x];
@@ -300,7 +1270,10 @@ void World::ScrollX( const int offset )
 			for (int x = GRIDWIDTH - 1; x >= o; x--) line[x] = line[x - o];
 			for (int x = 0; x < o; x++) line[x] = backup[x];
 		}
+		for (uint x = 0; x < GRIDWIDTH; x++) grid[CellIndex( x, y, z )] = line[x];
 	}
+	RebuildOccupancy();
+	if (surface) RebuildSurface();
 }
 
 // World::ScrollX
@@ -387,9 +1360,13 @@ void World::LoadSky( const char* filename, const float scale )
 		pixel4[x + y * skySize.x] = scale * make_float4( p3, 1 );
 	}
 	delete pixels;
-	// make the final buffer
-	sky = new Buffer( skySize.x * skySize.y * 4, Buffer::READONLY, pixel4 );
-	sky->CopyToDevice();
+	// make the final buffer; the host copy serves SampleSky and headless rendering
+	skyPixels = pixel4;
+	if (!headless)
+	{
+		sky = new Buffer( skySize.x * skySize.y * 4, Buffer::READONLY, pixel4 );
+		sky->CopyToDevice();
+	}
 	// update the sky lights
 	UpdateSkylights();
 }
@@ -409,10 +1386,8 @@ float3 World::SampleSky( const float3& D )
 	const uint idx3 = (iu + (iv + 1) * iw) % (iw * ih);
 	const uint idx4 = (iu + 1 + (iv + 1) * iw) % (iw * ih);
 	const float4 s =
-		((float4*)sky->hostBuffer)[idx1] * (1 - fu) * (1 - fv) +
-		((float4*)sky->hostBuffer)[idx2] * fu * (1 - fv) +
-		((float4*)sky->hostBuffer)[idx3] * (1 - fu) * fv +
-		((float4*)sky->hostBuffer)[idx4] * fu * fv;
+		skyPixels[idx1] * (1 - fu) * (1 - fv) + skyPixels[idx2] * fu * (1 - fv) +
+		skyPixels[idx3] * (1 - fu) * fv + skyPixels[idx4] * fu * fv;
 	return make_float3( s );
 }
 
@@ -508,29 +1483,45 @@ uint SpriteManager::LoadSprite( const char* voxFile, bool largeModel )
 {
 	if (strstr( voxFile, ".vx" ))
 	{
-		// load it from our custom file format
+		// load it from our custom file format; region exports are inflated in parallel
+		vector<uchar> raw;
+		{
+			MappedFile file( voxFile );
+			if (!file.IsValid()) FatalError( "File not found: %s", voxFile );
+			if (!InflateMembers( file.GetData(), file.GetSize(), raw ))
+			{
+				raw.clear();
+				gzFile f = gzopen( voxFile, "rb" );
+				uchar chunk[65536];
+				for (int n; (n = gzread( f, chunk, sizeof( chunk ) )) > 0;) raw.insert( raw.end(), chunk, chunk + n );
+				gzclose( f );
+			}
+		}
+		size_t offset = 0;
+		auto read = [&]( void* dst, const size_t bytes ) {
+			if (raw.size() - offset < bytes) FatalError( "Truncated sprite file: %s", voxFile );
+			memcpy( dst, raw.data() + offset, bytes ), offset += bytes;
+		};
 		Sprite* newSprite = new Sprite();
-		gzFile f = gzopen( voxFile, "rb" );
 		int frames, pls;
-		gzread( f, &pls, 4 );
-		gzread( f, &frames, 4 );
+		read( &pls, 4 );
+		read( &frames, 4 );
 		if (pls != PAYLOADSIZE) FatalError( "File was saved with a different voxel size." );
 		int3 maxSize = make_int3( 0 );
 		for (int i = 0; i < frames; i++)
 		{
 			SpriteFrame* sf = new SpriteFrame();
 			newSprite->frame.push_back( sf );
-			gzread( f, &sf->size, 12 );
-			gzread( f, &sf->drawListSize, 4 );
+			read( &sf->size, 12 );
+			read( &sf->drawListSize, 4 );
 			sf->drawPos = new uint[sf->drawListSize];
 			sf->drawVal = new PAYLOAD[sf->drawListSize];
-			gzread( f, sf->drawPos, sf->drawListSize * sizeof( uint ) );
-			gzread( f, sf->drawVal, sf->drawListSize * PAYLOADSIZE );
+			read( sf->drawPos, sf->drawListSize * sizeof( uint ) );
+			read( sf->drawVal, sf->drawListSize * PAYLOADSIZE );
 			maxSize.x = max( maxSize.x, sf->size.x );
 			maxSize.y = max( maxSize.y, sf->size.y );
 			maxSize.z = max( maxSize.z, sf->size.z );
 		}
-		gzclose( f );
 		// create the backup frame for sprite movement
 		SpriteFrame* backupFrame = new SpriteFrame();
 		backupFrame->size = maxSize;
@@ -892,25 +1883,199 @@ void SpriteManager::SaveSprite( const uint idx, const char* vxFile )
 
 		save_vox_scene(vxFile, scene);
 	}
-	else
+	else
+	{
+		if (idx >= sprite.size()) return;
+		// save the sprite to custom file format
+		Sprite* s = sprite[idx];
+		gzFile f = gzopen(vxFile, "wb");
+		int frames = (int)s->frame.size(), pls = PAYLOADSIZE;
+		gzwrite(f, &pls, 4);
+		gzwrite(f, &frames, 4);
+		for (int i = 0; i < frames; i++)
+		{
+			SpriteFrame* sf = s->frame[i];
+			gzwrite(f, &sf->size, 12);
+			gzwrite(f, &sf->drawListSize, 4);
+			gzwrite(f, sf->drawPos, sf->drawListSize * sizeof(uint));
+			gzwrite(f, sf->drawVal, sf->drawListSize * PAYLOADSIZE);
+		}
+		gzclose(f);
+	}
+}
+
+// World::RegionJob::Main: draw list of a range of grid cells, clipped to the region
+// ----------------------------------------------------------------------------
+void World::RegionJob::Main()
+{
+	drawPos.clear();
+	drawVal.clear();
+	const int3 end = pos + size;
+	for (uint i = 0; i < cellCount; i++)
+	{
+		const uint c = cell[i], g = world->grid[c];
+		const int3 b = CellCoord( c ) * BRICKDIM;
+		const int3 lo = max( pos, b ), hi = min( end, b + make_int3( BRICKDIM ) );
+		// solid cells are emitted without touching the brick store
+		alignas(32) PAYLOAD scratch[BRICKSIZE];
+		const PAYLOAD* voxels = (g & 1) ? world->BrickVoxels( g >> 1, scratch ) : 0;
+		for (int z = lo.z; z < hi.z; z++) for (int y = lo.y; y < hi.y; y++) for (int x = lo.x; x < hi.x; x++)
+		{
+			const PAYLOAD v = voxels ? voxels[VoxelIndex( x & BMSK, y & BMSK, z & BMSK )] : (PAYLOAD)(g >> 1);
+			if (!v) continue;
+			drawPos.push_back( (x - pos.x) + ((y - pos.y) << 10) + ((z - pos.z) << 20) );
+			drawVal.push_back( v );
+		}
+	}
+	if (pack)
+	{
+		DeflateMember( drawPos.data(), (uint)(drawPos.size() * sizeof( uint )), member[0] );
+		DeflateMember( drawVal.data(), (uint)(drawVal.size() * PAYLOADSIZE), member[1] );
+		count = (uint)drawPos.size();
+		vector<uint>().swap( drawPos );
+		vector<PAYLOAD>().swap( drawVal );
+	}
+	else count = (uint)drawPos.size();
+}
+
+// World::ExportRegion: write a box of the world as a single-frame .vx sprite, or as a
+// .vox scene (one model per 256^3 block). Ranges of grid cells are extracted and
+// compressed on all cores; empty cells are skipped.
+// ----------------------------------------------------------------------------
+bool World::ExportRegion( const char* file, const int3 pos, const int3 size )
+{
+	const int3 lo = max( pos, make_int3( 0 ) ), hi = min( pos + size, make_int3( MAPWIDTH, MAPHEIGHT, MAPDEPTH ) );
+	if (hi.x <= lo.x || hi.y <= lo.y || hi.z <= lo.z) return false;
+	// collect the non-empty cells overlapping the region
+	vector<uint> cells;
+	for (int by = lo.y / BRICKDIM; by <= (hi.y - 1) / BRICKDIM; by++)
+		for (int bz = lo.z / BRICKDIM; bz <= (hi.z - 1) / BRICKDIM; bz++)
+			for (int bx = lo.x / BRICKDIM; bx <= (hi.x - 1) / BRICKDIM; bx++)
+			{
+				const uint c = CellIndex( bx, by, bz );
+				if (grid[c]) cells.push_back( c );
+			}
+	// extract (and for .vx, compress) the ranges in parallel
+	const bool vox = strstr( file, ".vox" ) != 0;
+	vector<RegionJob> job( (cells.size() + REGIONCELLS - 1) / REGIONCELLS );
+	JobManager* jm = JobManager::GetJobManager();
+	for (size_t first = 0; first < job.size(); first += 256)
+	{
+		const size_t last = min( job.size(), first + 256 );
+		for (size_t i = first; i < last; i++)
+		{
+			RegionJob& j = job[i];
+			j.world = this, j.pos = lo, j.size = hi - lo, j.pack = !vox;
+			j.cell = cells.data() + i * REGIONCELLS;
+			j.cellCount = (uint)min( (size_t)REGIONCELLS, cells.size() - i * REGIONCELLS );
+			jm->AddJob2( &j );
+		}
+		jm->RunJobs();
+	}
+	uint count = 0;
+	for (const RegionJob& j : job) count += j.count;
+	if (!vox)
+	{
+		// sprite layout: payload size, frame count, frame size, draw list size, all
+		// positions, all values; a member per range for each of the two arrays
+		const int header[6] = { PAYLOADSIZE, 1, hi.x - lo.x, hi.y - lo.y, hi.z - lo.z, (int)count };
+		vector<uchar> member;
+		DeflateMember( header, sizeof( header ), member );
+		FILE* f = fopen( file, "wb" );
+		if (!f) return false;
+		bool ok = fwrite( member.data(), 1, member.size(), f ) == member.size();
+		for (int a = 0; a < 2; a++) for (const RegionJob& j : job)
+			ok &= fwrite( j.member[a].data(), 1, j.member[a].size(), f ) == j.member[a].size();
+		return (fclose( f ) == 0) && ok;
+	}
+	// palette: the 255 most used colors, others map to the nearest of those. Channel
+	// order mirrors the .vox path of SpriteManager::LoadSprite.
+	const uint colorCount = 1 << (PAYLOADSIZE * 8);
+	auto rgb = []( const uint p ) {
+	#if PAYLOADSIZE == 1
+		return make_int3( (p & 3) * 64, ((p >> 2) & 7) * 32, ((p >> 5) & 7) * 32 );
+	#else
+		return make_int3( (p & 15) * 17, ((p >> 4) & 15) * 17, ((p >> 8) & 15) * 17 );
+	#endif
+	};
+	vector<uint> histogram( colorCount, 0 ), used;
+	for (const RegionJob& j : job) for (const PAYLOAD v : j.drawVal) histogram[v]++;
+	for (uint v = 1; v < colorCount; v++) if (histogram[v]) used.push_back( v );
+	sort( used.begin(), used.end(), [&]( uint a, uint b ) { return histogram[a] > histogram[b]; } );
+	ogt_vox_palette palette = {};
+	vector<uint8_t> index( colorCount, 0 );
+	const uint paletteSize = min( (uint)used.size(), 255u );
+	for (uint i = 0; i < paletteSize; i++)
+	{
+		const int3 c = rgb( used[i] );
+		palette.color[i + 1] = { (uint8_t)c.x, (uint8_t)c.y, (uint8_t)c.z, 255 };
+		index[used[i]] = (uint8_t)(i + 1);
+	}
+	for (size_t i = paletteSize; i < used.size(); i++)
 	{
-		if (idx >= sprite.size()) return;
-		// save the sprite to custom file format
-		Sprite* s = sprite[idx];
-		gzFile f = gzopen(vxFile, "wb");
-		int frames = (int)s->frame.size(), pls = PAYLOADSIZE;
-		gzwrite(f, &pls, 4);
-		gzwrite(f, &frames, 4);
-		for (int i = 0; i < frames; i++)
+		const int3 c = rgb( used[i] );
+		int best = INT_MAX;
+		for (uint k = 0; k < paletteSize; k++)
 		{
-			SpriteFrame* sf = s->frame[i];
-			gzwrite(f, &sf->size, 12);
-			gzwrite(f, &sf->drawListSize, 4);
-			gzwrite(f, sf->drawPos, sf->drawListSize * sizeof(uint));
-			gzwrite(f, sf->drawVal, sf->drawListSize * PAYLOADSIZE);
+			const int3 d = c - rgb( used[k] );
+			const int dist = dot( d, d );
+			if (dist < best) best = dist, index[used[i]] = (uint8_t)(k + 1);
 		}
-		gzclose(f);
 	}
+	// models of at most 256^3; magicavoxel is z-up, so the world y axis becomes z
+	const int3 extent = make_int3( hi.x - lo.x, hi.z - lo.z, hi.y - lo.y );
+	const int3 blocks = make_int3( (extent.x + 255) >> 8, (extent.y + 255) >> 8, (extent.z + 255) >> 8 );
+	auto blockSize = [&]( const int3 b ) { return min( make_int3( 256 ), extent - b * 256 ); };
+	vector<vector<uint8_t>> voxels( blocks.x * blocks.y * blocks.z );
+	for (const RegionJob& j : job) for (size_t i = 0; i < j.drawPos.size(); i++)
+	{
+		const uint p = j.drawPos[i];
+		const int3 v = make_int3( p & 1023, p >> 20, (p >> 10) & 1023 ), b = make_int3( v.x >> 8, v.y >> 8, v.z >> 8 );
+		const int3 s = blockSize( b );
+		vector<uint8_t>& block = voxels[b.x + b.y * blocks.x + b.z * blocks.x * blocks.y];
+		if (block.empty()) block.resize( s.x * s.y * s.z, 0 );
+		block[(v.x & 255) + (v.y & 255) * s.x + (v.z & 255) * s.x * s.y] = index[j.drawVal[i]];
+	}
+	vector<ogt_vox_model> models;
+	vector<const ogt_vox_model*> modelList;
+	vector<ogt_vox_instance> instances;
+	models.reserve( voxels.size() );
+	for (int i = 0, z = 0; z < blocks.z; z++) for (int y = 0; y < blocks.y; y++) for (int x = 0; x < blocks.x; x++, i++)
+	{
+		if (voxels[i].empty()) continue;
+		const int3 b = make_int3( x, y, z ), s = blockSize( b ), origin = b * 256;
+		ogt_vox_model model = {};
+		model.size_x = s.x, model.size_y = s.y, model.size_z = s.z;
+		model.voxel_data = voxels[i].data();
+		models.push_back( model );
+		modelList.push_back( &models.back() );
+		// instance translations refer to the model pivot, floor( size / 2 )
+		ogt_vox_instance instance = {};
+		instance.transform = ogt_vox_transform_get_identity();
+		instance.transform.m30 = (float)(origin.x + s.x / 2);
+		instance.transform.m31 = (float)(origin.y + s.y / 2);
+		instance.transform.m32 = (float)(origin.z + s.z / 2);
+		instance.model_index = (uint32_t)models.size() - 1;
+		instances.push_back( instance );
+	}
+	ogt_vox_layer layer = {};
+	ogt_vox_group group = {};
+	group.transform = ogt_vox_transform_get_identity();
+	group.parent_group_index = k_invalid_group_index;
+	ogt_vox_scene scene = {};
+	scene.num_models = (uint32_t)models.size(), scene.models = modelList.data();
+	scene.num_instances = (uint32_t)instances.size(), scene.instances = instances.data();
+	scene.num_layers = 1, scene.layers = &layer;
+	scene.num_groups = 1, scene.groups = &group;
+	scene.palette = palette;
+	uint32_t bytes = 0;
+	uint8_t* buffer = ogt_vox_write_scene( &scene, &bytes );
+	if (!buffer) return false;
+	FILE* f = fopen( file, "wb" );
+	bool ok = f && fwrite( buffer, 1, bytes, f ) == bytes;
+	if (f) ok &= fclose( f ) == 0;
+	ogt_vox_free( buffer );
+	return ok;
 }
 
 // SpriteManager::CloneSprite
@@ -1250,18 +2415,25 @@ void World::DrawTile( const uint idx, const uint x, const uint y, const uint z )
 {
 	auto& tile = GetTileList();
 	if (x >= GRIDWIDTH || y >= GRIDHEIGHT || z > GRIDDEPTH) return;
-	const uint cellIdx = x + z * GRIDWIDTH + y * GRIDWIDTH * GRIDDEPTH;
-	DrawTileVoxels( cellIdx, tile[idx]->voxels, tile[idx]->zeroes );
+	DrawTileVoxels( CellIndex( x, y, z ), tile[idx]->voxels, tile[idx]->zeroes );
 }
 void World::DrawTileVoxels( const uint cellIdx, const PAYLOAD* voxels, const uint zeroes )
 {
 	const uint g = grid[cellIdx];
 	uint brickIdx;
-	if ((g & 1) == 1) brickIdx = g >> 1; else brickIdx = NewBrick(), grid[cellIdx] = (brickIdx << 1) | 1;
+	if ((g & 1) == 1 && packHandle && packHandle[g >> 1]) UnpackBrick( g >> 1 ); // gets a slot to write to
+	if ((g & 1) == 1 && !(brickRefs && brickRefs[g >> 1])) brickIdx = g >> 1; else
+	{
+		// solid cell, or a brick shared with other cells: the tile goes into a new brick
+		if (g & 1) ReleaseBrick( g >> 1 );
+		if (!g) { const int3 b = CellCoord( cellIdx ); SetOccupied( b.x, b.y, b.z ); }
+		brickIdx = NewBrick(), grid[cellIdx] = (brickIdx << 1) | 1;
+	}
 	// copy tile data to brick
 	memcpy( brick + brickIdx * BRICKSIZE, voxels, BRICKSIZE * PAYLOADSIZE );
 	Mark( brickIdx );
 	brickInfo[brickIdx].zeroes = zeroes;
+	if (surface) UpdateSurfaceCell( cellIdx );
 }
 
 // World::DrawTiles
@@ -1289,15 +2461,9 @@ void World::DrawBigTile( const uint idx, const uint x, const uint y, const uint
 {
 	auto& bigTile = GetBigTileList();
 	if (x >= GRIDWIDTH / 2 || y >= GRIDHEIGHT / 2 || z > GRIDDEPTH / 2) return;
-	const uint cellIdx = x * 2 + z * 2 * GRIDWIDTH + y * 2 * GRIDWIDTH * GRIDDEPTH;
-	DrawTileVoxels( cellIdx, bigTile[idx]->tile[0].voxels, bigTile[idx]->tile[0].zeroes );
-	DrawTileVoxels( cellIdx + 1, bigTile[idx]->tile[1].voxels, bigTile[idx]->tile[1].zeroes );
-	DrawTileVoxels( cellIdx + GRIDWIDTH * GRIDDEPTH, bigTile[idx]->tile[2].voxels, bigTile[idx]->tile[2].zeroes );
-	DrawTileVoxels( cellIdx + GRIDWIDTH * GRIDDEPTH + 1, bigTile[idx]->tile[3].voxels, bigTile[idx]->tile[3].zeroes );
-	DrawTileVoxels( cellIdx + GRIDWIDTH, bigTile[idx]->tile[4].voxels, bigTile[idx]->tile[4].zeroes );
-	DrawTileVoxels( cellIdx + GRIDWIDTH + 1, bigTile[idx]->tile[5].voxels, bigTile[idx]->tile[5].zeroes );
-	DrawTileVoxels( cellIdx + GRIDWIDTH + GRIDWIDTH * GRIDDEPTH, bigTile[idx]->tile[6].voxels, bigTile[idx]->tile[6].zeroes );
-	DrawTileVoxels( cellIdx + GRIDWIDTH + GRIDWIDTH * GRIDDEPTH + 1, bigTile[idx]->tile[7].voxels, bigTile[idx]->tile[7].zeroes );
+	// sub tile i covers cell (x * 2 + (i & 1), y * 2 + ((i >> 1) & 1), z * 2 + (i >> 2))
+	for (uint i = 0; i < 8; i++)
+		DrawTileVoxels( CellIndex( x * 2 + (i & 1), y * 2 + ((i >> 1) & 1), z * 2 + (i >> 2) ), bigTile[idx]->tile[i].voxels, bigTile[idx]->tile[i].zeroes );
 }
 
 // World::DrawBigTiles
@@ -1337,57 +2503,82 @@ uint World::TraceRay( float4 A, const float4 B, float& dist, float3& N, int step
 		if (tmax < tmin || tmax <= 0) return 0; /* ray misses scene */ else A += tmin * V; // new ray entry point
 		to = tmin;
 	}
-	uint tp = (clamp( (uint)A.x >> 3, 0u, 127u ) << 20) + (clamp( (uint)A.y >> 3, 0u, 127u ) << 10) +
-		clamp( (uint)A.z >> 3, 0u, 127u );
 	const int bits = SELECT( 4, 34, V.x > 0 ) + SELECT( 3072, 10752, V.y > 0 ) + SELECT( 1310720, 3276800, V.z > 0 ); // magic
-	float4 tm = (make_float4( (float)(((tp >> 20) & 127) + ((bits >> 5) & 1)), (float)(((tp >> 10) & 127) + ((bits >> 13) & 1)),
-		(float)((tp & 127) + ((bits >> 21) & 1)), 0 ) - A * 0.125f) * rV;
-	float t = 0;
 	const float4 td = make_float4( (float)DIR_X, (float)DIR_Y, (float)DIR_Z, 0 ) * rV;
+	// traverse the uber grid first; empty 4x4x4 groups of cells are skipped in one step
+	uint up = (clamp( (uint)A.x >> 5, 0u, 31u ) << 20) + (clamp( (uint)A.y >> 5, 0u, 31u ) << 10) +
+		clamp( (uint)A.z >> 5, 0u, 31u );
+	float4 tm = (make_float4( (float)((up >> 20) + OFFS_X), (float)(((up >> 10) & 31) + OFFS_Y),
+		(float)((up & 31) + OFFS_Z), 0 ) - A * 0.03125f) * rV;
+	float t = 0;
 	uint last = 0;
 	do
 	{
-		// fetch brick from top grid
-		uint o = grid[(tp >> 20) + ((tp & 127) << 7) + (((tp >> 10) & 127) << 14)];
-		if (!--steps) break;
-		if (o != 0) if ((o & 1) == 0) /* solid */
+		const uint64_t mask = occupancy[(up >> 20) + (up & 31) * UBERWIDTH + ((up >> 10) & 31) * UBERWIDTH * UBERDEPTH];
+		if (!mask) { if ((steps -= 4) <= 0) break; } else
 		{
-			dist = (t + to) * 8.0f;
-			N = make_float3( (float)((last == 0) * DIR_X), (float)((last == 1) * DIR_Y), (float)((last == 2) * DIR_Z) ) * -1.0f;
-			return o >> 1;
-		}
-		else // brick
-		{
-			// backup top-grid traversal state
-			const float4 tm_ = tm;
-			// intialize brick traversal
-			tm = A + V * (t *= 8); // abusing tm for I to save registers
-			uint p = (clamp( (uint)tm.x, tp >> 17, (tp >> 17) + 7 ) << 20) +
-				(clamp( (uint)tm.y, (tp >> 7) & 1023, ((tp >> 7) & 1023) + 7 ) << 10) +
-				clamp( (uint)tm.z, (tp << 3) & 1023, ((tp << 3) & 1023) + 7 ), lp = ~1;
-			tm = (make_float4( (float)((p >> 20) + OFFS_X), (float)(((p >> 10) & 1023) + OFFS_Y), (float)((p & 1023) + OFFS_Z), 0 ) - A) * rV;
-			p &= 7 + (7 << 10) + (7 << 20), o = (o >> 1) * BRICKSIZE;
-			do // traverse brick
+			// backup uber grid traversal state
+			const float4 tu = tm;
+			// initialize top-grid traversal
+			tm = A * 0.125f + V * (t *= 4); // abusing tm for I to save registers
+			uint tp = (clamp( (uint)tm.x, up >> 18, (up >> 18) + 3 ) << 20) +
+				(clamp( (uint)tm.y, (up >> 8) & 1023, ((up >> 8) & 1023) + 3 ) << 10) +
+				clamp( (uint)tm.z, (up << 2) & 1023, ((up << 2) & 1023) + 3 );
+			const uint tq = tp & UBERMASK3;
+			tm = (make_float4( (float)((tp >> 20) + OFFS_X), (float)(((tp >> 10) & 127) + OFFS_Y),
+				(float)((tp & 127) + OFFS_Z), 0 ) - A * 0.125f) * rV;
+			do
 			{
-				const uint v = brick[o + (p >> 20) + ((p >> 7) & (BMSK * BRICKDIM)) + (p & BMSK) * BDIM2];
-				if (v)
+				if (!--steps) return 0U;
+				// fetch brick from top grid, unless the mask says the cell is empty
+				uint o = (mask >> UberBit( tp >> 20, (tp >> 10) & 3, tp & 3 )) & 1 ? grid[CellIndex( tp >> 20, (tp >> 10) & 127, tp & 127 )] : 0;
+				if (o != 0) if ((o & 1) == 0) /* solid */
 				{
-					dist = t + to;
+					dist = (t + to) * 8.0f;
 					N = make_float3( (float)((last == 0) * DIR_X), (float)((last == 1) * DIR_Y), (float)((last == 2) * DIR_Z) ) * -1.0f;
-					return v;
+					return o >> 1;
+				}
+				else // brick
+				{
+					// backup top-grid traversal state
+					const float4 tm_ = tm;
+					// intialize brick traversal
+					tm = A + V * (t *= 8); // abusing tm for I to save registers
+					uint p = (clamp( (uint)tm.x, tp >> 17, (tp >> 17) + 7 ) << 20) +
+						(clamp( (uint)tm.y, (tp >> 7) & 1023, ((tp >> 7) & 1023) + 7 ) << 10) +
+						clamp( (uint)tm.z, (tp << 3) & 1023, ((tp << 3) & 1023) + 7 ), lp = ~1;
+					tm = (make_float4( (float)((p >> 20) + OFFS_X), (float)(((p >> 10) & 1023) + OFFS_Y), (float)((p & 1023) + OFFS_Z), 0 ) - A) * rV;
+					const uint pack = packHandle ? packHandle[o >> 1] : 0; // palette-packed brick, or 0
+					p &= 7 + (7 << 10) + (7 << 20), o = (o >> 1) * BRICKSIZE;
+					do // traverse brick
+					{
+						const uint voxel = VoxelIndex( p >> 20, (p >> 10) & BMSK, p & BMSK );
+						const uint v = pack ? PackedVoxel( pack, voxel ) : brick[o + voxel];
+						if (v)
+						{
+							dist = t + to;
+							N = make_float3( (float)((last == 0) * DIR_X), (float)((last == 1) * DIR_Y), (float)((last == 2) * DIR_Z) ) * -1.0f;
+							return v;
+						}
+						t = min( tm.x, min( tm.y, tm.z ) );
+						if (t == tm.x) tm.x += td.x, p += DIR_X << 20, last = 0;
+						else if (t == tm.y) tm.y += td.y, p += ((bits << 2) & 3072) - 1024, last = 1;
+						else if (t == tm.z) tm.z += td.z, p += DIR_Z, last = 2;
+					} while (!(p & TOPMASK3));
+					tm = tm_; // restore top-grid traversal state
 				}
 				t = min( tm.x, min( tm.y, tm.z ) );
-				if (t == tm.x) tm.x += td.x, p += DIR_X << 20, last = 0;
-				else if (t == tm.y) tm.y += td.y, p += ((bits << 2) & 3072) - 1024, last = 1;
-				else if (t == tm.z) tm.z += td.z, p += DIR_Z, last = 2;
-			} while (!(p & TOPMASK3));
-			tm = tm_; // restore top-grid traversal state
+				if (t == tm.x) tm.x += td.x, tp += DIR_X << 20, last = 0;
+				else if (t == tm.y) tm.y += td.y, tp += DIR_Y << 10, last = 1;
+				else if (t == tm.z) tm.z += td.z, tp += DIR_Z, last = 2;
+			} while ((tp & UBERMASK3) == tq);
+			tm = tu; // restore uber grid traversal state
 		}
 		t = min( tm.x, min( tm.y, tm.z ) );
-		if (t == tm.x) tm.x += td.x, tp += DIR_X << 20, last = 0;
-		else if (t == tm.y) tm.y += td.y, tp += DIR_Y << 10, last = 1;
-		else if (t == tm.z) tm.z += td.z, tp += DIR_Z, last = 2;
-	} while (!(tp & 0xf80e0380));
+		if (t == tm.x) tm.x += td.x, up += DIR_X << 20, last = 0;
+		else if (t == tm.y) tm.y += td.y, up += DIR_Y << 10, last = 1;
+		else if (t == tm.z) tm.z += td.z, up += DIR_Z, last = 2;
+	} while (!(up & 0xfe0f83e0));
 	return 0U;
 }
 void World::TraceRayToVoid( float4 A, const float4 B, float& dist, float3& N )
@@ -1409,8 +2600,8 @@ void World::TraceRayToVoid( float4 A, const float4 B, float& dist, float3& N )
 	uint last = 0;
 	do
 	{
-		// fetch brick from top grid
-		uint o = grid[(tp >> 20) + ((tp & 127) << 7) + (((tp >> 10) & 127) << 14)];
+		// fetch brick from top grid; the uber grid answers for empty cells
+		uint o = Occupied( tp >> 20, (tp >> 10) & 127, tp & 127 ) ? grid[CellIndex( tp >> 20, (tp >> 10) & 127, tp & 127 )] : 0;
 		if (o == 0) /* empty brick: done */
 		{
 			dist = t * 8.0f;
@@ -1427,10 +2618,12 @@ void World::TraceRayToVoid( float4 A, const float4 B, float& dist, float3& N )
 				(clamp( (uint)tm.y, (tp >> 7) & 1023, ((tp >> 7) & 1023) + 7 ) << 10) +
 				clamp( (uint)tm.z, (tp << 3) & 1023, ((tp << 3) & 1023) + 7 ), lp = ~1;
 			tm = (make_float4( (float)((p >> 20) + OFFS_X), (float)(((p >> 10) & 1023) + OFFS_Y), (float)((p & 1023) + OFFS_Z), 0 ) - A) * rV;
+			const uint pack = packHandle ? packHandle[o >> 1] : 0; // palette-packed brick, or 0
 			p &= 7 + (7 << 10) + (7 << 20), o = (o >> 1) * BRICKSIZE;
 			do // traverse brick
 			{
-				if (!brick[o + (p >> 20) + ((p >> 7) & (BMSK * BRICKDIM)) + (p & BMSK) * BDIM2])
+				const uint voxel = VoxelIndex( p >> 20, (p >> 10) & BMSK, p & BMSK );
+				if (!(pack ? PackedVoxel( pack, voxel ) : brick[o + voxel]))
 				{
 					dist = t;
 					N = make_float3( (float)((last == 0) * DIR_X), (float)((last == 1) * DIR_Y), (float)((last == 2) * DIR_Z) ) * -1.0f;
@@ -1452,15 +2645,20 @@ void World::TraceRayToVoid( float4 A, const float4 B, float& dist, float3& N )
 
 static Buffer* rayBatchBuffer = 0;
 static Buffer* rayBatchResult = 0;
+static Ray* rayBatchHost = 0;			// host side of the batch buffers; all there is without a device
+static Intersection* rayBatchHits = 0;
 
 Ray* World::GetBatchBuffer()
 {
-	if (!rayBatchBuffer)
+	if (!rayBatchHost)
+	{
+		rayBatchHost = (Ray*)new uint[SCRWIDTH * SCRHEIGHT * sizeof( Ray ) / 4];
+		rayBatchHits = (Intersection*)new uint[SCRWIDTH * SCRHEIGHT * sizeof( Intersection ) / 4];
+	}
+	if (!headless && !rayBatchBuffer)
 	{
-		uint* hostBuffer = new uint[SCRWIDTH * SCRHEIGHT * sizeof( Ray ) / 4];
-		rayBatchBuffer = new Buffer( SCRWIDTH * SCRHEIGHT * sizeof( Ray ) / 4, Buffer::DEFAULT, hostBuffer );
-		uint* hostResults = new uint[SCRWIDTH * SCRHEIGHT * sizeof( Intersection ) / 4];
-		rayBatchResult = new Buffer( SCRWIDTH * SCRHEIGHT * sizeof( Intersection ) / 4, Buffer::DEFAULT, hostResults );
+		rayBatchBuffer = new Buffer( SCRWIDTH * SCRHEIGHT * sizeof( Ray ) / 4, Buffer::DEFAULT, rayBatchHost );
+		rayBatchResult = new Buffer( SCRWIDTH * SCRHEIGHT * sizeof( Intersection ) / 4, Buffer::DEFAULT, rayBatchHits );
 		// now that we have the buffers, we can pass them to the kernel (just once)
 		batchTracer->SetArgument( 6, rayBatchBuffer );
 		batchTracer->SetArgument( 7, rayBatchResult );
@@ -1469,45 +2667,421 @@ Ray* World::GetBatchBuffer()
 		batchToVoidTracer->SetArgument( 7, rayBatchResult );
 		batchToVoidTracer->SetArgument( 8, &uberGrid );
 	}
-	return (Ray*)rayBatchBuffer->hostBuffer;
+	return rayBatchHost;
+}
+
+// World::BatchOnDevice: backend selection for TraceBatch and TraceBatchToVoid. With
+// BATCH_AUTO, small batches are cheaper on the CPU than a PCIe round trip; headless
+// worlds have no device, so they always trace on the CPU.
+// ----------------------------------------------------------------------------
+#define CPUBATCHSIZE	4096	// BATCH_AUTO traces batches up to this size on the CPU
+bool World::BatchOnDevice( const uint batchSize, const uint backend ) const
+{
+	if (headless || backend == BATCH_CPU) return false;
+	return backend == BATCH_DEVICE || batchSize > CPUBATCHSIZE;
 }
 
-Intersection* World::TraceBatch( const uint batchSize )
+Intersection* World::TraceBatch( const uint batchSize, const uint backend )
 {
 	// sanity checks
-	if (!rayBatchBuffer) FatalError( "TraceBatch: Batch not yet created." );
+	if (!rayBatchHost) FatalError( "TraceBatch: Batch not yet created." );
 	if (batchSize > SCRWIDTH * SCRHEIGHT) FatalError( "TraceBatch: batch is too large." );
 	if (batchSize > 0)
 	{
-		// copy the ray batch to the GPU
-		rayBatchBuffer->CopyToDevice();
-		// invoke ray tracing kernel
-		batchTracer->SetArgument( 5, (int)batchSize );
-		batchTracer->Run( batchSize );
-		// get results back from GPU
-		rayBatchResult->CopyFromDevice( true /* blocking */ );
+		if (!BatchOnDevice( batchSize, backend )) TraceBatchCPU( rayBatchHost, rayBatchHits, batchSize );
+		else
+		{
+			// copy the ray batch to the GPU
+			rayBatchBuffer->CopyToDevice();
+			// invoke ray tracing kernel
+			batchTracer->SetArgument( 5, (int)batchSize );
+			batchTracer->Run( batchSize );
+			// get results back from GPU
+			rayBatchResult->CopyFromDevice( true /* blocking */ );
+		}
 	}
 	// return host buffer with ray tracing results
-	return (Intersection*)rayBatchResult->hostBuffer;
+	return rayBatchHits;
 }
 
-Intersection* World::TraceBatchToVoid( const uint batchSize )
+Intersection* World::TraceBatchToVoid( const uint batchSize, const uint backend )
 {
 	// sanity checks
-	if (!rayBatchBuffer) FatalError( "TraceBatchToVoid: Batch not yet created." );
+	if (!rayBatchHost) FatalError( "TraceBatchToVoid: Batch not yet created." );
 	if (batchSize > SCRWIDTH * SCRHEIGHT) FatalError( "TraceBatchToVoid: batch is too large." );
 	if (batchSize > 0)
 	{
-		// copy the ray batch to the GPU
-		rayBatchBuffer->CopyToDevice();
-		// invoke ray tracing kernel
-		batchToVoidTracer->SetArgument( 5, (int)batchSize );
-		batchToVoidTracer->Run( batchSize );
-		// get results back from GPU
-		rayBatchResult->CopyFromDevice( true /* blocking */ );
+		if (!BatchOnDevice( batchSize, backend )) TraceBatchToVoidCPU( rayBatchHost, rayBatchHits, batchSize );
+		else
+		{
+			// copy the ray batch to the GPU
+			rayBatchBuffer->CopyToDevice();
+			// invoke ray tracing kernel
+			batchToVoidTracer->SetArgument( 5, (int)batchSize );
+			batchToVoidTracer->Run( batchSize );
+			// get results back from GPU
+			rayBatchResult->CopyFromDevice( true /* blocking */ );
+		}
 	}
 	// return host buffer with ray tracing results
-	return (Intersection*)rayBatchResult->hostBuffer;
+	return rayBatchHits;
+}
+
+// helpers for the packet tracer: SIMD counterparts of CellIndex and VoxelIndex
+#if MORTONHOST == 1
+static __forceinline __m256i Spread3( __m256i v ) // bit i moves to bit 3 * i; up to 10 bits
+{
+	v = _mm256_and_si256( _mm256_or_si256( v, _mm256_slli_epi32( v, 8 ) ), _mm256_set1_epi32( 0x300f00f ) );
+	v = _mm256_and_si256( _mm256_or_si256( v, _mm256_slli_epi32( v, 4 ) ), _mm256_set1_epi32( 0x30c30c3 ) );
+	return _mm256_and_si256( _mm256_or_si256( v, _mm256_slli_epi32( v, 2 ) ), _mm256_set1_epi32( 0x9249249 ) );
+}
+static __forceinline __m256i CellIndex8( const __m256i bx, const __m256i by, const __m256i bz )
+{
+	return _mm256_or_si256( Spread3( bx ), _mm256_or_si256( _mm256_slli_epi32( Spread3( bz ), 1 ), _mm256_slli_epi32( Spread3( by ), 2 ) ) );
+}
+static __forceinline __m256i VoxelIndex8( const __m256i lx, const __m256i ly, const __m256i lz )
+{
+	return _mm256_or_si256( Spread3( lx ), _mm256_or_si256( _mm256_slli_epi32( Spread3( ly ), 1 ), _mm256_slli_epi32( Spread3( lz ), 2 ) ) );
+}
+#else
+static __forceinline __m256i CellIndex8( const __m256i bx, const __m256i by, const __m256i bz )
+{
+	return _mm256_add_epi32( bx, _mm256_add_epi32( _mm256_mullo_epi32( bz, _mm256_set1_epi32( GRIDWIDTH ) ),
+		_mm256_mullo_epi32( by, _mm256_set1_epi32( GRIDWIDTH * GRIDDEPTH ) ) ) );
+}
+static __forceinline __m256i VoxelIndex8( const __m256i lx, const __m256i ly, const __m256i lz )
+{
+	return _mm256_add_epi32( lx, _mm256_add_epi32( _mm256_slli_epi32( ly, 3 ), _mm256_slli_epi32( lz, 6 ) ) );
+}
+#endif
+
+// World::TraceBatchCPU / TraceBatchToVoidCPU: CPU counterparts of TraceBatch and
+// TraceBatchToVoid, with the same result encoding; usable on headless worlds
+// ----------------------------------------------------------------------------
+#define PACKETJOBS	64
+void World::TraceBatchCPU( const Ray* rays, Intersection* hits, const uint count )
+{
+	PROFILE_SCOPE( "Trace batch (CPU)" );
+	TracePackets( rays, hits, count, false );
+}
+void World::TraceBatchToVoidCPU( const Ray* rays, Intersection* hits, const uint count )
+{
+	PROFILE_SCOPE( "Trace batch to void (CPU)" );
+	TracePackets( rays, hits, count, true );
+}
+void World::TracePackets( const Ray* rays, Intersection* hits, const uint count, const bool toVoid )
+{
+	const uint packets = (count + 7) / 8;
+	if (packets < PACKETJOBS)
+	{
+		// small batch: not worth waking the workers
+		for (uint i = 0; i < packets; i++) TracePacket( rays + i * 8, hits + i * 8, min( 8u, count - i * 8 ), toVoid );
+		return;
+	}
+	static JobManager* jm = JobManager::GetJobManager();
+	static PacketJob pj[PACKETJOBS];
+	for (uint i = 0; i < PACKETJOBS; i++)
+	{
+		pj[i].world = this, pj[i].rays = rays, pj[i].hits = hits, pj[i].count = count, pj[i].toVoid = toVoid;
+		pj[i].first = (uint)(((uint64_t)packets * i) / PACKETJOBS), pj[i].last = (uint)(((uint64_t)packets * (i + 1)) / PACKETJOBS);
+		jm->AddJob2( &pj[i] );
+	}
+	jm->RunJobs();
+}
+void World::PacketJob::Main()
+{
+	for (uint i = first; i < last; i++) world->TracePacket( rays + i * 8, hits + i * 8, min( 8u, count - i * 8 ), toVoid );
+}
+
+// World::TracePacket: trace up to 8 rays, one AVX2 lane each. Every lane walks the
+// uber grid (4x4x4 cells), the top-level grid and the bricks like TraceRay does, but
+// all lanes advance together: per iteration, each lane either finishes, descends a
+// level or steps to the next cell of its level, and the three are applied with masks.
+// Lanes re-derive their exit distances from the cell they are in, so a lane needs
+// no per-level state besides its level and its voxel position.
+// ----------------------------------------------------------------------------
+void World::TracePacket( const Ray* rays, Intersection* hits, const uint lanes, const bool toVoid )
+{
+	// per-lane setup: clip the ray against the map, like TraceRay
+	alignas(32) float ax[8], ay[8], az[8], vx[8], vy[8], vz[8], to[8];
+	alignas(32) int alive[8];
+	for (uint i = 0; i < 8; i++)
+	{
+		ax[i] = ay[i] = az[i] = to[i] = 0, vx[i] = vy[i] = vz[i] = 1, alive[i] = 0;
+		if (i >= lanes) continue;
+		float4 A = make_float4( rays[i].O, 0 );
+		const float4 V = FixZeroDeltas( make_float4( rays[i].D, 0 ) );
+		hits[i].t = 1e34f, hits[i].N = 0;
+		if (A.x < 0 || A.y < 0 || A.z < 0 || A.x > MAPWIDTH || A.y > MAPHEIGHT || A.z > MAPDEPTH)
+		{
+			if (toVoid)
+			{
+				hits[i].t = 0 < rays[i].t ? 0 : 1e34f, hits[i].N = 1 + 4 + 16; // starts in empty space, as TraceRayToVoid
+				continue;
+			}
+			const float tx1 = -A.x / V.x, tx2 = (MAPWIDTH - A.x) / V.x;
+			float tmin = min( tx1, tx2 ), tmax = max( tx1, tx2 );
+			const float ty1 = -A.y / V.y, ty2 = (MAPHEIGHT - A.y) / V.y;
+			tmin = max( tmin, min( ty1, ty2 ) ), tmax = min( tmax, max( ty1, ty2 ) );
+			const float tz1 = -A.z / V.z, tz2 = (MAPDEPTH - A.z) / V.z;
+			tmin = max( tmin, min( tz1, tz2 ) ), tmax = min( tmax, max( tz1, tz2 ) );
+			if (tmax < tmin || tmax <= 0) continue; // ray misses scene
+			A += tmin * V, to[i] = tmin;
+		}
+		ax[i] = A.x, ay[i] = A.y, az[i] = A.z, vx[i] = V.x, vy[i] = V.y, vz[i] = V.z, alive[i] = -1;
+	}
+	__m256i active = _mm256_load_si256( (__m256i*)alive );
+	if (_mm256_testz_si256( active, active )) return;
+	const __m256 Ax = _mm256_load_ps( ax ), Ay = _mm256_load_ps( ay ), Az = _mm256_load_ps( az );
+	const __m256 Vx = _mm256_load_ps( vx ), Vy = _mm256_load_ps( vy ), Vz = _mm256_load_ps( vz ), one = _mm256_set1_ps( 1 );
+	const __m256 rVx = _mm256_div_ps( one, Vx ), rVy = _mm256_div_ps( one, Vy ), rVz = _mm256_div_ps( one, Vz );
+	const __m256i zero = _mm256_setzero_si256(), i1 = _mm256_set1_epi32( 1 ), i3 = _mm256_set1_epi32( 3 ), i5 = _mm256_set1_epi32( 5 );
+	const __m256i posX = _mm256_castps_si256( _mm256_cmp_ps( Vx, _mm256_setzero_ps(), _CMP_GT_OQ ) );
+	const __m256i posY = _mm256_castps_si256( _mm256_cmp_ps( Vy, _mm256_setzero_ps(), _CMP_GT_OQ ) );
+	const __m256i posZ = _mm256_castps_si256( _mm256_cmp_ps( Vz, _mm256_setzero_ps(), _CMP_GT_OQ ) );
+	const __m256i two = _mm256_set1_epi32( 2 ); // ray dir per axis, 1 or -1, and grid plane offset, 0 or 1
+	const __m256i dirX = _mm256_sub_epi32( _mm256_and_si256( posX, two ), i1 ), dirY = _mm256_sub_epi32( _mm256_and_si256( posY, two ), i1 );
+	const __m256i dirZ = _mm256_sub_epi32( _mm256_and_si256( posZ, two ), i1 );
+	const __m256i offX = _mm256_and_si256( posX, i1 ), offY = _mm256_and_si256( posY, i1 ), offZ = _mm256_and_si256( posZ, i1 );
+	const __m256i mapMax = _mm256_set1_epi32( MAPWIDTH - 1 );
+	// traversal state: voxel position, level (5: uber grid, 3: grid, 0: brick), last axis
+	__m256i px = _mm256_min_epi32( _mm256_max_epi32( _mm256_cvttps_epi32( Ax ), zero ), mapMax );
+	__m256i py = _mm256_min_epi32( _mm256_max_epi32( _mm256_cvttps_epi32( Ay ), zero ), _mm256_set1_epi32( MAPHEIGHT - 1 ) );
+	__m256i pz = _mm256_min_epi32( _mm256_max_epi32( _mm256_cvttps_epi32( Az ), zero ), _mm256_set1_epi32( MAPDEPTH - 1 ) );
+	__m256i level = i5, last = zero, brickIdx = zero, pack = zero;
+	__m256 t = _mm256_setzero_ps();
+	// results
+	__m256i done = zero, hitValue = zero, hitLast = zero;
+	__m256 hitT = _mm256_setzero_ps();
+	while (!_mm256_testz_si256( active, active ))
+	{
+		const __m256i cx = _mm256_srlv_epi32( px, level ), cy = _mm256_srlv_epi32( py, level ), cz = _mm256_srlv_epi32( pz, level );
+		const __m256i atU = _mm256_and_si256( active, _mm256_cmpeq_epi32( level, i5 ) );
+		const __m256i atG = _mm256_and_si256( active, _mm256_cmpeq_epi32( level, i3 ) );
+		const __m256i atB = _mm256_and_si256( active, _mm256_cmpeq_epi32( level, zero ) );
+		__m256i found = zero, descend = zero, value = zero;
+		if (!_mm256_testz_si256( atU, atU ))
+		{
+			// uber grid: skip 4x4x4 cells at once if they are all empty
+			const __m256i u = _mm256_and_si256( atU, _mm256_add_epi32( cx, _mm256_add_epi32( _mm256_mullo_epi32( cz,
+				_mm256_set1_epi32( UBERWIDTH ) ), _mm256_mullo_epi32( cy, _mm256_set1_epi32( UBERWIDTH * UBERDEPTH ) ) ) ) );
+			const __m256i lo = _mm256_i32gather_epi64( (const long long*)occupancy, _mm256_castsi256_si128( u ), 8 );
+			const __m256i hi = _mm256_i32gather_epi64( (const long long*)occupancy, _mm256_extracti128_si256( u, 1 ), 8 );
+			const __m256i empty = _mm256_permute4x64_epi64( _mm256_castps_si256( _mm256_shuffle_ps( _mm256_castsi256_ps(
+				_mm256_cmpeq_epi64( lo, zero ) ), _mm256_castsi256_ps( _mm256_cmpeq_epi64( hi, zero ) ), _MM_SHUFFLE( 2, 0, 2, 0 ) ) ),
+				_MM_SHUFFLE( 3, 1, 2, 0 ) );
+			if (toVoid) found = _mm256_and_si256( atU, empty );
+			descend = _mm256_andnot_si256( empty, atU );
+		}
+		if (!_mm256_testz_si256( atG, atG ))
+		{
+			// top-level grid: empty, solid or brick
+			const __m256i g = _mm256_mask_i32gather_epi32( zero, (const int*)grid, CellIndex8( cx, cy, cz ), atG, 4 );
+			const __m256i empty = _mm256_cmpeq_epi32( g, zero ), isBrick = _mm256_cmpeq_epi32( _mm256_and_si256( g, i1 ), i1 );
+			if (toVoid) found = _mm256_or_si256( found, _mm256_and_si256( atG, empty ) ); else
+			{
+				const __m256i solid = _mm256_andnot_si256( _mm256_or_si256( empty, isBrick ), atG );
+				found = _mm256_or_si256( found, solid );
+				value = _mm256_blendv_epi8( value, _mm256_srli_epi32( g, 1 ), solid );
+			}
+			const __m256i enter = _mm256_and_si256( atG, isBrick );
+			descend = _mm256_or_si256( descend, enter );
+			brickIdx = _mm256_blendv_epi8( brickIdx, _mm256_srli_epi32( g, 1 ), enter );
+			if (packHandle) pack = _mm256_blendv_epi8( pack, _mm256_mask_i32gather_epi32( zero, (const int*)packHandle, _mm256_srli_epi32( g, 1 ), enter, 4 ), enter );
+		}
+		if (!_mm256_testz_si256( atB, atB ))
+		{
+			// brick: fetch the voxel; plain bricks with one gather, packed ones per lane
+			const __m256i bmsk = _mm256_set1_epi32( BMSK );
+			const __m256i voxel = VoxelIndex8( _mm256_and_si256( px, bmsk ), _mm256_and_si256( py, bmsk ), _mm256_and_si256( pz, bmsk ) );
+			const __m256i idx = _mm256_add_epi32( _mm256_mullo_epi32( brickIdx, _mm256_set1_epi32( BRICKSIZE ) ), voxel );
+			const __m256i plain = _mm256_and_si256( _mm256_cmpeq_epi32( pack, zero ), atB );
+			const __m256i dword = _mm256_mask_i32gather_epi32( zero, (const int*)brick, _mm256_srli_epi32( idx, 2 / PAYLOADSIZE ), plain, 4 );
+			__m256i v = _mm256_and_si256( _mm256_srlv_epi32( dword, _mm256_slli_epi32( _mm256_and_si256( idx, _mm256_set1_epi32( 4 / PAYLOADSIZE - 1 ) ),
+				PAYLOADSIZE + 2 ) ), _mm256_set1_epi32( (1 << (PAYLOADSIZE * 8)) - 1 ) );
+			const int packed = _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_andnot_si256( plain, atB ) ) );
+			if (packed)
+			{
+				alignas(32) uint vl[8], hl[8], xl[8];
+				_mm256_store_si256( (__m256i*)vl, v ), _mm256_store_si256( (__m256i*)hl, pack ), _mm256_store_si256( (__m256i*)xl, voxel );
+				for (int m = packed; m; m &= m - 1) { const int i = _tzcnt_u32( m ); vl[i] = PackedVoxel( hl[i], xl[i] ); }
+				v = _mm256_load_si256( (__m256i*)vl );
+			}
+			const __m256i empty = _mm256_cmpeq_epi32( v, zero );
+			if (toVoid) found = _mm256_or_si256( found, _mm256_and_si256( atB, empty ) ); else
+			{
+				const __m256i hit = _mm256_andnot_si256( empty, atB );
+				found = _mm256_or_si256( found, hit );
+				value = _mm256_blendv_epi8( value, v, hit );
+			}
+		}
+		// lanes that found what they were looking for are done
+		if (!_mm256_testz_si256( found, found ))
+		{
+			hitT = _mm256_blendv_ps( hitT, t, _mm256_castsi256_ps( found ) );
+			hitValue = _mm256_blendv_epi8( hitValue, value, found );
+			hitLast = _mm256_blendv_epi8( hitLast, last, found );
+			done = _mm256_or_si256( done, found );
+			active = _mm256_andnot_si256( found, active );
+		}
+		// lanes that descend: place them in the finer cell the ray is in at distance t
+		if (!_mm256_testz_si256( descend, descend ))
+		{
+			const __m256i size = _mm256_sub_epi32( _mm256_sllv_epi32( i1, level ), i1 );
+			const __m256i lx = _mm256_sllv_epi32( cx, level ), ly = _mm256_sllv_epi32( cy, level ), lz = _mm256_sllv_epi32( cz, level );
+			const __m256i ix = _mm256_cvttps_epi32( _mm256_add_ps( Ax, _mm256_mul_ps( Vx, t ) ) );
+			const __m256i iy = _mm256_cvttps_epi32( _mm256_add_ps( Ay, _mm256_mul_ps( Vy, t ) ) );
+			const __m256i iz = _mm256_cvttps_epi32( _mm256_add_ps( Az, _mm256_mul_ps( Vz, t ) ) );
+			px = _mm256_blendv_epi8( px, _mm256_min_epi32( _mm256_max_epi32( ix, lx ), _mm256_add_epi32( lx, size ) ), descend );
+			py = _mm256_blendv_epi8( py, _mm256_min_epi32( _mm256_max_epi32( iy, ly ), _mm256_add_epi32( ly, size ) ), descend );
+			pz = _mm256_blendv_epi8( pz, _mm256_min_epi32( _mm256_max_epi32( iz, lz ), _mm256_add_epi32( lz, size ) ), descend );
+			level = _mm256_blendv_epi8( level, _mm256_and_si256( _mm256_cmpeq_epi32( level, i5 ), i3 ), descend ); // 5 -> 3, 3 -> 0
+		}
+		// all other lanes step to the next cell of their level
+		const __m256i step = _mm256_andnot_si256( descend, active );
+		if (_mm256_testz_si256( step, step )) continue;
+		const __m256 tx = _mm256_mul_ps( _mm256_sub_ps( _mm256_cvtepi32_ps( _mm256_sllv_epi32( _mm256_add_epi32( cx, offX ), level ) ), Ax ), rVx );
+		const __m256 ty = _mm256_mul_ps( _mm256_sub_ps( _mm256_cvtepi32_ps( _mm256_sllv_epi32( _mm256_add_epi32( cy, offY ), level ) ), Ay ), rVy );
+		const __m256 tz = _mm256_mul_ps( _mm256_sub_ps( _mm256_cvtepi32_ps( _mm256_sllv_epi32( _mm256_add_epi32( cz, offZ ), level ) ), Az ), rVz );
+		const __m256 tn = _mm256_min_ps( tx, _mm256_min_ps( ty, tz ) );
+		// axis priority x, y, z, as in TraceRay
+		const __m256i sx = _mm256_and_si256( step, _mm256_castps_si256( _mm256_cmp_ps( tn, tx, _CMP_EQ_OQ ) ) );
+		const __m256i sy = _mm256_andnot_si256( sx, _mm256_and_si256( step, _mm256_castps_si256( _mm256_cmp_ps( tn, ty, _CMP_EQ_OQ ) ) ) );
+		const __m256i sz = _mm256_andnot_si256( _mm256_or_si256( sx, sy ), step );
+		// entering the next cell from below puts p at its start, from above at its end
+		const __m256i size = _mm256_sub_epi32( _mm256_sllv_epi32( i1, level ), i1 );
+		const __m256i nx = _mm256_add_epi32( _mm256_sllv_epi32( _mm256_add_epi32( cx, dirX ), level ), _mm256_andnot_si256( posX, size ) );
+		const __m256i ny = _mm256_add_epi32( _mm256_sllv_epi32( _mm256_add_epi32( cy, dirY ), level ), _mm256_andnot_si256( posY, size ) );
+		const __m256i nz = _mm256_add_epi32( _mm256_sllv_epi32( _mm256_add_epi32( cz, dirZ ), level ), _mm256_andnot_si256( posZ, size ) );
+		const __m256i ox = px, oy = py, oz = pz;
+		px = _mm256_blendv_epi8( px, nx, sx ), py = _mm256_blendv_epi8( py, ny, sy ), pz = _mm256_blendv_epi8( pz, nz, sz );
+		t = _mm256_blendv_ps( t, tn, _mm256_castsi256_ps( step ) );
+		last = _mm256_blendv_epi8( _mm256_blendv_epi8( last, zero, sx ), i1, sy );
+		last = _mm256_blendv_epi8( last, _mm256_set1_epi32( 2 ), sz );
+		// leaving the map ends the lane
+		const __m256i out = _mm256_or_si256( _mm256_or_si256( _mm256_cmpgt_epi32( zero, _mm256_min_epi32( px, _mm256_min_epi32( py, pz ) ) ),
+			_mm256_cmpgt_epi32( px, mapMax ) ), _mm256_or_si256( _mm256_cmpgt_epi32( py, _mm256_set1_epi32( MAPHEIGHT - 1 ) ),
+			_mm256_cmpgt_epi32( pz, _mm256_set1_epi32( MAPDEPTH - 1 ) ) ) );
+		active = _mm256_andnot_si256( _mm256_and_si256( step, out ), active );
+		// lanes that left their grid cell or uber cell climb back up
+		const __m256i leftU = _mm256_xor_si256( _mm256_cmpeq_epi32( _mm256_or_si256( _mm256_or_si256( _mm256_xor_si256( _mm256_srli_epi32( px, 5 ),
+			_mm256_srli_epi32( ox, 5 ) ), _mm256_xor_si256( _mm256_srli_epi32( py, 5 ), _mm256_srli_epi32( oy, 5 ) ) ),
+			_mm256_xor_si256( _mm256_srli_epi32( pz, 5 ), _mm256_srli_epi32( oz, 5 ) ) ), zero ), _mm256_set1_epi32( -1 ) );
+		const __m256i leftG = _mm256_xor_si256( _mm256_cmpeq_epi32( _mm256_or_si256( _mm256_or_si256( _mm256_xor_si256( _mm256_srli_epi32( px, 3 ),
+			_mm256_srli_epi32( ox, 3 ) ), _mm256_xor_si256( _mm256_srli_epi32( py, 3 ), _mm256_srli_epi32( oy, 3 ) ) ),
+			_mm256_xor_si256( _mm256_srli_epi32( pz, 3 ), _mm256_srli_epi32( oz, 3 ) ) ), zero ), _mm256_set1_epi32( -1 ) );
+		level = _mm256_blendv_epi8( level, i3, _mm256_and_si256( step, leftG ) );
+		level = _mm256_blendv_epi8( level, i5, _mm256_and_si256( step, leftU ) );
+	}
+	// store the results like the batch kernels do
+	alignas(32) float ht[8];
+	alignas(32) int hv[8], hl[8], hd[8];
+	_mm256_store_ps( ht, hitT ), _mm256_store_si256( (__m256i*)hv, hitValue );
+	_mm256_store_si256( (__m256i*)hl, hitLast ), _mm256_store_si256( (__m256i*)hd, done );
+	for (uint i = 0; i < lanes; i++) if (hd[i])
+	{
+		const float dist = ht[i] + to[i];
+		const float d = hl[i] == 0 ? vx[i] : hl[i] == 1 ? vy[i] : vz[i];
+		const uint Nval = d > 0 ? 21 - (1 << (hl[i] * 2)) : 21 + (1 << (hl[i] * 2)); // -dir on the last axis, 0 elsewhere
+		hits[i].t = dist < rays[i].t ? dist : 1e34f;
+		hits[i].N = toVoid ? Nval : (Nval + (hv[i] << 16));
+	}
+}
+
+// World::RenderCPU: render_whitted for a camera matrix on the host, for headless
+// worlds (thumbnails, regression images). Primary rays are set up as in Render,
+// traced as 8-pixel packets and shaded with the skylights; the result is tone
+// mapped like renderNoTAA and gets the sqrt of the display shader, so images
+// match the window. Pixels are RGBA bytes, ready for stbi_write_png.
+// ----------------------------------------------------------------------------
+#define RENDERJOBS	64
+#define RENDERTILE	16
+static float3 ToFloatRGB( const uint v )
+{
+#if PAYLOADSIZE == 1
+	return make_float3( (v >> 5) * (1.0f / 7.0f), ((v >> 2) & 7) * (1.0f / 7.0f), (v & 3) * (1.0f / 3.0f) );
+#else
+	return make_float3( ((v >> 8) & 15) * (1.0f / 15.0f), ((v >> 4) & 15) * (1.0f / 15.0f), (v & 15) * (1.0f / 15.0f) );
+#endif
+}
+static float ToneMapChannel( const float x, const float whitePt )
+{
+	// ToneMapFilmic_Hejl2015 and LinearToSRGB from cl/tools.cl, then the display shader sqrt
+	const float a = 1.425f * x + 0.05f, aw = 1.425f * whitePt + 0.05f;
+	const float f = (x * a + 0.004f) / (x * (a + 0.55f) + 0.0491f) - 0.0821f;
+	const float fw = (whitePt * aw + 0.004f) / (whitePt * (aw + 0.55f) + 0.0491f) - 0.0821f;
+	const float c = clamp( f / fw, 0.0f, 1.0f );
+	return sqrtf( c < 0.0031308f ? c * 12.92f : powf( c * 1.055f, 1.0f / 2.4f ) - 0.055f );
+}
+void World::RenderCPU( const mat4& M, uint* pixels, const int width, const int height )
+{
+	PROFILE_SCOPE( "Render (CPU)" );
+	if (!skyPixels) FatalError( "RenderCPU: no skydome loaded." );
+	const float aspectRatio = (float)width / height;
+	const uint tiles = ((width + RENDERTILE - 1) / RENDERTILE) * ((height + RENDERTILE - 1) / RENDERTILE);
+	static JobManager* jm = JobManager::GetJobManager();
+	static RenderJob rj[RENDERJOBS];
+	for (uint i = 0; i < RENDERJOBS; i++)
+	{
+		rj[i].world = this, rj[i].pixels = pixels, rj[i].width = width, rj[i].height = height;
+		rj[i].E = TransformPosition( make_float3( 0 ), M );
+		rj[i].p0 = TransformPosition( make_float3( aspectRatio, 1, 2.2f ), M );
+		rj[i].p1 = TransformPosition( make_float3( -aspectRatio, 1, 2.2f ), M );
+		rj[i].p2 = TransformPosition( make_float3( aspectRatio, -1, 2.2f ), M );
+		rj[i].first = i, rj[i].tiles = tiles;
+		jm->AddJob2( &rj[i] );
+	}
+	jm->RunJobs();
+}
+void World::RenderJob::Main()
+{
+	// tiles are interleaved over the jobs, so cheap sky tiles and busy terrain tiles mix
+	const int tilesX = (width + RENDERTILE - 1) / RENDERTILE;
+	const float lightScale = Game::skyDomeLightScale;
+	for (uint tile = first; tile < tiles; tile += RENDERJOBS)
+	{
+		const int x0 = (tile % tilesX) * RENDERTILE, y0 = (tile / tilesX) * RENDERTILE;
+		for (int y = y0; y < min( y0 + RENDERTILE, height ); y++) for (int x = x0; x < min( x0 + RENDERTILE, width ); x += 8)
+		{
+			const uint lanes = min( 8, width - x );
+			float3 pixel[8] = {};
+			bool missed[8] = {}; // like render_whitted, the first sample that misses returns the sky as is
+			for (int u = 0; u < AA_SAMPLES; u++) for (int v = 0; v < AA_SAMPLES; v++)
+			{
+				Ray rays[8];
+				Intersection hits[8];
+				for (uint i = 0; i < lanes; i++)
+				{
+					// GenerateCameraRay without the TAA jitter
+					const float2 uv = make_float2( (x + i + (float)u / AA_SAMPLES) / width, (y + (float)v / AA_SAMPLES) / height );
+					const float3 P = p0 + (p1 - p0) * uv.x + (p2 - p0) * uv.y;
+					rays[i].O = E, rays[i].D = normalize( P - E ), rays[i].t = 1e34f;
+				}
+				world->TracePacket( rays, hits, lanes, false );
+				for (uint i = 0; i < lanes; i++)
+				{
+					if (missed[i]) continue;
+					const float3 D = rays[i].D;
+					const uint voxel = hits[i].N >> 16;
+					if (voxel == 0) { pixel[i] = world->SampleSky( make_float3( D.x, D.z, D.y ) ), missed[i] = true; continue; }
+					const uint N = hits[i].N, side = (N & 3) != 1 ? 0 : ((N >> 2) & 3) != 1 ? 1 : 2;
+					float4 sky;
+					if (side == 0) sky = world->skyLight[D.x > 0 ? 0 : 1];
+					if (side == 1) sky = world->skyLight[D.y > 0 ? 2 : 3];
+					if (side == 2) sky = world->skyLight[D.z > 0 ? 4 : 5];
+					pixel[i] += INVPI * ToFloatRGB( voxel ) * lightScale * make_float3( sky );
+				}
+			}
+			for (uint i = 0; i < lanes; i++)
+			{
+				const float3 c = missed[i] ? pixel[i] : pixel[i] * (1.0f / (AA_SAMPLES * AA_SAMPLES));
+				const uint r = (uint)(ToneMapChannel( c.x, 1 ) * 255.0f + 0.5f);
+				const uint g = (uint)(ToneMapChannel( c.y, 1 ) * 255.0f + 0.5f);
+				const uint b = (uint)(ToneMapChannel( c.z, 1 ) * 255.0f + 0.5f);
+				pixels[x + i + y * width] = 0xff000000 | (b << 16) | (g << 8) | r;
+			}
+		}
+	}
 }
 
 /*
@@ -1539,6 +3113,7 @@ to ensure it completes before the commit kernel is executed on this data.
 // ----------------------------------------------------------------------------
 void World::Render()
 {
+	if (headless) return; // nothing to render to
 	// copy scene changes from staging buffer to final destination on GPU
 	// Note: even if game->autoRendering is false, we still keep the scene in sync
 	// with this mechanism.
@@ -1550,6 +3125,11 @@ void World::Render()
 			committer->Run( (tasks + 63) & (65536 - 32), 4, &copyDone, &commitDone );
 			commitInFlight = true;
 		}
+		else if (bulkSync)
+		{
+			// bricks were written straight into the brick buffer; don't render while that happens
+			clWaitForEvents( 1, &copyDone );
+		}
 		copyInFlight = false;
 	}
 	if (Game::autoRendering)
@@ -1662,40 +3242,62 @@ void World::Commit()
 		commitInFlight = false;
 	}
 	// replace the initial staging buffer by a double-sized buffer in pinned memory
-	static uint* pinnedMemPtr = 0;
 	if (pinnedMemPtr == 0)
 	{
-		const uint pinnedSize = commitSize + gridSize;
-		cl_mem pinned = clCreateBuffer( Kernel::GetContext(), CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, commitSize * 2, 0, 0 );
-		pinnedMemPtr = (uint*)clEnqueueMapBuffer( Kernel::GetQueue(), pinned, 1, CL_MAP_WRITE, 0, pinnedSize, 0, 0, 0, 0 );
-		StreamCopy( (__m256i*)(pinnedMemPtr + commitSize / 4), (__m256i*)grid, gridSize );
-		grid = pinnedMemPtr + commitSize / 4; // top-level grid resides at the start of the staging buffer
-	}
-	// gather changed bricks
-	tasks = 0;
-	uint* brickIndices = pinnedMemPtr + gridSize / 4;
-	uchar* changedBricks = (uchar*)(brickIndices + MAXCOMMITS);
-	for (uint j = 0; j < BRICKCOUNT / 32; j++) if (IsDirty32( j ) /* if not dirty: skip 32 bits at once */)
-	{
-		for (uint k = 0; k < 32; k++)
+		if (headless)
+		{
+			// no device to copy to; plain host memory is enough, the grid stays where it is
+			pinnedMemPtr = (uint*)_aligned_malloc( commitSize, 64 );
+		}
+		else
 		{
-			const uint i = j * 32 + k;
-			if (!IsDirty( i )) continue;
-			*brickIndices++ = i; // store index of modified brick at start of staging buffer
-			StreamCopy( (__m256i*)changedBricks, (__m256i*)(brick + i * BRICKSIZE), BRICKSIZE * PAYLOADSIZE );
-			changedBricks += BRICKSIZE * PAYLOADSIZE, tasks++;
+			const uint pinnedSize = commitSize + gridSize;
+			cl_mem pinned = clCreateBuffer( Kernel::GetContext(), CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, commitSize * 2, 0, 0 );
+			pinnedMemPtr = (uint*)clEnqueueMapBuffer( Kernel::GetQueue(), pinned, 1, CL_MAP_WRITE, 0, pinnedSize, 0, 0, 0, 0 );
+			StreamCopy( (__m256i*)(pinnedMemPtr + commitSize / 4), (__m256i*)grid, gridSize );
+			grid = pinnedMemPtr + commitSize / 4; // top-level grid resides at the start of the staging buffer
 		}
-		ClearMarks32( j );
-		if (tasks + 32 >= MAXCOMMITS) break; // we have too many commits; postpone
 	}
+	// drop freshly written bricks that are uniform, and share the others with identical
+	// bricks elsewhere, before they get uploaded
+	if (optimizeOnCommit) OptimizeBricks( true );
+	if (dedupOnWrite) DedupBricks( true );
+	// gather changed bricks; a large backlog is uploaded as one brick range instead
+	UpdateCommitBudget();
+	const uint backlog = GetDirtyBrickCount();
+	bulkSync = !headless && !MORTONHOST && backlog > BULKFRAMES * commitBudget; // morton bricks need converting
+	if (bulkSync)
+	{
+		PROFILE_SCOPE( "Commit bulk" );
+		SyncDirtyBricks();
+		tasks = 0;
+	}
+	else
+	{
+		PROFILE_SCOPE( "Commit gather" );
+		tasks = GatherBricks( pinnedMemPtr, commitBudget );
+	}
+	// estimate when the remaining backlog will be on the device
+	commitBacklog = bulkSync ? 0 : backlog - tasks;
+	if (commitBacklog == 0) syncEstimate = 0;
+	else if (commitBacklog > BULKFRAMES * commitBudget && uploadRate > 0)
+		syncEstimate = frameTime + commitBacklog * (float)(BRICKSIZE * PAYLOADSIZE) / uploadRate;
+	else syncEstimate = ceilf( (float)commitBacklog / commitBudget ) * frameTime;
 	// asynchroneously copy the CPU data to the GPU via the staging buffer
-	if (tasks > 0 || firstFrame)
+	if (!headless && (tasks > 0 || firstFrame || bulkSync || gridDirty))
 	{
+		PROFILE_SCOPE( "Commit copy" );
 		// copy top-level grid to start of pinned buffer in preparation of final transfer
+	#if MORTONHOST == 1
+		LinearGrid( pinnedMemPtr );
+	#else
 		StreamCopyMT( (__m256i*)pinnedMemPtr, (__m256i*)grid, gridSize );
+	#endif
 		// enqueue (on queue 2) memcopy of pinned buffer to staging buffer on GPU
 		const uint copySize = firstFrame ? commitSize : (gridSize + MAXCOMMITS * 4 + tasks * BRICKSIZE * PAYLOADSIZE);
-		clEnqueueWriteBuffer( Kernel::GetQueue2(), devmem, 0, 0, copySize, pinnedMemPtr, 0, 0, 0 );
+		const bool timed = uploadBytes == 0; // measure the transfer rate when nothing else is being timed
+		clEnqueueWriteBuffer( Kernel::GetQueue2(), devmem, 0, 0, copySize, pinnedMemPtr, 0, 0, timed ? &uploadDone : 0 );
+		if (timed) uploadBytes = copySize;
 		const size_t ws = UBERWIDTH * UBERHEIGHT * UBERDEPTH;
 		const size_t ls = 16;
 		clEnqueueNDRangeKernel( Kernel::GetQueue2(), uberGridUpdater->GetKernel(), 1, 0, &ws, &ls, 0, 0, &ubergridDone );
@@ -1705,6 +3307,7 @@ void World::Commit()
 		clEnqueueCopyBufferToImage( Kernel::GetQueue2(), devmem, gridMap, 0, origin, region, 0, 0, &copyDone );
 		copyInFlight = true;	// next render should wait for this commit to complete
 		firstFrame = false;		// next frame is not the first frame
+		gridDirty = false;
 	}
 	// bricks and top-level grid have been moved to the final host-side staging buffer; remove sprites and particles
 	// NOTE: this must explicitly happen in reverse order.
@@ -1715,8 +3318,9 @@ void World::Commit()
 		if (sprite[i]->hasShadow) RemoveSpriteShadow( i );
 	}
 	// at this point, rendering *must* be done; let's make sure
-	if (Game::autoRendering)
+	if (Game::autoRendering && !headless)
 	{
+		PROFILE_SCOPE( "Render wait" );
 		clWaitForEvents( 1, &renderDone );
 		// profiling: https://stackoverflow.com/questions/23272170/opencl-measure-kernels-time
 		cl_ulong renderStart = 0;
@@ -1726,11 +3330,243 @@ void World::Commit()
 		unsigned long duration = (unsigned long)(renderEnd - renderStart); // in nanoseconds
 		renderTime = duration / 1000000000.0f;
 	}
+	// a sparse brick store gives long-free pages back every now and then
+	if (sparsePool && --trimCountdown == 0) trimCountdown = POOLTRIM, TrimBricks();
 }
 
-// World::StreamCopyMT
+// World::UpdateCommitBudget: pick the number of bricks to gather this frame, from the
+// measured transfer rate and the part of the frame that rendering leaves unused
+// ----------------------------------------------------------------------------
+void World::UpdateCommitBudget()
+{
+	const float interval = commitTimer.elapsed();
+	commitTimer.reset();
+	frameTime = frameTime > 0 ? 0.9f * frameTime + 0.1f * interval : interval;
+	if (headless) return; // no device; the staging buffer is the only limit
+	if (uploadBytes > 0)
+	{
+		cl_int status = CL_QUEUED;
+		clGetEventInfo( uploadDone, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof( cl_int ), &status, 0 );
+		if (status != CL_COMPLETE) return; // still in flight; keep the previous budget
+		cl_ulong start = 0, end = 0;
+		clGetEventProfilingInfo( uploadDone, CL_PROFILING_COMMAND_START, sizeof( cl_ulong ), &start, 0 );
+		clGetEventProfilingInfo( uploadDone, CL_PROFILING_COMMAND_END, sizeof( cl_ulong ), &end, 0 );
+		if (end > start)
+		{
+			const float rate = uploadBytes / ((end - start) * 1e-9f);
+			uploadRate = uploadRate > 0 ? 0.9f * uploadRate + 0.1f * rate : rate;
+		}
+		clReleaseEvent( uploadDone );
+		uploadBytes = 0;
+	}
+	if (uploadRate == 0) return;
+	const float headroom = max( COMMITFRAME - renderTime, 0.0f ) * COMMITSHARE;
+	const float bricks = headroom * uploadRate / (BRICKSIZE * PAYLOADSIZE);
+	commitBudget = (uint)clamp( bricks, (float)MINCOMMITS, (float)MAXCOMMITS );
+}
+
+// World::SyncDirtyBricks: upload the index range spanning all dirty bricks straight into
+// the brick buffer, like ForceSyncAllBricks but limited to the part that changed
+// ----------------------------------------------------------------------------
+void World::SyncDirtyBricks()
+{
+	uint64_t* dirty = (uint64_t*)modified;
+	uint first = BRICKCOUNT / 64, last = 0;
+	for (uint j = 0; j < BRICKCOUNT / 64; j++) if (dirty[j]) first = min( first, j ), last = j + 1;
+	if (first >= last) return;
+	const size_t offset = (size_t)first * 64 * BRICKSIZE * PAYLOADSIZE;
+	const size_t bytes = (size_t)(last - first) * 64 * BRICKSIZE * PAYLOADSIZE;
+#if MORTONBRICKS == 1
+	ForceSyncAllBricks(); // the device stores the bricks in a different order
+#elif ONEBRICKBUFFER == 1
+	// on queue 2, so the grid copy that follows completes after the bricks
+	const bool timed = uploadBytes == 0;
+	clEnqueueWriteBuffer( Kernel::GetQueue2(), brickBuffer->deviceBuffer, 0, offset, bytes, (uchar*)brick + offset, 0, 0, timed ? &uploadDone : 0 );
+	if (timed) uploadBytes = bytes;
+#else
+	for (int i = 0; i < CHUNKCOUNT; i++)
+	{
+		const size_t lo = max( offset, (size_t)i * CHUNKSIZE ), hi = min( offset + bytes, (size_t)(i + 1) * CHUNKSIZE );
+		if (lo < hi) clEnqueueWriteBuffer( Kernel::GetQueue2(), brickBuffer[i]->deviceBuffer, 0, lo - (size_t)i * CHUNKSIZE, hi - lo, (uchar*)brick + lo, 0, 0, 0 );
+	}
+#endif
+	memset( dirty + first, 0, (last - first) * sizeof( uint64_t ) );
+}
+
+// World::BindDirtyMap: give the calling thread a dirty bitmap in this world, reusing
+// the bitmap of a thread that exited if there is one
+// ----------------------------------------------------------------------------
+void World::BindDirtyMap( DirtyMapRef& ref )
+{
+	if (ref.map) ref.map->released = true; // the thread moved on from another world
+	scoped_lock lock( dirtyMapLock );
+	ref.map = 0;
+	for (auto& m : dirtyMaps)
+	{
+		bool released = true;
+		if (m->released.compare_exchange_strong( released, false )) { ref.map = m; break; }
+	}
+	if (!ref.map)
+	{
+		ref.map = make_shared<DirtyMap>();
+		memset( ref.map->bits, 0, sizeof( DirtyMap::bits ) );
+		memset( ref.map->touched, 0, sizeof( DirtyMap::touched ) );
+		dirtyMaps.push_back( ref.map );
+	}
+	ref.serial = serial;
+}
+
+// World::MergeMarks: OR the per-thread dirty bitmaps into 'modified'. Not thread-safe
+// with respect to Set; called from Commit and the other readers of 'modified'.
+// ----------------------------------------------------------------------------
+#define MERGEJOBS	64
+#define MERGEMT		1024	// touched words below which a single thread is faster
+void World::MergeMarks()
+{
+	static JobManager* jm = JobManager::GetJobManager();
+	static MergeJob mj[MERGEJOBS];
+	scoped_lock lock( dirtyMapLock );
+	uint touched = 0;
+	for (auto& m : dirtyMaps) for (uint i = 0; i < BRICKCOUNT / 4096; i++) touched += (uint)_mm_popcnt_u64( m->touched[i] );
+	if (touched == 0) return;
+	for (uint i = 0; i < MERGEJOBS; i++)
+	{
+		mj[i].world = this;
+		mj[i].first = i * (BRICKCOUNT / 4096 / MERGEJOBS), mj[i].last = (i + 1) * (BRICKCOUNT / 4096 / MERGEJOBS);
+	}
+	if (touched < MERGEMT) for (uint i = 0; i < MERGEJOBS; i++) mj[i].Main(); else
+	{
+		for (uint i = 0; i < MERGEJOBS; i++) jm->AddJob2( &mj[i] );
+		jm->RunJobs();
+	}
+}
+
+// World::MergeJob::Main
+// ----------------------------------------------------------------------------
+void World::MergeJob::Main()
+{
+	uint64_t* dirty = (uint64_t*)world->modified;
+	for (auto& m : world->dirtyMaps) for (uint i = first; i < last; i++)
+	{
+		for (uint64_t t = m->touched[i]; t; t &= t - 1)
+		{
+			const uint w = i * 64 + (uint)_tzcnt_u64( t );
+			dirty[w] |= m->bits[w], m->bits[w] = 0;
+		}
+		m->touched[i] = 0;
+	}
+}
+
+// World::ClearMarks
+// ----------------------------------------------------------------------------
+void World::ClearMarks()
+{
+	memset( modified, 0, (BRICKCOUNT / 32) * 4 );
+	scoped_lock lock( dirtyMapLock );
+	for (auto& m : dirtyMaps)
+	{
+		memset( m->bits, 0, sizeof( DirtyMap::bits ) );
+		memset( m->touched, 0, sizeof( DirtyMap::touched ) );
+	}
+}
+
+// World::GetDirtyBrickCount
+// ----------------------------------------------------------------------------
+uint World::GetDirtyBrickCount()
+{
+	MergeMarks();
+	uint count = 0;
+	for (uint j = 0; j < BRICKCOUNT / 32; j++) count += _mm_popcnt_u32( modified[j] );
+	return count;
+}
+
+// World::GatherBricks
 // ----------------------------------------------------------------------------
+#define GATHERJOBS	64
+#define GATHERMT	256		// below this many bricks a single thread is faster
+uint World::GatherBricks( uint* staging, const uint budget )
+{
+	// copy changed bricks to the staging buffer, right after the space reserved for the grid.
+	// a prefix sum over the dirty counts of the bitfield ranges gives each range its staging
+	// slots, so the ranges can be copied in parallel. Bricks past the budget are postponed.
+	static JobManager* jm = JobManager::GetJobManager();
+	static GatherJob gj[GATHERJOBS];
+	const uint64_t* dirty = (const uint64_t*)modified;
+	const uint wordsPerJob = BRICKCOUNT / 64 / GATHERJOBS;
+	uint gathered = 0, jobs = 0;
+	bool full = false;
+	for (uint i = 0; i < GATHERJOBS && !full; i++)
+	{
+		GatherJob& job = gj[jobs];
+		job.first = i * wordsPerJob, job.last = job.first + wordsPerJob, job.offset = gathered;
+		for (uint j = job.first; j < job.last; j++)
+		{
+			const uint n = (uint)_mm_popcnt_u64( dirty[j] );
+			if (gathered + n > budget) { job.last = j, full = true; break; }
+			gathered += n;
+		}
+		if (gathered == job.offset) continue; // nothing to copy in this range
+		job.world = this, job.brickIndices = staging + gridSize / 4;
+		job.changedBricks = (uchar*)(job.brickIndices + MAXCOMMITS);
+		jobs++;
+	}
+	if (gathered < GATHERMT) for (uint i = 0; i < jobs; i++) gj[i].Main(); else
+	{
+		for (uint i = 0; i < jobs; i++) jm->AddJob2( &gj[i] );
+		jm->RunJobs();
+	}
+	return gathered;
+}
+
+// World::GatherJob::Main: copy the dirty bricks of a range, lowest index first
+// ----------------------------------------------------------------------------
+void World::GatherJob::Main()
+{
+	uint64_t* dirty = (uint64_t*)world->modified;
+	uint* indices = brickIndices + offset;
+	uchar* dst = changedBricks + (size_t)offset * BRICKSIZE * PAYLOADSIZE;
+	for (uint j = first; j < last; j++)
+	{
+		for (uint64_t bits = dirty[j]; bits; bits &= bits - 1)
+		{
+			const uint i = j * 64 + (uint)_tzcnt_u64( bits );
+			*indices++ = i; // store index of modified brick at start of staging buffer
+		#if MORTONHOST == 1
+			alignas(32) PAYLOAD scratch[BRICKSIZE];
+			LinearBrick( world->BrickVoxels( i, scratch ), (PAYLOAD*)dst ); // the device gets plain, linear bricks
+		#else
+			if (world->packHandle && world->packHandle[i]) world->DecodeBrick( world->packHandle[i], (PAYLOAD*)dst ); // the device gets plain bricks
+			else StreamCopy( (__m256i*)dst, (__m256i*)(world->brick + i * BRICKSIZE), BRICKSIZE * PAYLOADSIZE );
+		#endif
+			dst += BRICKSIZE * PAYLOADSIZE;
+		}
+		dirty[j] = 0;
+	}
+}
+
 #define COPYTHREADS	4
+// World::LinearGrid: copy the morton-ordered grid to dst in the linear device layout
+// ----------------------------------------------------------------------------
+void World::LinearGrid( uint* dst )
+{
+	static JobManager* jm = JobManager::GetJobManager();
+	static LayoutJob lj[COPYTHREADS];
+	for (uint i = 0; i < COPYTHREADS; i++)
+	{
+		lj[i].src = grid, lj[i].dst = dst;
+		lj[i].first = i * (GRIDSIZE / COPYTHREADS), lj[i].last = (i + 1) * (GRIDSIZE / COPYTHREADS);
+		jm->AddJob2( &lj[i] );
+	}
+	jm->RunJobs();
+}
+void World::LayoutJob::Main()
+{
+	for (uint c = first; c < last; c++)
+		dst[c] = src[CellIndex( c % GRIDWIDTH, c / (GRIDWIDTH * GRIDDEPTH), (c / GRIDWIDTH) % GRIDDEPTH )];
+}
+
+// World::StreamCopyMT
+// ----------------------------------------------------------------------------
 void World::StreamCopyMT( __m256i* dst, __m256i* src, const uint bytes )
 {
 	// fast copying of large 32-byte aligned / multiple of 32 sized data blocks:
@@ -1770,7 +3606,7 @@ Tile::Tile( const char* voxFile )
 	for (int i = 0; i < BRICKSIZE; i++)
 	{
 		PAYLOAD v = frame->buffer[i];
-		voxels[i] = v;
+		voxels[World::VoxelIndex( i & BMSK, (i / BRICKDIM) & BMSK, i / BDIM2 )] = v; // stored in host layout
 		if (v == 0) zeroCount++;
 	}
 	zeroes = zeroCount;
@@ -1798,7 +3634,7 @@ BigTile::BigTile( const char* voxFile )
 		for (int z = 0; z < BRICKDIM; z++) for (int y = 0; y < BRICKDIM; y++) for (int x = 0; x < BRICKDIM; x++)
 		{
 			PAYLOAD v = frame->buffer[sx * BRICKDIM + x + (sy * BRICKDIM + y) * BRICKDIM * 2 + (sz * BRICKDIM + z) * 4 * BRICKDIM * BRICKDIM];
-			tile[subTile].voxels[x + y * BRICKDIM + z * BRICKDIM * BRICKDIM] = v;
+			tile[subTile].voxels[World::VoxelIndex( x, y, z )] = v;
 			if (v == 0) zeroCount++;
 		}
 		tile[subTile].zeroes = zeroCount;
@@ -1,17 +1,58 @@
 #pragma once
 
 #define THREADSAFEWORLD 1
+#define BRICKBATCH	64	// bricks moved between a thread's magazine and the shared ring at once
+#if THREADSAFEWORLD
+#define TRASHSTRIDE	31	// ring step between consecutive bricks, so threads don't share cache lines
+#else
+#define TRASHSTRIDE	1	// a single thread walks the ring linearly
+#endif
+#define POOLPAGE	(65536 / (BRICKSIZE * PAYLOADSIZE))	// bricks per page of a sparse brick store: one allocation granule
+#define POOLPAGES	(BRICKCOUNT / POOLPAGE)
+#define POOLIDLE	4	// TrimBricks calls a page must stay free before it is decommitted
+#define POOLTRIM	64	// commits between automatic TrimBricks calls
+#define PACKUNIT	32	// granularity of the palette-packed brick store, in bytes
+#define PACKUNITS(bits)	(((PAYLOADSIZE << (bits)) + BRICKSIZE * (bits) / 8 + PACKUNIT - 1) / PACKUNIT)	// palette + indices
 #define SQR(x) ((x)*(x))
 #define TILESIZE	8
 #define TILESIZE2	(TILESIZE * TILESIZE)
 
 #define OUTOFRANGE -99999
 
+#if MORTONHOST == 1 && (GRIDWIDTH != 128 || GRIDHEIGHT != 128 || GRIDDEPTH != 128 || BRICKDIM != 8)
+#error "MORTONHOST expects a 128^3 grid of 8^3 bricks"
+#endif
+
 namespace Tmpl8
 {
 
 struct BrickInfo { uint zeroes; /* , location; */ };
 
+// brick pool occupancy, see World::GetBrickStats
+struct BrickStats
+{
+	uint inUse;							// grid cells that reference a brick
+	uint shared;						// of those, cells that share their brick with another cell
+	uint cached;						// free bricks held in per-thread magazines
+	uint free;							// bricks in the shared ring
+	uint peak;							// highest number of bricks taken from the ring
+	uint64_t refills, flushes;			// batch transfers between magazines and the ring
+	size_t committed, peakCommitted;	// bytes of the brick store backed by memory
+	uint packed;						// bricks stored as palette + indices, see World::PackBricks
+	size_t packedBytes;					// size of the packed store, including free slots
+};
+
+// compact copy of the world contents: only non-empty grid cells are stored, and bricks
+// that contain a single value are stored as solid cells.
+struct WorldSnapshot
+{
+	vector<uint> cells;					// indices of the non-empty grid cells
+	vector<uint> values;				// per cell: solid value << 1, or snapshot brick index << 1 | 1
+	vector<PAYLOAD> bricks;				// voxels of the snapshot bricks, BRICKSIZE each
+	vector<uint> zeroes;				// per snapshot brick: number of empty voxels
+	size_t Bytes() const { return (cells.size() + values.size() + zeroes.size()) * 4 + bricks.size() * PAYLOADSIZE; }
+};
+
 // Sprite system overview:
 // The world contains a set of 0 or more sprites, typically loaded from .vox files.
 // Sprites act like classic homecomputer sprites: they do not affect the world in
@@ -165,17 +206,45 @@ class World
 {
 public:
 	// constructor / destructor
-	World( const uint targetID );
+	World( const uint targetID ); // targetID 0: headless world, host-side data only
 	~World();
 	// initialization
 	void Clear();
+	void BeginUpdate();		// diff-based alternative to Clear: re-plot the world, then call EndUpdate
+	uint EndUpdate();		// keeps unchanged bricks; returns the number of grid cells that changed
 	void Fill( const uint c );
 	void DummyWorld();
 	void LoadSky( const char* filename, const float scale = 1.0f );
 	float3 SampleSky( const float3& D );
 	void UpdateSkylights(); // updates the six skylight colors
 	void ForceSyncAllBricks();
-	void OptimizeBricks();
+	uint OptimizeBricks( const bool dirtyOnly = false ); // replace uniform bricks by solid cells
+	void SetOptimizeOnCommit( const bool enabled ) { optimizeOnCommit = enabled; } // optimize dirty bricks at each commit
+	bool GetOptimizeOnCommit() const { return optimizeOnCommit; }
+	uint DedupBricks( const bool dirtyOnly = false ); // let cells with identical bricks share one
+	uint TrimBricks(); // decommit long-free pages of a sparse brick store; returns the page count
+	uint PackBricks(); // store bricks with at most 16 distinct values as palette + indices
+	void RebuildOccupancy(); // recalculate the host-side uber grid from the top-level grid
+	// column-top surface map: highest solid voxel and its value per (x,z), kept up to date by Set
+	void EnableSurfaceMap( const bool enabled );
+	bool HasSurfaceMap() const { return surface != 0; }
+	void RebuildSurface(); // recalculate the surface map from the voxel data
+	int SurfaceHeight( const uint x, const uint z ) const // -1: empty column, or no surface map
+	{
+		return surface && x < MAPWIDTH && z < MAPDEPTH ? (int)(surface[x + z * MAPWIDTH] >> 16) - 1 : -1;
+	}
+	uint SurfaceColor( const uint x, const uint z ) const
+	{
+		return surface && x < MAPWIDTH && z < MAPDEPTH ? surface[x + z * MAPWIDTH] & 0xffff : 0;
+	}
+	const uint* GetSurfaceMap() const { return surface; } // MAPWIDTH x MAPDEPTH entries of ((top + 1) << 16) + value
+	void SetDedupOnWrite( const bool enabled ) { dedupOnWrite = enabled; } // dedup dirty bricks at each commit
+	bool GetDedupOnWrite() const { return dedupOnWrite; }
+	void SaveSnapshot( WorldSnapshot& snapshot );
+	void LoadSnapshot( const WorldSnapshot& snapshot );
+	bool SaveSnapshotFile( const char* file, const uint64_t tag = 0, const void* user = 0, const size_t userSize = 0 );
+	bool LoadSnapshotFile( const char* file, const uint64_t tag = 0, void* user = 0, const size_t userSize = 0 );
+	bool ExportRegion( const char* file, const int3 pos, const int3 size ); // .vx sprite or .vox scene
 	// camera
 	void SetCameraMatrix( const mat4& m ) { camMat = m; }
 	float3 GetCameraViewDir() { return make_float3( camMat[2], camMat[6], camMat[10] ); }
@@ -185,6 +254,12 @@ public:
 	// render flow
 	void Commit();
 	void Render();
+	bool IsHeadless() const { return headless; }
+	uint GetDirtyBrickCount(); // bricks waiting to be committed
+	BrickStats GetBrickStats(); // scans the grid; meant for statistics, not for every frame
+	uint GetCommitBacklog() const { return commitBacklog; } // dirty bricks left after the last commit
+	uint GetCommitBudget() const { return commitBudget; } // bricks per frame, adapted to the transfer rate
+	float GetSyncEstimate() const { return syncEstimate; } // seconds until the backlog reaches the device
 	float GetRenderTime() { return renderTime; }
 	// high-level voxel access
 	void Sphere( const float x, const float y, const float z, const float r, const uint c );
@@ -206,9 +281,19 @@ public:
 	// inline ray tracing / cpu-only ray tracing / inline ray batch rendering
 	uint TraceRay( float4 A, const float4 B, float& dist, float3& N, int steps );
 	void TraceRayToVoid( float4 A, const float4 B, float& dist, float3& N );
+	// TraceBatch backends. BATCH_DEVICE is the default; headless worlds, which have no device, fall
+	// back to the CPU. BATCH_CPU and BATCH_AUTO (CPU for small batches) are opt-in per call: the CPU
+	// traces the host grid, where sprites and particles are erased again after Commit, so unlike
+	// the device it does not see them.
+	enum { BATCH_AUTO = 0, BATCH_DEVICE = 1, BATCH_CPU = 2 };
 	Ray* GetBatchBuffer();
-	Intersection* TraceBatch( const uint batchSize );
-	Intersection* TraceBatchToVoid( const uint batchSize );
+	Intersection* TraceBatch( const uint batchSize, const uint backend = BATCH_DEVICE );
+	Intersection* TraceBatchToVoid( const uint batchSize, const uint backend = BATCH_DEVICE );
+	bool BatchOnDevice( const uint batchSize, const uint backend ) const;
+	void TraceBatchCPU( const Ray* rays, Intersection* hits, const uint count ); // 8-ray AVX2 packets on all cores
+	void TraceBatchToVoidCPU( const Ray* rays, Intersection* hits, const uint count );
+	// headless rendering: render_whitted on the CPU, tone mapped like the display path
+	void RenderCPU( const mat4& M, uint* pixels, const int width, const int height );
 	// block scrolling
 	void ScrollX( const int offset );
 	void ScrollY( const int offset );
@@ -222,12 +307,75 @@ private:
 	void EraseParticles( const uint set );
 	void DrawParticles( const uint set );
 	void DrawTileVoxels( const uint cellIdx, const PAYLOAD* voxels, const uint zeroes );
+	bool MapBricks( HANDLE mapping, const uint64_t offset, const size_t bytes );
+	void AllocateBricks( void* base );
+	void BricksToPlaceholder();
+	void ReleaseBricks();
+	void ResetPool( const uint mappedPages );
+	void CommitPage( const uint page );
 	// convenient access to 'guaranteed to be instantiated' sprite, particle, tile lists
 	vector<Sprite*>& GetSpriteList() { return SpriteManager::GetSpriteManager()->sprite; }
 	vector<Particles*>& GetParticlesList() { return ParticlesManager::GetParticlesManager()->particles; }
 	vector<Tile*>& GetTileList() { return TileManager::GetTileManager()->tile; }
 	vector<BigTile*>& GetBigTileList() { return TileManager::GetTileManager()->bigTile; }
 public:
+	// host-side layout of grid cells (x, z, y) and brick voxels (x, y, z): linear, or with
+	// MORTONHOST, interleaved bits, so neighbours share cache lines. The device copy of
+	// both is always linear; Commit converts.
+	static __forceinline uint CellIndex( const uint bx, const uint by, const uint bz )
+	{
+	#if MORTONHOST == 1
+		return _pdep_u32( bx, 0x49249 ) | _pdep_u32( bz, 0x92492 ) | _pdep_u32( by, 0x124924 );
+	#else
+		return bx + bz * GRIDWIDTH + by * GRIDWIDTH * GRIDDEPTH;
+	#endif
+	}
+	static __forceinline int3 CellCoord( const uint cellIdx )
+	{
+	#if MORTONHOST == 1
+		return make_int3( _pext_u32( cellIdx, 0x49249 ), _pext_u32( cellIdx, 0x124924 ), _pext_u32( cellIdx, 0x92492 ) );
+	#else
+		return make_int3( cellIdx % GRIDWIDTH, cellIdx / (GRIDWIDTH * GRIDDEPTH), (cellIdx / GRIDWIDTH) % GRIDDEPTH );
+	#endif
+	}
+	static __forceinline uint VoxelIndex( const uint lx, const uint ly, const uint lz )
+	{
+	#if MORTONHOST == 1
+		return _pdep_u32( lx, 0x49 ) | _pdep_u32( ly, 0x92 ) | _pdep_u32( lz, 0x124 ); // as Morton3Bit in tools.cl
+	#else
+		return lx + ly * BRICKDIM + lz * BRICKDIM * BRICKDIM;
+	#endif
+	}
+	// host-side uber grid: a 64-bit mask per 4x4x4 grid cells, one bit per non-empty cell.
+	// Set keeps it exact; other writers may leave bits of emptied cells set, which only
+	// costs CPU traversal some speed.
+	static __forceinline uint UberIndex( const uint bx, const uint by, const uint bz )
+	{
+		return (bx >> 2) + (bz >> 2) * UBERWIDTH + (by >> 2) * UBERWIDTH * UBERDEPTH;
+	}
+	static __forceinline uint UberBit( const uint bx, const uint by, const uint bz )
+	{
+		return (bx & 3) + (bz & 3) * 4 + (by & 3) * 16;
+	}
+	__forceinline bool Occupied( const uint bx, const uint by, const uint bz ) const
+	{
+		return (occupancy[UberIndex( bx, by, bz )] >> UberBit( bx, by, bz )) & 1;
+	}
+	__forceinline void SetOccupied( const uint bx, const uint by, const uint bz )
+	{
+		atomic_ref<uint64_t>( occupancy[UberIndex( bx, by, bz )] ).fetch_or( 1ull << UberBit( bx, by, bz ), memory_order_relaxed );
+	}
+	__forceinline void ClearOccupied( const uint bx, const uint by, const uint bz )
+	{
+		atomic_ref<uint64_t>( occupancy[UberIndex( bx, by, bz )] ).fetch_and( ~(1ull << UberBit( bx, by, bz )), memory_order_relaxed );
+	}
+	// surface map maintenance for a single voxel write; a cleared top rescans the column below it
+	__forceinline void UpdateSurface( const uint x, const uint y, const uint z, const uint v )
+	{
+		uint& s = surface[x + z * MAPWIDTH];
+		if (v != 0 && y + 1 >= (s >> 16)) s = ((y + 1) << 16) + (v & 0xffff);
+		else if (v == 0 && y + 1 == (s >> 16)) s = ColumnTop( x, y, z );
+	}
 	// low-level voxel access
 	__forceinline uint Get( const uint x, const uint y, const uint z )
 	{
@@ -235,12 +383,14 @@ public:
 		const uint bx = (x / BRICKDIM) & (GRIDWIDTH - 1);
 		const uint by = (y / BRICKDIM) & (GRIDHEIGHT - 1);
 		const uint bz = (z / BRICKDIM) & (GRIDDEPTH - 1);
-		const uint cellIdx = bx + bz * GRIDWIDTH + by * GRIDWIDTH * GRIDDEPTH;
+		const uint cellIdx = CellIndex( bx, by, bz );
 		const uint g = grid[cellIdx];
 		if ((g & 1) == 0 /* this is currently a 'solid' grid cell */) return g >> 1;
 		// calculate the position of the voxel inside the brick
 		const uint lx = x & (BRICKDIM - 1), ly = y & (BRICKDIM - 1), lz = z & (BRICKDIM - 1);
-		return brick[(g >> 1) * BRICKSIZE + lx + ly * BRICKDIM + lz * BRICKDIM * BRICKDIM];
+		const uint voxel = VoxelIndex( lx, ly, lz );
+		if (packHandle && packHandle[g >> 1]) return PackedVoxel( packHandle[g >> 1], voxel );
+		return brick[(g >> 1) * BRICKSIZE + voxel];
 	}
 	__forceinline void Set( const uint x, const uint y, const uint z, const uint v /* actually an 8-bit value */ )
 	{
@@ -249,7 +399,8 @@ public:
 		const uint by = y / BRICKDIM;
 		const uint bz = z / BRICKDIM;
 		if (bx >= GRIDWIDTH || by >= GRIDHEIGHT || bz >= GRIDDEPTH) return;
-		const uint cellIdx = bx + bz * GRIDWIDTH + by * GRIDWIDTH * GRIDDEPTH;
+		if (surface) UpdateSurface( x, y, z, v );
+		const uint cellIdx = CellIndex( bx, by, bz );
 		// obtain current brick identifier from top-level grid
 		uint g = grid[cellIdx], g1 = g >> 1;
 		if ((g & 1) == 0 /* this is currently a 'solid' grid cell */)
@@ -281,11 +432,24 @@ public:
 		#endif
 			// we keep track of the number of zeroes, so we can remove fully zeroed bricks
 			brickInfo[newIdx].zeroes = g == 0 ? BRICKSIZE : 0;
+			if (g == 0) SetOccupied( bx, by, bz );
 			g1 = newIdx, grid[cellIdx] = g = (newIdx << 1) | 1;
 		}
+		else if (packHandle && atomic_ref<uint>( packHandle[g1] ).load( memory_order_acquire ))
+		{
+			// writes go to the plain brick; expand it first
+			UnpackBrick( g1 );
+		}
 		// calculate the position of the voxel inside the brick
 		const uint lx = x & (BRICKDIM - 1), ly = y & (BRICKDIM - 1), lz = z & (BRICKDIM - 1);
-		const uint voxelIdx = g1 * BRICKSIZE + lx + ly * BRICKDIM + lz * BRICKDIM * BRICKDIM;
+		uint voxelIdx = g1 * BRICKSIZE + VoxelIndex( lx, ly, lz );
+		if (brickRefs && atomic_ref<uint>( brickRefs[g1] ).load( memory_order_acquire ) > 0)
+		{
+			// the brick is shared with other cells: write to a private copy, if anything changes
+			if (brick[voxelIdx] == v) return;
+			const uint copy = UnshareBrick( cellIdx, g1 );
+			voxelIdx += (copy - g1) * BRICKSIZE, g1 = copy;
+		}
 		const uint cv = brick[voxelIdx];
 		if ((brickInfo[g1].zeroes += (cv != 0 && v == 0) - (cv == 0 && v != 0)) < BRICKSIZE)
 		{
@@ -294,37 +458,91 @@ public:
 			return;
 		}
 		grid[cellIdx] = 0;	// brick just became completely zeroed; recycle
+		ClearOccupied( bx, by, bz );
 		UnMark( g1 );		// no need to send it to GPU anymore
 		FreeBrick( g1 );
 	}
 private:
+	// per-thread brick magazines: NewBrick and FreeBrick work on a small thread-local stack
+	// and only touch the shared ring to move BRICKBATCH bricks at a time
+	struct MagazineOwner
+	{
+		MagazineOwner( World* world ) : world( world ) {}
+		mutex lock;							// held while bricks are handed back, and by ~World
+		World* world;						// null once the world is destroyed
+	};
+	struct BrickMagazine
+	{
+		~BrickMagazine() { Release(); }
+		void Release();						// hand the bricks back to the owner, if it still exists
+		shared_ptr<MagazineOwner> owner;	// world the bricks belong to
+		uint epoch = 0;						// owner's trashEpoch at the time of the last refill
+		uint count = 0;
+		uint brick[2 * BRICKBATCH];
+	};
+	static BrickMagazine& Magazine() { thread_local BrickMagazine magazine; return magazine; }
+	BrickMagazine& BoundMagazine()
+	{
+		BrickMagazine& m = Magazine();
+		if (m.owner != self || m.epoch != trashEpoch) BindMagazine( m );
+		return m;
+	}
+	void BindMagazine( BrickMagazine& m );
+	void RefillMagazine( BrickMagazine& m );
+	void FlushMagazine( BrickMagazine& m, const uint bricks );
 	uint NewBrick()
 	{
 	#if THREADSAFEWORLD
-		// get a fresh brick from the circular list in a thread-safe manner and without false sharing
-		const uint trashItem = InterlockedAdd( &trashTail, 31 ) - 31;
-		return trash[trashItem & (BRICKCOUNT - 1)];
+		BrickMagazine& m = BoundMagazine();
+		if (m.count == 0) RefillMagazine( m );
+		const uint idx = m.brick[--m.count];
 	#else
 		// slightly faster to not prevent false sharing if we're doing single core updates only
-		return trash[trashTail++ & (BRICKCOUNT - 1)];
+		const uint idx = trash[trashTail++ & (BRICKCOUNT - 1)];
 	#endif
+		// a sparse store commits the page of a brick when it is first handed out
+		if (sparsePool && !atomic_ref<uchar>( pageState[idx / POOLPAGE] ).load( memory_order_acquire )) CommitPage( idx / POOLPAGE );
+		return idx;
 	}
 	void FreeBrick( const uint idx )
 	{
 	#if THREADSAFEWORLD
-		// thread-safe access of the circular list
-		const uint trashItem = InterlockedAdd( &trashHead, 31 ) - 31;
-		trash[trashItem & (BRICKCOUNT - 1)] = idx;
+		BrickMagazine& m = BoundMagazine();
+		if (m.count == 2 * BRICKBATCH) FlushMagazine( m, BRICKBATCH );
+		m.brick[m.count++] = idx;
 	#else
 		// for single-threaded code, a stepsize of 1 maximizes cache coherence.
 		trash[trashHead++ & (BRICKCOUNT - 1)] = idx;
 	#endif
 	}
+	// per-thread dirty bitmaps: Mark is a plain write into the calling thread's own bitmap,
+	// MergeMarks ORs all of them into 'modified' once per commit
+	struct DirtyMap
+	{
+		uint64_t bits[BRICKCOUNT / 64];		// 1 bit per brick
+		uint64_t touched[BRICKCOUNT / 4096];	// 1 bit per non-zero word of bits
+		atomic<bool> released = false;		// the writer thread is gone; the map can be reused
+	};
+	struct DirtyMapRef
+	{
+		~DirtyMapRef() { if (map) map->released = true; }
+		uint serial = 0;					// world the map belongs to
+		shared_ptr<DirtyMap> map;
+	};
+	DirtyMap& LocalDirtyMap()
+	{
+		thread_local DirtyMapRef ref;
+		if (ref.serial != serial) BindDirtyMap( ref );
+		return *ref.map;
+	}
+	void BindDirtyMap( DirtyMapRef& ref );
+	void MergeMarks();
 	void Mark( const uint idx )
 	{
 	#if THREADSAFEWORLD
-		// be careful, setting a bit in an array is not thread-safe without _interlockedbittestandset
-		_interlockedbittestandset( (LONG*)modified + (idx >> 5), idx & 31 );
+		DirtyMap& m = LocalDirtyMap();
+		m.bits[idx >> 6] |= 1ull << (idx & 63);
+		m.touched[idx >> 12] |= 1ull << ((idx >> 6) & 63);
 	#else
 		modified[idx >> 5] |= 1 << (idx & 31);
 	#endif
@@ -332,16 +550,53 @@ private:
 	void UnMark( const uint idx )
 	{
 	#if THREADSAFEWORLD
-		// be careful, resetting a bit in an array is not thread-safe without _interlockedbittestandreset
-		_interlockedbittestandreset( (LONG*)modified + (idx >> 5), idx & 31 );
+		// clears the merged bit and our own; a stale bit in the bitmap of another thread
+		// only causes a redundant upload of whatever the brick holds at the next commit
+		LocalDirtyMap().bits[idx >> 6] &= ~(1ull << (idx & 63));
+		atomic_ref<uint>( modified[idx >> 5] ).fetch_and( ~(1u << (idx & 31)), memory_order_relaxed );
 	#else
 		modified[idx >> 5] &= 0xffffffffu - (1 << (idx & 31));
 	#endif
 	}
+	// content-addressed sharing: brickRefs counts the cells that use a brick besides the first;
+	// writers copy a shared brick first, and only the last user recycles it
+	uint UnshareBrick( const uint cellIdx, const uint idx );
+	void ReleaseBrick( const uint idx )
+	{
+		if (brickRefs) for (uint r = atomic_ref<uint>( brickRefs[idx] ).load(); r > 0;)
+			if (atomic_ref<uint>( brickRefs[idx] ).compare_exchange_weak( r, r - 1 )) return;
+		if (packHandle && packHandle[idx]) UnpackBrick( idx, false );
+		UnMark( idx );
+		FreeBrick( idx );
+	}
+	// palette-packed bricks: packHandle holds the first PACKUNIT of the palette and indices
+	// in packStore, << 2, plus 1, 2 or 3 for 1-, 2- or 4-bit indices; 0 for a plain brick.
+	// The plain brick keeps its slot, so indices in the grid and on the device stay valid.
+	__forceinline uint PackedVoxel( const uint handle, const uint voxel ) const
+	{
+		const uint bits = 1 << ((handle & 3) - 1);
+		const PAYLOAD* palette = (const PAYLOAD*)(packStore.data() + (handle >> 2));
+		const uchar* indices = (const uchar*)(palette + (1 << bits));
+		return palette[(indices[(voxel * bits) >> 3] >> ((voxel * bits) & 7)) & ((1 << bits) - 1)];
+	}
+	void DecodeBrick( const uint handle, PAYLOAD* voxels ) const;
+	const PAYLOAD* BrickVoxels( const uint idx, PAYLOAD* scratch ) const
+	{
+		// plain voxels of a brick; packed bricks are decoded into scratch
+		if (!packHandle || !packHandle[idx]) return brick + idx * BRICKSIZE;
+		DecodeBrick( packHandle[idx], scratch );
+		return scratch;
+	}
+	void UnpackBrick( const uint idx, const bool decode = true ); // back to a plain brick, or just drop the packed form
+	uint BricksInUse() const
+	{
+		// bricks taken from the ring, including those cached in magazines
+		return (trashTail - trashHead + BRICKCOUNT) / TRASHSTRIDE;
+	}
 	bool IsDirty( const uint idx ) { return (modified[idx >> 5] & (1 << (idx & 31))) > 0; }
 	bool IsDirty32( const uint idx ) { return modified[idx] != 0; }
 	void ClearMarks32( const uint idx ) { modified[idx] = 0; }
-	void ClearMarks() { memset( modified, 0, (BRICKCOUNT / 32) * 4 ); }
+	void ClearMarks();
 	// helpers
 	__forceinline static void StreamCopy( __m256i* dst, const __m256i* src, const uint bytes )
 	{
@@ -394,6 +649,10 @@ private:
 		}
 	}
 	void StreamCopyMT( __m256i* dst, __m256i* src, const uint bytes );
+	void LinearGrid( uint* dst );
+	uint GatherBricks( uint* staging, const uint budget = MAXCOMMITS );
+	void UpdateCommitBudget();
+	void SyncDirtyBricks();
 	// helper class for multithreaded memcpy
 	class CopyJob : public Job
 	{
@@ -402,19 +661,180 @@ private:
 		__m256i* dst, * src;
 		uint N;
 	};
+	// helper class for multithreaded merging of the dirty bitmaps: one range of words
+	class MergeJob : public Job
+	{
+	public:
+		void Main();
+		World* world;
+		uint first, last;					// range of words in DirtyMap::touched
+	};
+	// helper class for multithreaded brick gathering: one range of the modified bitfield
+	class GatherJob : public Job
+	{
+	public:
+		void Main();
+		World* world;
+		uint first, last;					// range of 64-bit words in the bitfield
+		uint offset;						// staging slot of the first brick in the range
+		uint* brickIndices;
+		uchar* changedBricks;
+	};
+	// helper class for multithreaded diff updates: one range of grid cells
+	class DiffJob : public Job
+	{
+	public:
+		void Main();
+		World* world;
+		uint first, last;					// grid cell range
+		uint changed;						// grid cells that differ from gridShadow
+	};
+	// helper class for multithreaded conversion of a morton-ordered grid to the linear device layout
+	class LayoutJob : public Job
+	{
+	public:
+		void Main();
+		const uint* src;
+		uint* dst;
+		uint first, last;					// range of linear cell indices
+	};
+	// helper class for multithreaded brick optimization: one slab of grid cells
+	class OptimizeJob : public Job
+	{
+	public:
+		void Main();
+		World* world;
+		uint first, last;					// grid cell range
+		bool dirtyOnly;						// only bricks waiting to be committed
+		uint replaced;						// bricks replaced by solid cells
+	};
+	// helper class for multithreaded CPU batch tracing: one range of 8-ray packets
+	void TracePackets( const Ray* rays, Intersection* hits, const uint count, const bool toVoid );
+	void TracePacket( const Ray* rays, Intersection* hits, const uint lanes, const bool toVoid );
+	class PacketJob : public Job
+	{
+	public:
+		void Main();
+		World* world;
+		const Ray* rays;
+		Intersection* hits;
+		uint count, first, last;			// batch size, range of packets
+		bool toVoid;
+	};
+	// helper class for the CPU renderer: every RENDERJOBS-th tile of the image
+	class RenderJob : public Job
+	{
+	public:
+		void Main();
+		World* world;
+		float3 E, p0, p1, p2;				// camera setup, as in World::Render
+		uint* pixels;
+		int width, height;
+		uint first, tiles;					// tiles first, first + RENDERJOBS, .. below tiles
+	};
+	// surface map helpers: the column top below a height, as a surface map entry
+	uint ColumnTop( const uint x, const uint below, const uint z );
+	void UpdateSurfaceCell( const uint cellIdx );
+	class SurfaceJob : public Job
+	{
+	public:
+		void Main();
+		World* world;
+		uint first, last;					// range of z rows
+	};
+	// helper class for multithreaded uber grid rebuilds: one range of uber cells
+	class OccupancyJob : public Job
+	{
+	public:
+		void Main();
+		World* world;
+		uint first, last;					// range of uber cells
+	};
+	// helper class for multithreaded brick dedup: hashes the bricks of a range of grid cells
+	class DedupJob : public Job
+	{
+	public:
+		void Main();
+		World* world;
+		uint first, last;					// grid cell range
+		bool dirtyOnly;						// skip bricks that are already committed
+		vector<uint64_t> hash;				// per hashed cell: hash of the brick contents
+		vector<uint> cell;
+	};
+	// helper class for multithreaded brick packing: encodes the bricks of a range of grid cells
+	struct PackUnit { alignas(PACKUNIT) uchar bytes[PACKUNIT]; };
+	class PackJob : public Job
+	{
+	public:
+		void Main();
+		World* world;
+		uint first, last;					// grid cell range
+		vector<uint> cell;					// per encoded brick: its grid cell
+		vector<uchar> bits;					// 0 for a uniform brick, else 1, 2 or 4
+		vector<uint> offset;				// first unit in 'units', or the value of a uniform brick
+		vector<PackUnit> units;				// encoded palettes and indices
+	};
+	// helper class for multithreaded region export: one range of grid cells
+	class RegionJob : public Job
+	{
+	public:
+		void Main();
+		World* world;
+		const uint* cell;					// grid cell indices of the range
+		uint cellCount;
+		int3 pos, size;						// region, clipped to the map
+		bool pack;							// deflate the draw list into two gzip members
+		uint count;							// voxels in the range
+		vector<uint> drawPos;				// region-relative positions, sprite encoding
+		vector<PAYLOAD> drawVal;
+		vector<uchar> member[2];			// packed drawPos and drawVal
+	};
 	// data members
 	mat4 camMat;						// camera matrix to be used for rendering
 	uint* grid = 0, * gridOrig = 0;		// pointer to host-side copy of the top-level grid
+	uint* gridShadow = 0;				// grid before BeginUpdate, compared against in EndUpdate
+	uint64_t* occupancy = 0;			// host-side uber grid, see UberIndex; used by TraceRay
+	uint* surface = 0;					// optional column-top map, see EnableSurfaceMap
+	bool updating = false;				// between BeginUpdate and EndUpdate
 #if ONEBRICKBUFFER == 1
 	Buffer* brickBuffer;				// OpenCL buffer for the bricks
 #else
 	Buffer* brickBuffer[4];				// OpenCL buffers for the bricks
 #endif
 	PAYLOAD* brick = 0;					// pointer to host-side copy of the bricks
+	void* brickView = 0;				// copy-on-write view of a snapshot file at the start of the brick store
+	void* brickRest = 0;				// remainder of the brick store after a mapped view
+	size_t viewBytes = 0;				// size of brickView
+	bool placeholderStore = false;		// the store address is held by a placeholder while views are swapped
+	bool sparsePool = false;			// headless worlds reserve the brick store and commit pages on demand
+	uchar* pageState = 0;				// per page: 0 = decommitted, 1 = committed, 1 + n = free for n trims
+	uint viewPages = 0;					// pages covered by brickView; those are never decommitted
+	uint trimCountdown = POOLTRIM;		// commits until the next TrimBricks call
+	size_t committedBytes = 0, peakCommitted = 0;
+	mutex poolLock;						// serializes CommitPage
+	uint* packHandle = 0;				// per brick: location of its packed form; allocated by PackBricks
+	vector<PackUnit> packStore;			// palettes and indices; only grows in PackBricks
+	vector<uint> packFree[3];			// free slots per index width, reused by PackBricks
+	uint packedBricks = 0;
+	mutex packLock;						// serializes UnpackBrick
 	uint* modified = 0;					// bitfield to mark bricks for synchronization
+	vector<shared_ptr<DirtyMap>> dirtyMaps;	// per-thread bitfields, merged into modified
+	mutex dirtyMapLock;
+	uint serial = ++worldCount;			// tells the dirty maps of different worlds apart
+	inline static atomic<uint> worldCount = 0;
 	BrickInfo* brickInfo = 0;			// maintenance data for bricks: zeroes, location
-	volatile inline static LONG trashHead = BRICKCOUNT;	// thrash circular buffer tail
-	volatile inline static LONG trashTail = 0;	// thrash circular buffer tail
+	uint* brickRefs = 0;				// per brick: cells sharing it besides the first; allocated by DedupBricks
+	unordered_map<uint64_t, uint> brickHashes; // brick content hash -> grid cell that holds such a brick
+	mutex shareLock;					// serializes copy-on-write of shared bricks
+	bool dedupOnWrite = false;			// Commit dedups the dirty bricks before gathering them
+	bool optimizeOnCommit = false;		// Commit replaces dirty uniform bricks by solid cells
+	bool gridDirty = false;				// grid changed without dirty bricks; Commit uploads it anyway
+	atomic<uint> trashHead = BRICKCOUNT;	// thrash circular buffer head
+	atomic<uint> trashTail = 0;			// thrash circular buffer tail
+	atomic<uint> trashEpoch = 1;		// bumped whenever the ring is rebuilt
+	atomic<uint> peakBricks = 0;		// highest BricksInUse since the ring was rebuilt
+	atomic<uint64_t> refills = 0, flushes = 0; // batch transfers between magazines and ring
+	shared_ptr<MagazineOwner> self = make_shared<MagazineOwner>( this ); // lets magazines of other threads outlive the world
 	uint* trash = 0;					// indices of recycled bricks
 	Buffer* screen = 0;					// OpenCL buffer that encapsulates the target OpenGL texture
 	uint targetTextureID = 0;			// OpenGL render target
@@ -423,6 +843,7 @@ private:
 	Buffer* history[2] = { 0 };			// OpenCL buffers for history data (previous frame)
 	Buffer* tmpFrame = 0;				// OpenCL buffer to store rendered frame in linear color space
 	Buffer* sky = 0;					// OpenCL buffer for a HDR skydome
+	float4* skyPixels = 0;				// host-side skydome, also for headless worlds
 	Buffer* blueNoise = 0;				// blue noise data
 	int2 skySize;						// size of the skydome bitmap
 	RenderParams params;				// CPU-side copy of the renderer parameters
@@ -440,12 +861,23 @@ private:
 	cl_event renderDone;				// event used for profiling
 	float renderTime;					// render time for the previous frame (in seconds)
 	uint tasks = 0;						// number of changed bricks, to be passed to commit kernel
+	uint commitBudget = MAXCOMMITS;		// bricks gathered per frame, at most MAXCOMMITS
+	uint commitBacklog = 0;				// dirty bricks postponed by the last commit
+	float uploadRate = 0;				// measured host-to-device rate, in bytes per second
+	float frameTime = 0;				// smoothed interval between commits, in seconds
+	float syncEstimate = 0;				// seconds until the backlog is on the device
+	Timer commitTimer;					// measures the interval between commits
+	cl_event uploadDone;				// last timed upload, for the transfer rate
+	size_t uploadBytes = 0;				// size of the timed upload; 0 if none pending
+	bool bulkSync = false;				// last commit uploaded a brick range directly
 	bool copyInFlight = false;			// flag for skipping async copy on first iteration
 	bool commitInFlight = false;		// flag to make next commit wait for previous to complete
 	cl_mem devmem = 0;					// device-side commit buffer
+	uint* pinnedMemPtr = 0;				// host-side staging buffer (pinned, unless headless)
 	cl_mem gridMap;						// device-side 3D image or buffer for top-level
 	Surface* font;						// bitmap font for print command
 	bool firstFrame = true;				// for doing things in the first frame
+	bool headless = false;				// no OpenCL / OpenGL: nothing gets rendered or sent to a device
 	float4 skyLight[6];					// integrated light for the 6 possible normals
 };
 
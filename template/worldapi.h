@@ -13,6 +13,8 @@ void Plot( const int3 pos, const uint c );
 uint Read( const int x, const int y, const int z );
 uint Read( const int3 pos );
 uint Read( const uint3 pos );
+int SurfaceHeight( const int x, const int z ); // highest solid y, -1 if none; see World::EnableSurfaceMap
+uint SurfaceColor( const int x, const int z );
 void Sphere( const float x, const float y, const float z, const float r, const uint c );
 void Sphere( const float3 pos, const float r, const uint c );
 void Box( const int x1, const int y1, const int z1, const int x2, const int y2, const int z2, const uint c );
@@ -93,7 +95,9 @@ uint BGR32to8( const uint c );
 uint RGB16to32( const uint c );
 float GetRenderTime();
 Ray* GetBatchBuffer();
-Intersection* TraceBatch( const uint batchSize );
-Intersection* TraceBatchToVoid( const uint batchSize );
+Intersection* TraceBatch( const uint batchSize, const uint backend = World::BATCH_DEVICE );
+Intersection* TraceBatchToVoid( const uint batchSize, const uint backend = World::BATCH_DEVICE );
+void TraceBatchCPU( const Ray* rays, Intersection* hits, const uint count );
+void TraceBatchToVoidCPU( const Ray* rays, Intersection* hits, const uint count );
 
 // EOF
\ No newline at end of file